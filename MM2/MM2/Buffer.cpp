@@ -4,8 +4,121 @@
 #include "Exception.h"
 #include "Logger.h"
 #include "Utils.h"
+#include "BufferPool.h"
+#include "ReceiveBufferPool.h"
+#include <new>
+#include <cstring>
 using namespace MessagingMesh;
 
+// Creates a Buffer instance.
+// The Buffer and its data are allocated from the BufferPool and are
+// returned to it when the last BufferPtr to the Buffer is released.
+BufferPtr Buffer::create()
+{
+    // We construct the Buffer in memory from the pool, and create the shared
+    // pointer with a deleter which returns it to the pool. The control block
+    // is also allocated from the pool...
+    auto pBuffer = new (BufferPool::allocate(sizeof(Buffer))) Buffer();
+    return BufferPtr(
+        pBuffer,
+        [](Buffer* p)
+        {
+            p->~Buffer();
+            BufferPool::release(p, sizeof(Buffer));
+        },
+        BufferPool::Allocator<Buffer>());
+}
+
+// Creates a read-only Buffer for a complete network message held in a buffer
+// from a ReceiveBufferPool. The data is not copied: the Buffer refers to it in
+// place and holds a reference to the receive buffer until it is destroyed.
+// - pReceiveBuffer is the start of the receive buffer.
+// - pMessage is the start of the message in it, and messageSize its size.
+BufferPtr Buffer::createView(char* pReceiveBuffer, char* pMessage, int32_t messageSize)
+{
+    auto pBuffer = create();
+    ReceiveBufferPool::addReference(pReceiveBuffer);
+    pBuffer->m_pReceiveBuffer = pReceiveBuffer;
+    pBuffer->m_pBuffer = pMessage;
+    pBuffer->m_bufferSize = messageSize;
+    pBuffer->m_dataSize = messageSize;
+    pBuffer->m_hasAllData = true;
+    return pBuffer;
+}
+
+// Creates read-only Buffers, as createView() does, for the frames in a buffer from a
+// ReceiveBufferPool, and adds them to views. The references to the receive buffer
+// for all the views are added together.
+void Buffer::createViews(char* pReceiveBuffer, const std::vector<NetworkMessageFrame>& frames, std::vector<BufferPtr>& views)
+{
+    if (frames.empty())
+    {
+        return;
+    }
+
+    // We add all the references with one atomic update, rather than one for each view...
+    ReceiveBufferPool::addReference(pReceiveBuffer, static_cast<int32_t>(frames.size()));
+    views.reserve(views.size() + frames.size());
+    for (auto& frame : frames)
+    {
+        auto pBuffer = create();
+        pBuffer->m_pReceiveBuffer = pReceiveBuffer;
+        pBuffer->m_pBuffer = pReceiveBuffer + frame.offset;
+        pBuffer->m_bufferSize = frame.size;
+        pBuffer->m_dataSize = frame.size;
+        pBuffer->m_hasAllData = true;
+        pBuffer->resetPosition();
+        views.push_back(std::move(pBuffer));
+    }
+}
+
+// If the Buffer is a view, replaces it with a Buffer holding a copy of its data, so
+// that it no longer holds a reference to the receive buffer. The view itself is not
+// changed, as it may be shared. The copy has the same position as the view.
+// Does nothing if the Buffer is not a view.
+void Buffer::detachView(BufferPtr& pBuffer)
+{
+    if (!pBuffer->isView())
+    {
+        return;
+    }
+
+    // We copy the data, including the size, into a buffer from the BufferPool...
+    auto dataSize = pBuffer->getBufferSize();
+    auto pCopy = create();
+    pCopy->allocateBuffer(dataSize);
+    std::memcpy(pCopy->m_pBuffer, pBuffer->getData(), dataSize);
+    pCopy->m_bufferSize = dataSize;
+    pCopy->m_dataSize = dataSize;
+    pCopy->m_hasAllData = true;
+    pCopy->m_position = pBuffer->m_position;
+    pBuffer = pCopy;
+}
+
+// Finds the complete network messages in the buffer from the position specified, and
+// adds their frames to frames. Returns the position after the last complete message,
+// ie the start of the first message whose data is not all in the buffer.
+size_t Buffer::scanNetworkMessages(const char* pBuffer, size_t bufferSize, size_t bufferPosition, std::vector<NetworkMessageFrame>& frames)
+{
+    // Each message starts with its size, so we cannot find where a message starts until
+    // we have read the size of the one before it. We make one pass over the sizes, with
+    // one (unaligned) load of each size and one check that the message is complete.
+    // (The size is read as-is as the messaging-mesh network protocol for int32 is
+    // little-endian.) A size which is too small is left for readNetworkMessage()...
+    while (bufferSize - bufferPosition >= SIZE_SIZE)
+    {
+        int32_t messageSize;
+        std::memcpy(&messageSize, pBuffer + bufferPosition, SIZE_SIZE);
+        if (messageSize < SIZE_SIZE || static_cast<size_t>(messageSize) > bufferSize - bufferPosition)
+        {
+            break;
+        }
+        frames.push_back(NetworkMessageFrame{ static_cast<int32_t>(bufferPosition), messageSize });
+        bufferPosition += messageSize;
+    }
+    return bufferPosition;
+}
+
 // Constructor.
 // NOTE: The constructor is private. Use Buffer::create() to create an instance.
 Buffer::Buffer()
@@ -15,27 +128,40 @@ Buffer::Buffer()
 // Destructor.
 Buffer::~Buffer()
 {
-    delete[] m_pBuffer;
+    releaseBuffer();
 }
 
 // Gets the buffer.
 char* Buffer::getBuffer()
+{
+    finalizeSize();
+    return m_pBuffer;
+}
+
+// Writes the data size to the first four bytes of the buffer. This must be called
+// before the buffer is shared with other threads, for example before it is written
+// to sockets. (It does nothing for a view, which already holds its size.)
+void Buffer::finalizeSize()
 {
     // If the buffer has not yet been allocated we allocate a buffer to hold the
     // size, as client code is always expecting a buffer with at least a size at
     // the start of the buffer...
     if (!m_pBuffer)
     {
-        m_pBuffer = new char[SIZE_SIZE];
-        m_bufferSize = SIZE_SIZE;
+        allocateBuffer(SIZE_SIZE);
+        m_bufferSize = m_capacity;
+    }
+
+    // A view already holds the size of the message it refers to, and must
+    // not be written to as the data may be shared with other threads...
+    if (m_pReceiveBuffer)
+    {
+        return;
     }
 
     // We update the data size, stored in the first four bytes of the buffer...
     int32_t size = m_dataSize;
     std::memcpy(m_pBuffer, &size, sizeof(size));
-
-    // We return the buffer...
-    return m_pBuffer;
 }
 
 // Reads an int8 from the buffer.
@@ -94,6 +220,158 @@ void Buffer::write_double(double item)
     writeCopyable(item);
 }
 
+// Decodes a LEB128 varint from the data. Returns the number of bytes read, or zero
+// if the data does not start with a complete varint of at most ten bytes.
+int32_t Buffer::decodeVarint(const char* pData, int32_t dataSize, uint64_t& value)
+{
+    value = 0;
+    auto maxSize = dataSize < 10 ? dataSize : 10;
+    for (int32_t i = 0; i < maxSize; ++i)
+    {
+        auto byte = static_cast<uint8_t>(pData[i]);
+        value |= static_cast<uint64_t>(byte & 0x7f) << (7 * i);
+        if ((byte & 0x80) == 0)
+        {
+            return i + 1;
+        }
+    }
+    return 0;
+}
+
+// Reads a signed int64 from the buffer.
+int64_t Buffer::read_int64()
+{
+    int64_t result;
+    readCopyable(result);
+    return result;
+}
+
+// Writes a signed int64 to the buffer.
+void Buffer::write_int64(int64_t item)
+{
+    writeCopyable(item);
+}
+
+// Reads an unsigned int64 from the buffer.
+uint64_t Buffer::read_uint64()
+{
+    uint64_t result;
+    readCopyable(result);
+    return result;
+}
+
+// Writes an unsigned int64 to the buffer.
+void Buffer::write_uint64(uint64_t item)
+{
+    writeCopyable(item);
+}
+
+// Reads a bool from the buffer.
+bool Buffer::read_bool()
+{
+    return read_int8() != 0;
+}
+
+// Writes a bool to the buffer.
+// Bools are serialized as an int8 holding 1 or 0.
+void Buffer::write_bool(bool item)
+{
+    write_int8(item ? 1 : 0);
+}
+
+// Writes an unsigned integer to the buffer as a LEB128 varint.
+void Buffer::write_varint(uint64_t item)
+{
+    // Each byte holds seven bits of the value, starting with the lowest bits.
+    // The top bit is set on every byte except the last...
+    char bytes[10];
+    int32_t size = 0;
+    while (item >= 0x80)
+    {
+        bytes[size++] = static_cast<char>((item & 0x7f) | 0x80);
+        item >>= 7;
+    }
+    bytes[size++] = static_cast<char>(item);
+    write_bytes(bytes, size);
+}
+
+// Reads a LEB128 varint from the buffer.
+uint64_t Buffer::read_varint()
+{
+    uint64_t result;
+    auto size = decodeVarint(m_pBuffer + m_position, m_dataSize - m_position, result);
+    if (size == 0)
+    {
+        throw Exception("Buffer does not hold a valid varint");
+    }
+    updatePosition_Read(size);
+    return result;
+}
+
+// Writes a signed integer to the buffer as a zig-zag encoded LEB128 varint.
+void Buffer::write_signed_varint(int64_t item)
+{
+    // Zig-zag encoding maps small negative numbers to small positive ones
+    // (0, -1, 1, -2... to 0, 1, 2, 3...) so that they encode to few bytes...
+    auto value = static_cast<uint64_t>(item);
+    write_varint((value << 1) ^ (item < 0 ? ~uint64_t(0) : 0));
+}
+
+// Reads a zig-zag encoded LEB128 varint from the buffer.
+int64_t Buffer::read_signed_varint()
+{
+    auto value = read_varint();
+    return static_cast<int64_t>((value >> 1) ^ (~(value & 1) + 1));
+}
+
+// Reads a byte array from the buffer.
+std::vector<uint8_t> Buffer::read_byte_array()
+{
+    return readArray<uint8_t>();
+}
+
+// Writes a byte array to the buffer.
+void Buffer::write_byte_array(const std::vector<uint8_t>& items)
+{
+    writeArray(items);
+}
+
+// Reads a double array from the buffer.
+std::vector<double> Buffer::read_double_array()
+{
+    return readArray<double>();
+}
+
+// Writes a double array to the buffer.
+void Buffer::write_double_array(const std::vector<double>& items)
+{
+    writeArray(items);
+}
+
+// Reads a signed int32 array from the buffer.
+std::vector<int32_t> Buffer::read_int32_array()
+{
+    return readArray<int32_t>();
+}
+
+// Writes a signed int32 array to the buffer.
+void Buffer::write_int32_array(const std::vector<int32_t>& items)
+{
+    writeArray(items);
+}
+
+// Reads a signed int64 array from the buffer.
+std::vector<int64_t> Buffer::read_int64_array()
+{
+    return readArray<int64_t>();
+}
+
+// Writes a signed int64 array to the buffer.
+void Buffer::write_int64_array(const std::vector<int64_t>& items)
+{
+    writeArray(items);
+}
+
 // Reads a string from the buffer.
 std::string Buffer::read_string()
 {
@@ -171,21 +449,23 @@ void Buffer::write_field(const ConstFieldPtr& item)
     item->serialize(*this);
 }
 
-// Reads a message from the buffer.
-ConstMessagePtr Buffer::read_message()
+// Reads a message with the encoding specified from the buffer. If pFieldNames is not
+// null, field names are read using the dictionary (see FieldNameDictionary).
+ConstMessagePtr Buffer::read_message(MessageEncoding encoding, FieldNameDictionary* pFieldNames)
 {
     // We create a new message and deserialize into it...
     auto message = Message::create();
-    message->deserialize(*this);
+    message->deserialize(*this, encoding, pFieldNames);
     return message;
 }
 
-// Writes a message to the buffer.
-void Buffer::write_message(const ConstMessagePtr& item)
+// Writes a message to the buffer, with the encoding specified. If pFieldNames is not
+// null, field names are written using the dictionary (see FieldNameDictionary).
+void Buffer::write_message(const ConstMessagePtr& item, MessageEncoding encoding, FieldNameDictionary* pFieldNames)
 {
     // We call the message's serialize() method. This calls back into the buffer
     // to write the data for the message and the fields it is managing...
-    item->serialize(*this);
+    item->serialize(*this, encoding, pFieldNames);
 }
 
 // Reads an item from the buffer using memcpy.
@@ -218,6 +498,40 @@ void Buffer::writeCopyable(const T& item)
     updatePosition_Write(static_cast<int32_t>(size));
 }
 
+// Reads an array of items which can be read with memcpy from the buffer.
+template <typename T>
+std::vector<T> Buffer::readArray()
+{
+    // Arrays are serialized as [count][items]. We check the count against the
+    // data in the buffer before allocating the array...
+    auto count = read_int32();
+    if (count < 0 || static_cast<size_t>(count) > static_cast<size_t>(m_dataSize - m_position) / sizeof(T))
+    {
+        throw Exception("Buffer is not large enough to read requested data");
+    }
+
+    // We read all the items with one copy...
+    std::vector<T> result(count);
+    if (count > 0)
+    {
+        read_bytes(result.data(), static_cast<int32_t>(count * sizeof(T)));
+    }
+    return result;
+}
+
+// Writes an array of items which can be written with memcpy to the buffer.
+template <typename T>
+void Buffer::writeArray(const std::vector<T>& items)
+{
+    // Arrays are serialized as [count][items], with the items written with one copy...
+    auto count = static_cast<int32_t>(items.size());
+    write_int32(count);
+    if (count > 0)
+    {
+        write_bytes(items.data(), static_cast<int32_t>(count * sizeof(T)));
+    }
+}
+
 // Checks that the buffer is large enough to read the specified number of bytes.
 // Throws a MessagingMesh::Exception if the buffer is not large enough.
 void Buffer::checkBufferSize_Read(size_t bytesRequired)
@@ -234,6 +548,12 @@ void Buffer::checkBufferSize_Read(size_t bytesRequired)
 // Throws a MessagingMesh::Exception if the buffer required is too large.
 void Buffer::checkBufferSize_Write(size_t bytesRequired)
 {
+    // Views of received messages are read-only...
+    if (m_pReceiveBuffer)
+    {
+        throw Exception("Buffer is a read-only view of a received message");
+    }
+
     // We check if we can fit the bytes-required into the buffer at the current position...
     if (m_position + bytesRequired <= m_bufferSize)
     {
@@ -259,22 +579,50 @@ void Buffer::expandBuffer()
     // If the buffer has not yet been allocated, we allocate the initial size...
     if (!m_pBuffer)
     {
-        m_pBuffer = new char[INITIAL_SIZE];
-        m_bufferSize = INITIAL_SIZE;
+        allocateBuffer(INITIAL_SIZE);
+        m_bufferSize = m_capacity;
         return;
     }
 
     // We create a new buffer double the size and copy the existing data into it...
     auto newBufferSize = m_bufferSize * 2;
-    auto newBuffer = new char[newBufferSize];
+    auto newCapacity = static_cast<int32_t>(BufferPool::getCapacity(newBufferSize));
+    auto newBuffer = static_cast<char*>(BufferPool::allocate(newCapacity));
     std::memcpy(newBuffer, m_pBuffer, m_bufferSize);
 
-    // We delete the old buffer...
-    delete[] m_pBuffer;
+    // We release the old buffer...
+    releaseBuffer();
 
     // We use the new buffer...
     m_pBuffer = newBuffer;
-    m_bufferSize = newBufferSize;
+    m_capacity = newCapacity;
+    m_bufferSize = newCapacity;
+}
+
+// Allocates a byte-array from the BufferPool with at least the size specified,
+// releasing the current one. Sets m_capacity to the size allocated.
+void Buffer::allocateBuffer(int32_t size)
+{
+    releaseBuffer();
+    m_capacity = static_cast<int32_t>(BufferPool::getCapacity(size));
+    m_pBuffer = static_cast<char*>(BufferPool::allocate(m_capacity));
+}
+
+// Releases the byte-array to the BufferPool, or the reference to the receive
+// buffer if this is a view.
+void Buffer::releaseBuffer()
+{
+    if (m_pReceiveBuffer)
+    {
+        ReceiveBufferPool::release(m_pReceiveBuffer);
+        m_pReceiveBuffer = nullptr;
+    }
+    else
+    {
+        BufferPool::release(m_pBuffer, m_capacity);
+    }
+    m_pBuffer = nullptr;
+    m_capacity = 0;
 }
 
 // Updates the position to reflect bytes read from the buffer.
@@ -360,8 +708,17 @@ size_t Buffer::readNetworkMessageSize(const char* pBuffer, size_t bufferSize, si
         return 0;
     }
 
-    // We read as many bytes as we can for the size from the buffer...
+    // If we have not read any of the size and all of it is in the buffer, we read it
+    // with one copy rather than byte-by-byte...
     int32_t bytesRead = 0;
+    if (m_networkMessageSizeBufferPosition == 0 && bufferSize - bufferPosition >= SIZE_SIZE)
+    {
+        std::memcpy(&m_networkMessageSizeBuffer[0], pBuffer + bufferPosition, SIZE_SIZE);
+        m_networkMessageSizeBufferPosition = SIZE_SIZE;
+        bytesRead = SIZE_SIZE;
+    }
+
+    // Otherwise we read as many bytes as we can for the size from the buffer...
     while (m_networkMessageSizeBufferPosition < SIZE_SIZE)
     {
         if (bufferPosition >= bufferSize) break;
@@ -376,10 +733,12 @@ size_t Buffer::readNetworkMessageSize(const char* pBuffer, size_t bufferSize, si
         // the messaging-mesh network protocol for int32 is little-endian.)
         std::memcpy(&m_bufferSize, &m_networkMessageSizeBuffer[0], SIZE_SIZE);
 
-        // We allocate the data buffer for the size...
-        delete[] m_pBuffer;
+        // We allocate the data buffer for the size, and copy the size into it. The
+        // buffer may be forwarded to other sockets as it is, so the size is written
+        // here on the thread which received it...
         m_dataSize = m_bufferSize;
-        m_pBuffer = new char[m_bufferSize];
+        allocateBuffer(m_bufferSize);
+        std::memcpy(m_pBuffer, &m_networkMessageSizeBuffer[0], SIZE_SIZE);
 
         // We make sure that the position is four bytes from the start of the buffer.
         // The first four bytes are reserved for the size itself. The data will be
@@ -3,9 +3,13 @@
 #include <vector>
 #include <string>
 #include "SharedPointers.h"
+#include "MessageEncoding.h"
 
 namespace MessagingMesh
 {
+    // Forward declarations...
+    class FieldNameDictionary;
+
     /// <summary>
     /// A binary buffer managing a byte-array, holding for example the network 
     /// serialization of a NetworkMessage.
@@ -74,14 +78,69 @@ namespace MessagingMesh
     /// NOTE: This is the size of the data itself, not including the size.
     ///       So it is m_dataSize - INITIAL_POSITION.
     /// 
-    /// The size is added to the buffer when the getBuffer() method is called.
+    /// The size is added to the buffer when the getBuffer() or finalizeSize() methods
+    /// are called. A Buffer may be written to several sockets, which read it on their
+    /// own threads, so the size is finalized once by the thread which created it before
+    /// it is shared (NetworkMessage::serialize() does this), and code which may share a
+    /// Buffer reads it with getData(), which does not write to it.
+    /// 
+    /// Pooling
+    /// -------
+    /// Buffer objects, their shared_ptr control blocks and their byte-arrays are
+    /// allocated from the BufferPool, as we create Buffers for every message sent
+    /// and received.
+    /// 
+    /// Views of received messages
+    /// --------------------------
+    /// When a Socket receives one or more complete messages in one read it does not copy
+    /// them into new Buffers. Instead it creates read-only views (see createView()) which
+    /// refer to the data in the receive buffer. Only messages which arrive across more
+    /// than one read are copied. Writing to a view throws a MessagingMesh::Exception.
     /// </summary>
     class Buffer
     {
+    // Public types...
+    public:
+        // The position and size of a complete network message in a receive buffer.
+        struct NetworkMessageFrame
+        {
+            int32_t offset;
+            int32_t size;
+        };
+
     // Public methods...
     public:
         // Creates a Buffer instance.
-        static BufferPtr create() { return BufferPtr(new Buffer()); }
+        // The Buffer and its data are allocated from the BufferPool and are
+        // returned to it when the last BufferPtr to the Buffer is released.
+        static BufferPtr create();
+
+        // Creates a read-only Buffer for a complete network message held in a buffer
+        // from a ReceiveBufferPool. The data is not copied: the Buffer refers to it in
+        // place and holds a reference to the receive buffer until it is destroyed.
+        // - pReceiveBuffer is the start of the receive buffer.
+        // - pMessage is the start of the message in it, and messageSize its size.
+        static BufferPtr createView(char* pReceiveBuffer, char* pMessage, int32_t messageSize);
+
+        // Creates read-only Buffers, as createView() does, for the frames in a buffer from a
+        // ReceiveBufferPool, and adds them to views. The references to the receive buffer
+        // for all the views are added together.
+        static void createViews(char* pReceiveBuffer, const std::vector<NetworkMessageFrame>& frames, std::vector<BufferPtr>& views);
+
+        // If the Buffer is a view, replaces it with a Buffer holding a copy of its data, so
+        // that it no longer holds a reference to the receive buffer. The view itself is not
+        // changed, as it may be shared. The copy has the same position as the view.
+        // Does nothing if the Buffer is not a view.
+        static void detachView(BufferPtr& pBuffer);
+
+        // Finds the complete network messages in the buffer from the position specified, and
+        // adds their frames to frames. Returns the position after the last complete message,
+        // ie the start of the first message whose data is not all in the buffer.
+        static size_t scanNetworkMessages(const char* pBuffer, size_t bufferSize, size_t bufferPosition, std::vector<NetworkMessageFrame>& frames);
+
+        // Decodes a LEB128 varint from the data. Returns the number of bytes read, or zero
+        // if the data does not start with a complete varint of at most ten bytes.
+        static int32_t decodeVarint(const char* pData, int32_t dataSize, uint64_t& value);
 
         // Destructor.
         ~Buffer();
@@ -89,9 +148,22 @@ namespace MessagingMesh
         // Gets the buffer.
         char* getBuffer();
 
+        // Gets the data, including the size, without updating the size. This does not
+        // write to the buffer, so it can be called from multiple threads. The size must
+        // already have been written by finalizeSize() or getBuffer().
+        const char* getData() const { return m_pBuffer; }
+
+        // Writes the data size to the first four bytes of the buffer. This must be called
+        // before the buffer is shared with other threads, for example before it is written
+        // to sockets. (It does nothing for a view, which already holds its size.)
+        void finalizeSize();
+
         // Gets the size of the data stored in the buffer.
         // This includes the four bytes for the size plus the data.
-        int32_t getBufferSize() { return m_dataSize; }
+        int32_t getBufferSize() const { return m_dataSize; }
+
+        // Returns true if the Buffer is a view of data in a receive buffer (see createView()).
+        bool isView() const { return m_pReceiveBuffer != nullptr; }
 
         // Resets the position to the initial position for reading data.
         // Note: This is the position after the size.
@@ -125,17 +197,45 @@ namespace MessagingMesh
         // Writes a double to the buffer.
         void write_double(double item);
 
+        // Writes a signed int64 to the buffer.
+        void write_int64(int64_t item);
+
+        // Writes an unsigned int64 to the buffer.
+        void write_uint64(uint64_t item);
+
+        // Writes a bool to the buffer.
+        void write_bool(bool item);
+
+        // Writes an unsigned integer to the buffer as a LEB128 varint.
+        void write_varint(uint64_t item);
+
+        // Writes a signed integer to the buffer as a zig-zag encoded LEB128 varint.
+        void write_signed_varint(int64_t item);
+
         // Writes a string to the buffer.
         void write_string(const std::string& item);
 
         // Writes bytes to the buffer from the pointer passed in.
         void write_bytes(const void* p, int32_t size);
 
+        // Writes a byte array to the buffer.
+        void write_byte_array(const std::vector<uint8_t>& items);
+
+        // Writes a double array to the buffer.
+        void write_double_array(const std::vector<double>& items);
+
+        // Writes a signed int32 array to the buffer.
+        void write_int32_array(const std::vector<int32_t>& items);
+
+        // Writes a signed int64 array to the buffer.
+        void write_int64_array(const std::vector<int64_t>& items);
+
         // Writes a field to the buffer.
         void write_field(const ConstFieldPtr& item);
 
-        // Writes a message to the buffer.
-        void write_message(const ConstMessagePtr& item);
+        // Writes a message to the buffer, with the encoding specified. If pFieldNames is not
+        // null, field names are written using the dictionary (see FieldNameDictionary).
+        void write_message(const ConstMessagePtr& item, MessageEncoding encoding = MessageEncoding::STANDARD, FieldNameDictionary* pFieldNames = nullptr);
 
     // read() method for various types...
     public:
@@ -151,6 +251,21 @@ namespace MessagingMesh
         // Reads a double from the buffer.
         double read_double();
 
+        // Reads a signed int64 from the buffer.
+        int64_t read_int64();
+
+        // Reads an unsigned int64 from the buffer.
+        uint64_t read_uint64();
+
+        // Reads a bool from the buffer.
+        bool read_bool();
+
+        // Reads a LEB128 varint from the buffer.
+        uint64_t read_varint();
+
+        // Reads a zig-zag encoded LEB128 varint from the buffer.
+        int64_t read_signed_varint();
+
         // Reads a string from the buffer.
         std::string read_string();
 
@@ -158,11 +273,24 @@ namespace MessagingMesh
         // NOTE: You must make sure that the memory pointed to is large enough.
         void read_bytes(void* p, int32_t size);
 
+        // Reads a byte array from the buffer.
+        std::vector<uint8_t> read_byte_array();
+
+        // Reads a double array from the buffer.
+        std::vector<double> read_double_array();
+
+        // Reads a signed int32 array from the buffer.
+        std::vector<int32_t> read_int32_array();
+
+        // Reads a signed int64 array from the buffer.
+        std::vector<int64_t> read_int64_array();
+
         // Reads a field from the buffer.
         ConstFieldPtr read_field();
 
-        // Reads a message from the buffer.
-        ConstMessagePtr read_message();
+        // Reads a message with the encoding specified from the buffer. If pFieldNames is not
+        // null, field names are read using the dictionary (see FieldNameDictionary).
+        ConstMessagePtr read_message(MessageEncoding encoding = MessageEncoding::STANDARD, FieldNameDictionary* pFieldNames = nullptr);
 
     // Private functions...
     private:
@@ -176,6 +304,12 @@ namespace MessagingMesh
         // Writes an item to the buffer which can be written with memcpy.
         template <typename T> void writeCopyable(const T& item);
 
+        // Reads an array of items which can be read with memcpy from the buffer.
+        template <typename T> std::vector<T> readArray();
+
+        // Writes an array of items which can be written with memcpy to the buffer.
+        template <typename T> void writeArray(const std::vector<T>& items);
+
         // Checks that the buffer is large enough to read the specified number of bytes.
         // Throws a MessagingMesh::Exception if the buffer is not large enough.
         void checkBufferSize_Read(size_t bytesRequired);
@@ -188,6 +322,14 @@ namespace MessagingMesh
         // Expands the buffer by doubling its size.
         void expandBuffer();
 
+        // Allocates a byte-array from the BufferPool with at least the size specified,
+        // releasing the current one. Sets m_capacity to the size allocated.
+        void allocateBuffer(int32_t size);
+
+        // Releases the byte-array to the BufferPool, or the reference to the receive
+        // buffer if this is a view.
+        void releaseBuffer();
+
         // Updates the position to reflect bytes read from the buffer.
         void updatePosition_Read(int32_t bytesWritten);
 
@@ -203,13 +345,21 @@ namespace MessagingMesh
         // start of the buffer...
         static const int SIZE_SIZE = 4;
 
-        // The initial size we allocate for the buffer...
-        const int32_t INITIAL_SIZE = 8192;
+        // The initial size we allocate for the buffer. Most messages are small, and as
+        // the buffer comes from the BufferPool expanding it is relatively cheap...
+        const int32_t INITIAL_SIZE = 256;
 
         // The buffer...
         char* m_pBuffer = nullptr;
         int32_t m_bufferSize = 0;
 
+        // The size of the byte-array allocated for the buffer. This can be larger than
+        // m_bufferSize, as allocations are rounded up to a BufferPool size class.
+        int32_t m_capacity = 0;
+
+        // For a view, the receive buffer holding the data. Null if this is not a view.
+        char* m_pReceiveBuffer = nullptr;
+
         // The current position at which data will be written.
         // This starts after the bytes reserved for the size.
         int32_t m_position = SIZE_SIZE;
@@ -0,0 +1,181 @@
+#include "BufferPool.h"
+#include <new>
+#include <algorithm>
+using namespace MessagingMesh;
+
+// True once the cache for the current thread has been destroyed.
+static thread_local bool threadCacheDestroyed = false;
+
+// Allocates a block of at least the size specified.
+void* BufferPool::allocate(size_t size)
+{
+    // Large blocks are allocated from the heap...
+    auto sizeClass = getSizeClass(size);
+    if (sizeClass < 0)
+    {
+        return ::operator new(size);
+    }
+
+    auto pThreadCache = getThreadCache();
+    if (!pThreadCache)
+    {
+        return ::operator new(getClassSize(sizeClass));
+    }
+
+    // If the thread's cache is empty we take a batch of blocks from the central list...
+    auto& freeList = pThreadCache->freeLists[sizeClass];
+    if (!freeList.pHead)
+    {
+        auto& centralList = getCentralList(sizeClass);
+        std::lock_guard<std::mutex> lock(centralList.mutex);
+        moveBlocks(centralList.freeList, freeList, getThreadCacheLimit(sizeClass) / 2);
+    }
+
+    // If there are still no free blocks we allocate a new one...
+    if (!freeList.pHead)
+    {
+        return ::operator new(getClassSize(sizeClass));
+    }
+
+    // We take the first free block...
+    auto pBlock = freeList.pHead;
+    freeList.pHead = pBlock->pNext;
+    freeList.count--;
+    return pBlock;
+}
+
+// Releases a block. The size must be the size passed to allocate(), or the
+// capacity returned by getCapacity() for it.
+void BufferPool::release(void* p, size_t size)
+{
+    if (!p) return;
+
+    // Large blocks are returned to the heap, as are blocks released while
+    // the thread is exiting...
+    auto sizeClass = getSizeClass(size);
+    auto pThreadCache = (sizeClass < 0) ? nullptr : getThreadCache();
+    if (!pThreadCache)
+    {
+        ::operator delete(p);
+        return;
+    }
+
+    // We add the block to the thread's cache...
+    auto& freeList = pThreadCache->freeLists[sizeClass];
+    auto pBlock = static_cast<FreeBlock*>(p);
+    pBlock->pNext = freeList.pHead;
+    freeList.pHead = pBlock;
+    freeList.count++;
+
+    // If the cache is full we move half of it to the central list (and the
+    // heap if the central list is also full)...
+    auto threadCacheLimit = getThreadCacheLimit(sizeClass);
+    if (freeList.count > threadCacheLimit)
+    {
+        FreeList overflow;
+        moveBlocks(freeList, overflow, threadCacheLimit / 2);
+        {
+            auto& centralList = getCentralList(sizeClass);
+            auto centralListLimit = CENTRAL_LIST_BYTES / getClassSize(sizeClass);
+            std::lock_guard<std::mutex> lock(centralList.mutex);
+            if (centralList.freeList.count < centralListLimit)
+            {
+                moveBlocks(overflow, centralList.freeList, centralListLimit - centralList.freeList.count);
+            }
+        }
+        freeBlocks(overflow);
+    }
+}
+
+// Returns the size of the block which will be allocated for the size requested.
+size_t BufferPool::getCapacity(size_t size)
+{
+    auto sizeClass = getSizeClass(size);
+    return (sizeClass < 0) ? size : getClassSize(sizeClass);
+}
+
+// Returns the size class for the size, or -1 if it is too large to be pooled.
+int BufferPool::getSizeClass(size_t size)
+{
+    if (size > getClassSize(NUM_SIZE_CLASSES - 1))
+    {
+        return -1;
+    }
+    int sizeClass = 0;
+    while (getClassSize(sizeClass) < size)
+    {
+        sizeClass++;
+    }
+    return sizeClass;
+}
+
+// Returns the maximum number of blocks held by a thread cache for a size class.
+size_t BufferPool::getThreadCacheLimit(int sizeClass)
+{
+    auto limit = THREAD_CACHE_BYTES / getClassSize(sizeClass);
+    return std::min(std::max(limit, (size_t)4), (size_t)256);
+}
+
+// Moves up to count blocks from one list to another.
+void BufferPool::moveBlocks(FreeList& from, FreeList& to, size_t count)
+{
+    for (size_t i = 0; i < count && from.pHead; ++i)
+    {
+        auto pBlock = from.pHead;
+        from.pHead = pBlock->pNext;
+        from.count--;
+        pBlock->pNext = to.pHead;
+        to.pHead = pBlock;
+        to.count++;
+    }
+}
+
+// Frees the blocks in a list.
+void BufferPool::freeBlocks(FreeList& freeList)
+{
+    while (freeList.pHead)
+    {
+        auto pBlock = freeList.pHead;
+        freeList.pHead = pBlock->pNext;
+        ::operator delete(pBlock);
+    }
+    freeList.count = 0;
+}
+
+// Gets the cache for the current thread.
+// Returns nullptr if the thread's cache has already been destroyed, as can happen
+// if a Buffer is released while the thread is exiting.
+BufferPool::ThreadCache* BufferPool::getThreadCache()
+{
+    if (threadCacheDestroyed) return nullptr;
+    static thread_local ThreadCache threadCache;
+    return &threadCache;
+}
+
+// Gets the central list for a size class.
+BufferPool::CentralList& BufferPool::getCentralList(int sizeClass)
+{
+    // We never delete the central lists, so that they are available to
+    // threads which exit while the process is shutting down...
+    static CentralList* pCentralLists = new CentralList[NUM_SIZE_CLASSES];
+    return pCentralLists[sizeClass];
+}
+
+// Destructor. Returns the cached blocks to the central lists.
+BufferPool::ThreadCache::~ThreadCache()
+{
+    threadCacheDestroyed = true;
+    for (int sizeClass = 0; sizeClass < NUM_SIZE_CLASSES; ++sizeClass)
+    {
+        auto& centralList = getCentralList(sizeClass);
+        auto centralListLimit = CENTRAL_LIST_BYTES / getClassSize(sizeClass);
+        {
+            std::lock_guard<std::mutex> lock(centralList.mutex);
+            if (centralList.freeList.count < centralListLimit)
+            {
+                moveBlocks(freeLists[sizeClass], centralList.freeList, centralListLimit - centralList.freeList.count);
+            }
+        }
+        freeBlocks(freeLists[sizeClass]);
+    }
+}
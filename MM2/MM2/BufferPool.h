@@ -0,0 +1,142 @@
+#pragma once
+#include <cstddef>
+#include <mutex>
+
+namespace MessagingMesh
+{
+    /// <summary>
+    /// A pool of memory blocks used for Buffer objects and the data they hold.
+    /// 
+    /// We create Buffers for every message sent and received, each of which needs
+    /// the Buffer object, its shared_ptr control block and the byte-array for the
+    /// data. Rather than allocating and freeing these from the heap for each message
+    /// we recycle them using this pool. It is also used for other small allocations
+    /// made for each message, such as the nodes of an MPSCQueue.
+    /// 
+    /// Size classes
+    /// ------------
+    /// Blocks are allocated in power-of-two size classes from 64 bytes to 64KB. A
+    /// request is rounded up to the size of its class, and callers can use the whole
+    /// block (see getCapacity()). Larger requests are allocated from the heap.
+    /// 
+    /// Threading
+    /// ---------
+    /// Each thread has a cache of free blocks for each size class, so allocating and
+    /// releasing blocks usually takes no lock. Buffers are often created on one thread
+    /// and released on another (for example, messages are serialized on a client thread
+    /// and released on the UV loop thread once written), so when a thread's cache is
+    /// full it moves a batch of blocks to a central list shared by all threads, and when
+    /// its cache is empty it takes a batch back from the central list.
+    /// 
+    /// The central lists are capped, and blocks above the cap are returned to the heap.
+    /// 
+    /// Allocator
+    /// ---------
+    /// BufferPool::Allocator is an STL-style allocator using the pool. We use it to
+    /// allocate shared_ptr control blocks.
+    /// </summary>
+    class BufferPool
+    {
+    // Public types...
+    public:
+        // STL-style allocator which allocates from the pool.
+        template <typename T>
+        class Allocator
+        {
+        public:
+            typedef T value_type;
+
+            Allocator() = default;
+            template <typename U> Allocator(const Allocator<U>&) {}
+
+            T* allocate(size_t n) { return static_cast<T*>(BufferPool::allocate(n * sizeof(T))); }
+            void deallocate(T* p, size_t n) { BufferPool::release(p, n * sizeof(T)); }
+
+            template <typename U> bool operator==(const Allocator<U>&) const { return true; }
+            template <typename U> bool operator!=(const Allocator<U>&) const { return false; }
+        };
+
+    // Public functions...
+    public:
+        // Allocates a block of at least the size specified.
+        static void* allocate(size_t size);
+
+        // Releases a block. The size must be the size passed to allocate(), or the
+        // capacity returned by getCapacity() for it.
+        static void release(void* p, size_t size);
+
+        // Returns the size of the block which will be allocated for the size requested.
+        static size_t getCapacity(size_t size);
+
+    // Constants...
+    private:
+        // The smallest block size. This is also the smallest size class.
+        static const size_t MIN_BLOCK_SIZE = 64;
+
+        // The number of size classes (64 bytes to 64KB)...
+        static const int NUM_SIZE_CLASSES = 11;
+
+        // The approximate number of bytes cached by a thread for each size class...
+        static const size_t THREAD_CACHE_BYTES = 256 * 1024;
+
+        // The maximum number of bytes held in the central list for each size class...
+        static const size_t CENTRAL_LIST_BYTES = 16 * 1024 * 1024;
+
+    // Private types...
+    private:
+        // A free block. The pointer to the next block is held in the block itself.
+        struct FreeBlock
+        {
+            FreeBlock* pNext;
+        };
+
+        // A list of free blocks.
+        struct FreeList
+        {
+            FreeBlock* pHead = nullptr;
+            size_t count = 0;
+        };
+
+        // Free blocks for one size class shared by all threads, and a lock for them.
+        struct CentralList
+        {
+            std::mutex mutex;
+            FreeList freeList;
+        };
+
+        // Free blocks cached by one thread.
+        struct ThreadCache
+        {
+            // Destructor. Returns the cached blocks to the central lists.
+            ~ThreadCache();
+
+            FreeList freeLists[NUM_SIZE_CLASSES];
+        };
+
+    // Private functions...
+    private:
+        // Returns the size class for the size, or -1 if it is too large to be pooled.
+        static int getSizeClass(size_t size);
+
+        // Returns the block size for a size class.
+        static size_t getClassSize(int sizeClass) { return MIN_BLOCK_SIZE << sizeClass; }
+
+        // Returns the maximum number of blocks held by a thread cache for a size class.
+        static size_t getThreadCacheLimit(int sizeClass);
+
+        // Moves up to count blocks from one list to another.
+        static void moveBlocks(FreeList& from, FreeList& to, size_t count);
+
+        // Frees the blocks in a list.
+        static void freeBlocks(FreeList& freeList);
+
+        // Gets the cache for the current thread.
+        // Returns nullptr if the thread's cache has already been destroyed, as can happen
+        // if a Buffer is released while the thread is exiting.
+        static ThreadCache* getThreadCache();
+
+        // Gets the central list for a size class.
+        static CentralList& getCentralList(int sizeClass);
+    };
+} // namespace
+
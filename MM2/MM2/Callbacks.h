@@ -6,6 +6,11 @@
 namespace MessagingMesh
 {
     // Signature for subscription callbacks.
+    //
+    // The message is decoded lazily: it holds its data as it was received, and decodes the
+    // fields the first time one of them is asked for. The message holds its own copy of the
+    // data, so it can be kept after the callback returns without holding on to the buffers
+    // the connection reads into. (See Message for reading a message from multiple threads.)
     typedef std::function<void(const std::string& subject, const std::string& replySubject, MessagePtr pMessage)> SubscriptionCallback;
 } // namespace
 
@@ -3,8 +3,8 @@
 using namespace MessagingMesh;
 
 // Constructor.
-Connection::Connection(const std::string& hostname, int port, const std::string& service) :
-    m_pImpl(std::make_unique<ConnectionImpl>(hostname, port, service))
+Connection::Connection(const std::string& hostname, int port, const std::string& service, MessageEncoding messageEncoding, bool useFieldNameDictionary) :
+    m_pImpl(std::make_unique<ConnectionImpl>(hostname, port, service, messageEncoding, useFieldNameDictionary))
 {
 }
 
@@ -4,6 +4,7 @@
 #include <functional>
 #include "SharedPointers.h"
 #include "Callbacks.h"
+#include "MessageEncoding.h"
 
 namespace MessagingMesh
 {
@@ -18,7 +19,13 @@ namespace MessagingMesh
     // Public methods...
     public:
         // Constructor.
-        Connection(const std::string& hostname, int port, const std::string& service);
+        // messageEncoding is the encoding we ask the gateway to use for messages sent and
+        // received by this connection. The COMPACT encoding uses less bandwidth, at the
+        // cost of more work to encode and decode messages. See MessageEncoding.
+        // If useFieldNameDictionary is true, each field name in messages we send is written
+        // in full the first time it is sent, and as a small ID after that, if the gateway
+        // supports this. See FieldNameDictionary.
+        Connection(const std::string& hostname, int port, const std::string& service, MessageEncoding messageEncoding = MessageEncoding::STANDARD, bool useFieldNameDictionary = false);
 
         // Destructor.
         ~Connection();
@@ -7,13 +7,16 @@
 #include "NetworkMessage.h"
 #include "Message.h"
 #include "Subscription.h"
+#include "Buffer.h"
 using namespace MessagingMesh;
 
 // Constructor.
-ConnectionImpl::ConnectionImpl(const std::string& hostname, int port, const std::string& service) :
+ConnectionImpl::ConnectionImpl(const std::string& hostname, int port, const std::string& service, MessageEncoding messageEncoding, bool useFieldNameDictionary) :
     m_hostname(hostname),
     m_port(port),
     m_service(service),
+    m_messageEncoding(messageEncoding),
+    m_usesFieldNameDictionary(useFieldNameDictionary),
     m_nextSubscriptionID(0)
 {
     // We create the UV loop for client messaging...
@@ -32,11 +35,14 @@ ConnectionImpl::ConnectionImpl(const std::string& hostname, int port, const std:
         }
     );
 
-    // We send a CONNECT message...
+    // We send a CONNECT message, with the message encoding we want to use and
+    // whether we want to use a field-name dictionary...
     NetworkMessage networkMessage;
     auto& header = networkMessage.getHeader();
     header.setAction(NetworkMessageHeader::Action::CONNECT);
     header.setSubject(m_service);
+    header.setMessageEncoding(m_messageEncoding);
+    header.setUsesFieldNameDictionary(m_usesFieldNameDictionary);
     Utils::sendNetworkMessage(networkMessage, m_pSocket);
 
     // We wait for the ACK to confirm that we have connected.
@@ -56,6 +62,7 @@ ConnectionImpl::ConnectionImpl(const std::string& hostname, int port, const std:
 ConnectionImpl::~ConnectionImpl()
 {
     // We unsubscribe from all active subscriptions...
+    std::lock_guard<std::mutex> lock(m_subscriptionsMutex);
     for (auto& pair : m_subscriptions)
     {
         // We unsubscribe...
@@ -85,8 +92,22 @@ void ConnectionImpl::sendMessage(const std::string& subject, const MessagePtr& p
     auto& header = networkMessage.getHeader();
     header.setAction(NetworkMessageHeader::Action::SEND_MESSAGE);
     header.setSubject(subject);
+    header.setMessageEncoding(m_messageEncoding);
+    header.setUsesFieldNameDictionary(m_usesFieldNameDictionary);
     networkMessage.setMessage(pMessage);
 
+    // With a field-name dictionary, names are added to it as messages are serialized, so
+    // we serialize and queue each message under the lock. This makes sure that messages
+    // sent from different threads are written in the order their names were added...
+    if (m_usesFieldNameDictionary)
+    {
+        std::lock_guard<std::mutex> lock(m_fieldNamesMutex);
+        auto pBuffer = Buffer::create();
+        networkMessage.serialize(*pBuffer, &m_fieldNames);
+        m_pSocket->write(pBuffer);
+        return;
+    }
+
     // We send the message...
     Utils::sendNetworkMessage(networkMessage, m_pSocket);
 }
@@ -101,7 +122,10 @@ SubscriptionPtr ConnectionImpl::subscribe(const std::string& subject, Subscripti
     // We create an object to manage the subscription. 
     // The subscription will be removed when this object is destructed.
     auto pSubscription = Subscription::create(this, subscriptionID, callback);
-    m_subscriptions.insert({ subscriptionID, pSubscription.get()});
+    {
+        std::lock_guard<std::mutex> lock(m_subscriptionsMutex);
+        m_subscriptions.insert({ subscriptionID, pSubscription.get() });
+    }
 
     // We send a SUBSCRIBE message...
     NetworkMessage networkMessage;
@@ -127,6 +151,7 @@ void ConnectionImpl::unsubscribe(uint32_t subscriptionID, bool removeFromCollect
     // We remove the subscription from the collection...
     if (removeFromCollection)
     {
+        std::lock_guard<std::mutex> lock(m_subscriptionsMutex);
         m_subscriptions.erase(subscriptionID);
     }
 }
@@ -146,7 +171,11 @@ void ConnectionImpl::onDataReceived(Socket* /*pSocket*/, BufferPtr pBuffer)
         switch (action)
         {
         case NetworkMessageHeader::Action::ACK:
-            onAck();
+            onAck(header);
+            break;
+
+        case NetworkMessageHeader::Action::SEND_MESSAGE:
+            onMessage(networkMessage, pBuffer);
             break;
         }
     }
@@ -171,10 +200,15 @@ void ConnectionImpl::onDisconnected(Socket* pSocket)
 }
 
 // Called when we see the ACK message from the Gateway.
-void ConnectionImpl::onAck()
+void ConnectionImpl::onAck(const NetworkMessageHeader& header)
 {
     try
     {
+        // We use the message encoding selected by the gateway, and the field-name
+        // dictionary if we asked for it and the gateway accepts it...
+        m_messageEncoding = header.getMessageEncoding();
+        m_usesFieldNameDictionary = m_usesFieldNameDictionary && header.usesFieldNameDictionary();
+
         // We signal that the ACK has been received...
         m_ackSignal.set();
     }
@@ -184,3 +218,37 @@ void ConnectionImpl::onAck()
     }
 }
 
+// Called when we receive a message for one of our subscriptions.
+void ConnectionImpl::onMessage(NetworkMessage& networkMessage, BufferPtr pBuffer)
+{
+    // We find the callback for the subscription.
+    // Note: We take a copy of the callback so that we do not call it while holding
+    //       the lock, as the callback may itself subscribe or unsubscribe.
+    auto& header = networkMessage.getHeader();
+    SubscriptionCallback callback;
+    {
+        std::lock_guard<std::mutex> lock(m_subscriptionsMutex);
+        auto it = m_subscriptions.find(header.getSubscriptionID());
+        if (it == m_subscriptions.end())
+        {
+            // We have unsubscribed but the gateway had already sent the message...
+            return;
+        }
+        callback = it->second->getCallback();
+    }
+    if (!callback)
+    {
+        return;
+    }
+
+    // We deserialize the message and call the callback. The message is deserialized
+    // lazily, so that only the fields the callback reads are decoded.
+    //
+    // A lazy message holds the Buffer it was read from. If this is a view, that would
+    // keep the whole receive buffer it refers to alive for as long as the callback keeps
+    // the message, so we copy the view into a Buffer of its own first...
+    Buffer::detachView(pBuffer);
+    networkMessage.deserializeMessageLazily(pBuffer);
+    callback(header.getSubject(), header.getReplySubject(), networkMessage.getMessage());
+}
+
@@ -2,15 +2,19 @@
 #include <string>
 #include <map>
 #include <atomic>
+#include <mutex>
 #include "SharedPointers.h"
 #include "Socket.h"
 #include "AutoResetEvent.h"
 #include "Callbacks.h"
+#include "MessageEncoding.h"
+#include "FieldNameDictionary.h"
 
 namespace MessagingMesh
 {
     // Forward declarations...
     class NetworkMessage;
+    class NetworkMessageHeader;
 
     /// <summary>
     /// Implementation of the Connection class, ie a client connection
@@ -21,7 +25,7 @@ namespace MessagingMesh
     // Public methods...
     public:
         // Constructor.
-        ConnectionImpl(const std::string& hostname, int port, const std::string& service);
+        ConnectionImpl(const std::string& hostname, int port, const std::string& service, MessageEncoding messageEncoding, bool useFieldNameDictionary);
 
         // Destructor.
         ~ConnectionImpl();
@@ -55,7 +59,10 @@ namespace MessagingMesh
     // Private functions...
     private:
         // Called when we see the ACK message from the Gateway.
-        void onAck();
+        void onAck(const NetworkMessageHeader& header);
+
+        // Called when we receive a message for one of our subscriptions.
+        void onMessage(NetworkMessage& networkMessage, BufferPtr pBuffer);
 
     // Private data...
     private:
@@ -73,14 +80,32 @@ namespace MessagingMesh
         // Waits for the ACK signal...
         AutoResetEvent m_ackSignal;
 
+        // The message encoding we request in the CONNECT message. When the ACK is received
+        // this is updated to the encoding selected by the gateway, which we use to send messages.
+        // (It is only updated before the constructor returns, so it can be read from any thread.)
+        MessageEncoding m_messageEncoding;
+
+        // Whether we ask to send messages using a field-name dictionary in the CONNECT message.
+        // When the ACK is received this is updated to whether the gateway accepts them. (This
+        // is also only updated before the constructor returns.)
+        bool m_usesFieldNameDictionary;
+
+        // The field-name dictionary for messages we send, and a mutex for it.
+        // Note: The mutex is held while a message is serialized and queued to be written, as
+        //       the gateway must receive messages in the order their names were added.
+        mutable FieldNameDictionary m_fieldNames;
+        mutable std::mutex m_fieldNamesMutex;
+
         // Threadsafe subscription ID...
         std::atomic<uint32_t> m_nextSubscriptionID;
 
-        // Active subscriptions, keyed by subscription ID.
+        // Active subscriptions, keyed by subscription ID, and a mutex for them.
         // Note: This holds non-shared pointers as the lifetime of Subscriptions objects
         //       is managed by the shared-pointers passed to client code.
-        // RSSTODO: THIS NEEDS TO BE THREAD SAFE!!!
+        // Note: The mutex is needed as subscriptions are made from client threads and
+        //       looked up from the UV loop thread when messages are received.
         std::map<uint32_t, Subscription*> m_subscriptions;
+        std::mutex m_subscriptionsMutex;
     };
 } // namespace
 
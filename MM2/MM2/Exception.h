@@ -1,15 +1,15 @@
 #pragma once
-#include <exception>
+#include <stdexcept>
 #include <string>
 
 namespace MessagingMesh
 {
     // Exception type thrown by messaging-mesh code.
-    class Exception : public std::exception
+    class Exception : public std::runtime_error
     {
     public:
         Exception(const std::string& message) :
-            std::exception(message.c_str())
+            std::runtime_error(message)
         {
         }
     };
@@ -63,6 +63,76 @@ void Field::setMessage(const ConstMessagePtr& value)
     m_pImpl->setMessage(value);
 }
 
+int64_t Field::getSignedInt64() const
+{
+    return m_pImpl->getSignedInt64();
+}
+
+void Field::setSignedInt64(int64_t value)
+{
+    m_pImpl->setSignedInt64(value);
+}
+
+uint64_t Field::getUnsignedInt64() const
+{
+    return m_pImpl->getUnsignedInt64();
+}
+
+void Field::setUnsignedInt64(uint64_t value)
+{
+    m_pImpl->setUnsignedInt64(value);
+}
+
+bool Field::getBool() const
+{
+    return m_pImpl->getBool();
+}
+
+void Field::setBool(bool value)
+{
+    m_pImpl->setBool(value);
+}
+
+const std::vector<uint8_t>& Field::getBytes() const
+{
+    return m_pImpl->getBytes();
+}
+
+void Field::setBytes(const std::vector<uint8_t>& value)
+{
+    m_pImpl->setBytes(value);
+}
+
+const std::vector<double>& Field::getDoubleArray() const
+{
+    return m_pImpl->getDoubleArray();
+}
+
+void Field::setDoubleArray(const std::vector<double>& value)
+{
+    m_pImpl->setDoubleArray(value);
+}
+
+const std::vector<int32_t>& Field::getSignedInt32Array() const
+{
+    return m_pImpl->getSignedInt32Array();
+}
+
+void Field::setSignedInt32Array(const std::vector<int32_t>& value)
+{
+    m_pImpl->setSignedInt32Array(value);
+}
+
+const std::vector<int64_t>& Field::getSignedInt64Array() const
+{
+    return m_pImpl->getSignedInt64Array();
+}
+
+void Field::setSignedInt64Array(const std::vector<int64_t>& value)
+{
+    m_pImpl->setSignedInt64Array(value);
+}
+
 void Field::serialize(Buffer& buffer) const
 {
     m_pImpl->serialize(buffer);
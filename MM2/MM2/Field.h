@@ -1,5 +1,7 @@
 #pragma once
 #include <string>
+#include <vector>
+#include <cstdint>
 #include "SharedPointers.h"
 
 namespace MessagingMesh
@@ -18,7 +20,14 @@ namespace MessagingMesh
             STRING,
             SIGNED_INT32,
             DOUBLE,
-            MESSAGE
+            MESSAGE,
+            SIGNED_INT64,
+            UNSIGNED_INT64,
+            BOOL,
+            BYTES,
+            DOUBLE_ARRAY,
+            SIGNED_INT32_ARRAY,
+            SIGNED_INT64_ARRAY
         };
         
     // Public methods...
@@ -70,6 +79,55 @@ namespace MessagingMesh
 
         // Sets the field to hold a message.
         void setMessage(const ConstMessagePtr& value);
+
+        // Gets the signed int64 held by the field.
+        // Throws a MessagingMesh::Exception if the field does not hold this type.
+        int64_t getSignedInt64() const;
+
+        // Sets the field to hold a signed int64.
+        void setSignedInt64(int64_t value);
+
+        // Gets the unsigned int64 held by the field.
+        // Throws a MessagingMesh::Exception if the field does not hold this type.
+        uint64_t getUnsignedInt64() const;
+
+        // Sets the field to hold an unsigned int64.
+        void setUnsignedInt64(uint64_t value);
+
+        // Gets the bool held by the field.
+        // Throws a MessagingMesh::Exception if the field does not hold this type.
+        bool getBool() const;
+
+        // Sets the field to hold a bool.
+        void setBool(bool value);
+
+        // Gets the byte array held by the field.
+        // Throws a MessagingMesh::Exception if the field does not hold this type.
+        const std::vector<uint8_t>& getBytes() const;
+
+        // Sets the field to hold a byte array.
+        void setBytes(const std::vector<uint8_t>& value);
+
+        // Gets the double array held by the field.
+        // Throws a MessagingMesh::Exception if the field does not hold this type.
+        const std::vector<double>& getDoubleArray() const;
+
+        // Sets the field to hold a double array.
+        void setDoubleArray(const std::vector<double>& value);
+
+        // Gets the signed int32 array held by the field.
+        // Throws a MessagingMesh::Exception if the field does not hold this type.
+        const std::vector<int32_t>& getSignedInt32Array() const;
+
+        // Sets the field to hold a signed int32 array.
+        void setSignedInt32Array(const std::vector<int32_t>& value);
+
+        // Gets the signed int64 array held by the field.
+        // Throws a MessagingMesh::Exception if the field does not hold this type.
+        const std::vector<int64_t>& getSignedInt64Array() const;
+
+        // Sets the field to hold a signed int64 array.
+        void setSignedInt64Array(const std::vector<int64_t>& value);
         
     // Private functions...
     private:
@@ -75,6 +75,90 @@ void FieldImpl::setMessage(const ConstMessagePtr& value)
     m_dataMessage = value;
 }
 
+int64_t FieldImpl::getSignedInt64() const
+{
+    CHECK_DATA_TYPE(Field::SIGNED_INT64);
+    return m_dataNumeric.Int64;
+}
+
+void FieldImpl::setSignedInt64(int64_t value)
+{
+    m_dataType = Field::SIGNED_INT64;
+    m_dataNumeric.Int64 = value;
+}
+
+uint64_t FieldImpl::getUnsignedInt64() const
+{
+    CHECK_DATA_TYPE(Field::UNSIGNED_INT64);
+    return m_dataNumeric.UInt64;
+}
+
+void FieldImpl::setUnsignedInt64(uint64_t value)
+{
+    m_dataType = Field::UNSIGNED_INT64;
+    m_dataNumeric.UInt64 = value;
+}
+
+bool FieldImpl::getBool() const
+{
+    CHECK_DATA_TYPE(Field::BOOL);
+    return m_dataNumeric.Bool;
+}
+
+void FieldImpl::setBool(bool value)
+{
+    m_dataType = Field::BOOL;
+    m_dataNumeric.Bool = value;
+}
+
+const std::vector<uint8_t>& FieldImpl::getBytes() const
+{
+    CHECK_DATA_TYPE(Field::BYTES);
+    return m_dataBytes;
+}
+
+void FieldImpl::setBytes(const std::vector<uint8_t>& value)
+{
+    m_dataType = Field::BYTES;
+    m_dataBytes = value;
+}
+
+const std::vector<double>& FieldImpl::getDoubleArray() const
+{
+    CHECK_DATA_TYPE(Field::DOUBLE_ARRAY);
+    return m_dataDoubleArray;
+}
+
+void FieldImpl::setDoubleArray(const std::vector<double>& value)
+{
+    m_dataType = Field::DOUBLE_ARRAY;
+    m_dataDoubleArray = value;
+}
+
+const std::vector<int32_t>& FieldImpl::getSignedInt32Array() const
+{
+    CHECK_DATA_TYPE(Field::SIGNED_INT32_ARRAY);
+    return m_dataInt32Array;
+}
+
+void FieldImpl::setSignedInt32Array(const std::vector<int32_t>& value)
+{
+    m_dataType = Field::SIGNED_INT32_ARRAY;
+    m_dataInt32Array = value;
+}
+
+const std::vector<int64_t>& FieldImpl::getSignedInt64Array() const
+{
+    CHECK_DATA_TYPE(Field::SIGNED_INT64_ARRAY);
+    return m_dataInt64Array;
+}
+
+void FieldImpl::setSignedInt64Array(const std::vector<int64_t>& value)
+{
+    m_dataType = Field::SIGNED_INT64_ARRAY;
+    m_dataInt64Array = value;
+}
+
 void FieldImpl::serialize(Buffer& buffer) const
 {
     // We serialize the field name...
@@ -102,6 +186,34 @@ void FieldImpl::serialize(Buffer& buffer) const
         buffer.write_message(m_dataMessage);
         break;
 
+    case Field::SIGNED_INT64:
+        buffer.write_int64(m_dataNumeric.Int64);
+        break;
+
+    case Field::UNSIGNED_INT64:
+        buffer.write_uint64(m_dataNumeric.UInt64);
+        break;
+
+    case Field::BOOL:
+        buffer.write_bool(m_dataNumeric.Bool);
+        break;
+
+    case Field::BYTES:
+        buffer.write_byte_array(m_dataBytes);
+        break;
+
+    case Field::DOUBLE_ARRAY:
+        buffer.write_double_array(m_dataDoubleArray);
+        break;
+
+    case Field::SIGNED_INT32_ARRAY:
+        buffer.write_int32_array(m_dataInt32Array);
+        break;
+
+    case Field::SIGNED_INT64_ARRAY:
+        buffer.write_int64_array(m_dataInt64Array);
+        break;
+
     default:
         throw Exception("Field::serialize data-type not handled");
     }
@@ -134,6 +246,34 @@ void FieldImpl::deserialize(Buffer& buffer)
         m_dataMessage = buffer.read_message();
         break;
 
+    case Field::SIGNED_INT64:
+        m_dataNumeric.Int64 = buffer.read_int64();
+        break;
+
+    case Field::UNSIGNED_INT64:
+        m_dataNumeric.UInt64 = buffer.read_uint64();
+        break;
+
+    case Field::BOOL:
+        m_dataNumeric.Bool = buffer.read_bool();
+        break;
+
+    case Field::BYTES:
+        m_dataBytes = buffer.read_byte_array();
+        break;
+
+    case Field::DOUBLE_ARRAY:
+        m_dataDoubleArray = buffer.read_double_array();
+        break;
+
+    case Field::SIGNED_INT32_ARRAY:
+        m_dataInt32Array = buffer.read_int32_array();
+        break;
+
+    case Field::SIGNED_INT64_ARRAY:
+        m_dataInt64Array = buffer.read_int64_array();
+        break;
+
     default:
         throw Exception("Field::deserialize data-type not handled");
     }
@@ -0,0 +1,54 @@
+#pragma once
+#include <string>
+#include <cstdint>
+#include <cstddef>
+
+namespace MessagingMesh
+{
+    /// <summary>
+    /// The name of a field together with its hash, for reading fields from messages.
+    ///
+    /// Message::getField(name) hashes the name each time it is called. Code which reads
+    /// the same fields from many messages can create a FieldKey for each field name once,
+    /// and pass it to Message::getField(key) so that the name is not hashed for each read.
+    /// For example:
+    ///
+    ///     static const FieldKey PRICE("PRICE");
+    ///     auto price = pMessage->getField(PRICE)->getDouble();
+    /// </summary>
+    class FieldKey
+    {
+    // Public methods...
+    public:
+        // Constructor.
+        FieldKey(const std::string& name) :
+            m_name(name),
+            m_hash(hash(name.data(), name.size()))
+        {
+        }
+
+        // Gets the field name.
+        const std::string& getName() const { return m_name; }
+
+        // Gets the hash of the field name.
+        uint32_t getHash() const { return m_hash; }
+
+        // Returns the hash of a field name (FNV-1a).
+        static uint32_t hash(const char* pName, size_t size)
+        {
+            uint32_t result = 2166136261u;
+            for (size_t i = 0; i < size; ++i)
+            {
+                result ^= static_cast<uint8_t>(pName[i]);
+                result *= 16777619u;
+            }
+            return result;
+        }
+
+    // Private data...
+    private:
+        std::string m_name;
+        uint32_t m_hash;
+    };
+} // namespace
+
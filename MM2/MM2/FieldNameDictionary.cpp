@@ -0,0 +1,69 @@
+#include "FieldNameDictionary.h"
+#include <cstring>
+#include "Exception.h"
+#include "Utils.h"
+using namespace MessagingMesh;
+
+// Constructor.
+FieldNameDictionary::FieldNameDictionary()
+{
+}
+
+// Returns the ID of the name specified, or -1 if it is not in the dictionary.
+int32_t FieldNameDictionary::find(const char* pName, int32_t size, uint32_t nameHash) const
+{
+    auto it = m_firstIDs.find(nameHash);
+    if (it == m_firstIDs.end())
+    {
+        return -1;
+    }
+
+    // We check each name with the same hash...
+    for (auto id = it->second; id != -1; id = m_nextIDs[id])
+    {
+        auto& name = m_names[id];
+        if (static_cast<int32_t>(name.size()) == size && (size == 0 || std::memcmp(name.data(), pName, size) == 0))
+        {
+            return id;
+        }
+    }
+    return -1;
+}
+
+// Adds the name with the next ID, and returns the ID. Returns -1 if the dictionary
+// is full. The name must not already be in the dictionary.
+int32_t FieldNameDictionary::add(const char* pName, int32_t size, uint32_t nameHash)
+{
+    auto id = getCount();
+    if (id >= MAX_NAMES)
+    {
+        return -1;
+    }
+    m_names.emplace_back(pName, size);
+    m_nameHashes.push_back(nameHash);
+
+    // We add the ID to the front of the IDs with the same hash...
+    auto it = m_firstIDs.find(nameHash);
+    if (it == m_firstIDs.end())
+    {
+        m_firstIDs.insert({ nameHash, id });
+        m_nextIDs.push_back(-1);
+    }
+    else
+    {
+        m_nextIDs.push_back(it->second);
+        it->second = id;
+    }
+    return id;
+}
+
+// Gets the name with the ID specified.
+// Throws a MessagingMesh::Exception if the ID is not in the dictionary.
+const std::string& FieldNameDictionary::getName(int32_t id) const
+{
+    if (id < 0 || id >= getCount())
+    {
+        throw Exception(Utils::format("Field name ID %d is not in the dictionary", id));
+    }
+    return m_names[id];
+}
@@ -0,0 +1,71 @@
+#pragma once
+#include <vector>
+#include <string>
+#include <unordered_map>
+#include <cstdint>
+
+namespace MessagingMesh
+{
+    /// <summary>
+    /// Assigns small integer IDs to field names, so that a name can be sent once on a
+    /// connection and then referred to by its ID in later messages.
+    ///
+    /// The sender and the receiver each hold a dictionary for the messages going in one
+    /// direction on a connection. Neither side sends the IDs: each name is given the next
+    /// ID the first time it is written or read in full, while the dictionary is not full.
+    /// So the two dictionaries stay the same as long as the receiver reads every message
+    /// in the order they were written, which is why they are only used for data that is
+    /// never dropped, such as messages sent from a client to the gateway.
+    ///
+    /// Names are written with a token (a varint or int32, depending on the encoding):
+    /// - An even token is the length of the name, times two, and the name follows.
+    /// - An odd token is the ID of the name, times two, plus one.
+    ///
+    /// We hold at most MAX_NAMES names, so that a token for an ID is at most two bytes in
+    /// the compact encoding. Later names are always written in full.
+    ///
+    /// Note: The dictionary is not threadsafe. Messages using it must be serialized, and
+    ///       deserialized, one at a time and in the order they are sent.
+    /// </summary>
+    class FieldNameDictionary
+    {
+    // Public constants...
+    public:
+        // The maximum number of names held.
+        static const int32_t MAX_NAMES = 8192;
+
+    // Public methods...
+    public:
+        // Constructor.
+        FieldNameDictionary();
+
+        // Returns the ID of the name specified, or -1 if it is not in the dictionary.
+        int32_t find(const char* pName, int32_t size, uint32_t nameHash) const;
+
+        // Adds the name with the next ID, and returns the ID. Returns -1 if the dictionary
+        // is full. The name must not already be in the dictionary.
+        int32_t add(const char* pName, int32_t size, uint32_t nameHash);
+
+        // Gets the name with the ID specified.
+        // Throws a MessagingMesh::Exception if the ID is not in the dictionary.
+        const std::string& getName(int32_t id) const;
+
+        // Gets the hash of the name with the ID specified (see FieldKey).
+        uint32_t getNameHash(int32_t id) const { return m_nameHashes[id]; }
+
+        // Gets the number of names in the dictionary.
+        int32_t getCount() const { return static_cast<int32_t>(m_names.size()); }
+
+    // Private data...
+    private:
+        // Names and their hashes, by ID...
+        std::vector<std::string> m_names;
+        std::vector<uint32_t> m_nameHashes;
+
+        // The first ID for each name-hash, and for each ID the next ID with the same
+        // hash (or -1). So finding a name does not allocate a string to look it up...
+        std::unordered_map<uint32_t, int32_t> m_firstIDs;
+        std::vector<int32_t> m_nextIDs;
+    };
+} // namespace
+
@@ -6,30 +6,88 @@
 #include "Message.h"
 #include "Field.h"
 #include "Exception.h"
+#include "UVUtils.h"
 using namespace MessagingMesh;
 
 // Constructor.
-Gateway::Gateway(int port) :
-    m_port(port),
-    m_pUVLoop(UVLoop::create("GATEWAY"))
+// acceptorLoopCount is the number of UV loops listening for client connections.
+Gateway::Gateway(int port, int acceptorLoopCount) :
+    m_port(port)
 {
-    // We create a socket to listen to client connections, managed by the uv loop...
-    m_pUVLoop->marshallEvent(
-        [this](uv_loop_t* /*pLoop*/)
-        {
-            createListeningSocket();
-        }
-    );
+    // We check that we can share the port between acceptor loops...
+    if (acceptorLoopCount > 1 && !UVUtils::supportsReusePort())
+    {
+        Logger::warn("SO_REUSEPORT is not supported: using one acceptor loop");
+        acceptorLoopCount = 1;
+    }
+    if (acceptorLoopCount < 1)
+    {
+        acceptorLoopCount = 1;
+    }
+    auto reusePort = acceptorLoopCount > 1;
+
+    // We create the acceptor loops, and a socket in each of them to listen to client connections...
+    m_listeningSockets.resize(acceptorLoopCount);
+    for (int i = 0; i < acceptorLoopCount; ++i)
+    {
+        auto name = reusePort ? Utils::format("GATEWAY-%d", i + 1) : std::string("GATEWAY");
+        auto pUVLoop = UVLoop::create(name);
+        m_acceptorLoops.push_back(pUVLoop);
+
+        size_t acceptorIndex = i;
+        pUVLoop->marshallEvent(
+            [this, acceptorIndex, reusePort](uv_loop_t* /*pLoop*/)
+            {
+                createListeningSocket(acceptorIndex, reusePort);
+            }
+        );
+    }
 }
 
-// Creates the socket to listen for client connections.
-void Gateway::createListeningSocket()
+// Sets the number of shards (UV loops and threads) to use for the service specified.
+// This must be called before the first client connects to the service.
+void Gateway::setServiceShardCount(const std::string& service, int shardCount)
+{
+    updateServiceSettings(service, [shardCount](ServiceManager::Settings& settings) { settings.shardCount = shardCount; });
+}
+
+// Sets the flush policy for the sockets of clients of the service specified.
+// This must be called before the first client connects to the service.
+void Gateway::setServiceFlushPolicy(const std::string& service, const Socket::FlushPolicy& flushPolicy)
+{
+    updateServiceSettings(service, [&flushPolicy](ServiceManager::Settings& settings) { settings.flushPolicy = flushPolicy; });
+}
+
+// Sets the slow-consumer policy for the sockets of clients of the service specified.
+// This must be called before the first client connects to the service.
+void Gateway::setServiceSlowConsumerPolicy(const std::string& service, const Socket::SlowConsumerPolicy& slowConsumerPolicy)
+{
+    updateServiceSettings(service, [&slowConsumerPolicy](ServiceManager::Settings& settings) { settings.slowConsumerPolicy = slowConsumerPolicy; });
+}
+
+// Sets settings for a service which has not yet been created, using the function
+// passed in. Logs a warning if the service has already been created.
+void Gateway::updateServiceSettings(const std::string& service, const std::function<void(ServiceManager::Settings&)>& update)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_serviceManagers.find(service) != m_serviceManagers.end())
+    {
+        Logger::warn(Utils::format("Service %s has already been created: settings not changed", service.c_str()));
+        return;
+    }
+    update(m_serviceSettings[service]);
+}
+
+// Creates the socket to listen for client connections for the acceptor loop
+// at the index specified.
+void Gateway::createListeningSocket(size_t acceptorIndex, bool reusePort)
 {
     try
     {
-        m_listeningSocket = Socket::create(m_pUVLoop);
-        m_listeningSocket->setCallback(this);
-        m_listeningSocket->listen(m_port);
+        auto pListeningSocket = Socket::create(m_acceptorLoops[acceptorIndex]);
+        pListeningSocket->setCallback(this);
+        pListeningSocket->listen(m_port, reusePort);
+        m_listeningSockets[acceptorIndex] = pListeningSocket;
     }
     catch (const std::exception& ex)
     {
@@ -38,14 +96,17 @@ void Gateway::createListeningSocket()
 }
 
 // Called when a new client connection has been made to a listening socket.
-// Called on the GATEWAY thread.
+// Called on the thread of the acceptor loop for the listening socket.
 void Gateway::onNewConnection(SocketPtr pSocket)
 {
     try
     {
         // We add the socket to the pending-collection and observe it 
         // to listen for the CONNECT message...
-        m_pendingConnections[pSocket->getName()] = pSocket;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_pendingConnections[pSocket->getName()] = pSocket;
+        }
         pSocket->setCallback(this);
     }
     catch (const std::exception& ex)
@@ -60,17 +121,16 @@ void Gateway::onDataReceived(Socket* pSocket, BufferPtr pBuffer)
 {
     try
     {
-        // The buffer holds a serialized NetworkMessage. We deserialize
-        // the header and check the action...
-        NetworkMessage networkMessage;
-        networkMessage.deserializeHeader(*pBuffer);
-        auto& header = networkMessage.getHeader();
-        auto action = header.getAction();
-        switch (action)
+        // The buffer holds a serialized NetworkMessage. We check the action from
+        // the header's fixed-size prefix, and only deserialize the header for a
+        // CONNECT...
+        NetworkMessageHeader::Action action;
+        if (NetworkMessageHeader::peekAction(pBuffer->getBuffer(), pBuffer->getBufferSize(), action) &&
+            action == NetworkMessageHeader::Action::CONNECT)
         {
-        case NetworkMessageHeader::Action::CONNECT:
-            onConnect(pSocket->getName(), header);
-            break;
+            NetworkMessage networkMessage;
+            networkMessage.deserializeHeader(*pBuffer);
+            onConnect(pSocket->getName(), networkMessage.getHeader());
         }
     }
     catch (const std::exception& ex)
@@ -94,6 +154,7 @@ void Gateway::onDisconnected(Socket* pSocket)
         // If this happens, we remove the socket from the pending-collection. This 
         // releases our reference to it, allowing it to be destructed.
         auto& socketName = pSocket->getName();
+        std::lock_guard<std::mutex> lock(m_mutex);
         m_pendingConnections.erase(socketName);
     }
     catch (const std::exception& ex)
@@ -109,26 +170,47 @@ void Gateway::onConnect(const std::string& socketName, const NetworkMessageHeade
     auto& service = header.getSubject();
     Logger::info(Utils::format("Received CONNECT request from %s for service %s", socketName.c_str(), service.c_str()));
 
-    // We find the socket from the pending-collection...
-    auto it_pendingConnections = m_pendingConnections.find(socketName);
-    if (it_pendingConnections == m_pendingConnections.end())
+    SocketPtr pSocket;
+    ServiceManager* pServiceManager;
     {
-        auto message = Utils::format("Socket %s not in pending-collection", socketName.c_str());
-        throw Exception(message);
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        // We find the socket from the pending-collection...
+        auto it_pendingConnections = m_pendingConnections.find(socketName);
+        if (it_pendingConnections == m_pendingConnections.end())
+        {
+            auto message = Utils::format("Socket %s not in pending-collection", socketName.c_str());
+            throw Exception(message);
+        }
+        pSocket = it_pendingConnections->second;
+
+        // The socket will be managed by the service-manager, so we remove it from our pending-collection...
+        m_pendingConnections.erase(it_pendingConnections);
+
+        // We get or create the ServiceManager for the service requested by the client.
+        // (Service managers are never removed, so we can use the pointer outside the lock.)
+        auto it_serviceManagers = m_serviceManagers.find(service);
+        if (it_serviceManagers == m_serviceManagers.end())
+        {
+            ServiceManager::Settings settings;
+            auto it_settings = m_serviceSettings.find(service);
+            if (it_settings != m_serviceSettings.end()) settings = it_settings->second;
+            auto pNewServiceManager = std::make_unique<ServiceManager>(service, settings);
+            it_serviceManagers = m_serviceManagers.insert(it_serviceManagers, { service, std::move(pNewServiceManager) });
+        }
+        pServiceManager = it_serviceManagers->second.get();
     }
-    auto pSocket = it_pendingConnections->second;
 
-    // We get or create the ServiceManager for the service requested by the client...
-    auto it_serviceManagers = m_serviceManagers.find(service);
-    if (it_serviceManagers == m_serviceManagers.end())
+    // We select the encoding of messages sent to the client. We use the encoding
+    // the client requested, or the standard encoding if we do not recognise it.
+    // The ACK sent when the socket is registered tells the client which we chose...
+    auto messageEncoding = header.getMessageEncoding();
+    if (messageEncoding != MessageEncoding::COMPACT)
     {
-        it_serviceManagers = m_serviceManagers.insert(it_serviceManagers, { service, ServiceManager(service) });
+        messageEncoding = MessageEncoding::STANDARD;
     }
-    auto& serviceManager = it_serviceManagers->second;
-    
-    // We move the socket to the service-manager...
-    serviceManager.registerSocket(pSocket);
+    pSocket->setMessageEncoding(messageEncoding);
 
-    // The socket is now managed by the service-manager, so we remove it from our pending-collection...
-    m_pendingConnections.erase(socketName);
+    // We move the socket to the service-manager...
+    pServiceManager->registerSocket(pSocket);
 }
@@ -1,6 +1,9 @@
 #pragma once
 #include <memory>
 #include <map>
+#include <vector>
+#include <mutex>
+#include <functional>
 #include "UVLoop.h"
 #include "Socket.h"
 #include "SharedPointers.h"
@@ -20,6 +23,22 @@ namespace MessagingMesh
     /// All methods except the constructor and destructor will be called from the UV
     /// loop's thread.
     /// 
+    /// Acceptor loops
+    /// --------------
+    /// When many clients connect at the same time (for example, when they all reconnect
+    /// after a failover) a single loop accepting connections, reading CONNECT messages and
+    /// handing the sockets to services can become a bottleneck. So the gateway can be
+    /// created with more than one acceptor loop. Each loop has its own listening socket,
+    /// bound to the same port with SO_REUSEPORT, and the OS spreads incoming connections
+    /// across them.
+    /// 
+    /// Where SO_REUSEPORT is not supported (see UVUtils::supportsReusePort()) we fall back
+    /// to a single acceptor loop.
+    /// 
+    /// With more than one acceptor loop, the callbacks are called from each of the loops'
+    /// threads, so the pending-connection and service-manager collections are accessed
+    /// under a lock. (This lock is also used for the service shard counts.)
+    /// 
     /// Services
     /// --------
     /// When clients connect using the Connection class, they specify a service. Each service
@@ -45,21 +64,45 @@ namespace MessagingMesh
     /// 
     /// Each ServiceManager runs its own UV loop, so all subsequent interactions with the client
     /// will be managed by that loop. This means that each service runs on its own thread.
+    /// 
+    /// A busy service can be configured with setServiceShardCount() to run more than one
+    /// UV loop, with its clients spread across them. See ServiceManager.
+    /// 
+    /// setServiceFlushPolicy() sets when data for the service's clients is sent to the
+    /// network. For example, a service whose clients are bulk consumers can hold data to
+    /// send fewer, larger writes. See Socket::FlushPolicy.
+    /// 
+    /// setServiceSlowConsumerPolicy() limits the data queued for each of the service's
+    /// clients, so that a client which does not keep up with the messages sent to it cannot
+    /// make the gateway's memory grow without limit. See Socket::SlowConsumerPolicy.
     /// </summary>
     class Gateway : public Socket::ICallback
     {
     // Public methods...
     public:
         // Constructor.
-        Gateway(int port);
+        // acceptorLoopCount is the number of UV loops listening for client connections.
+        Gateway(int port, int acceptorLoopCount = 1);
 
         // Destructor.
         ~Gateway() = default;
 
+        // Sets the number of shards (UV loops and threads) to use for the service specified.
+        // This must be called before the first client connects to the service.
+        void setServiceShardCount(const std::string& service, int shardCount);
+
+        // Sets the flush policy for the sockets of clients of the service specified.
+        // This must be called before the first client connects to the service.
+        void setServiceFlushPolicy(const std::string& service, const Socket::FlushPolicy& flushPolicy);
+
+        // Sets the slow-consumer policy for the sockets of clients of the service specified.
+        // This must be called before the first client connects to the service.
+        void setServiceSlowConsumerPolicy(const std::string& service, const Socket::SlowConsumerPolicy& slowConsumerPolicy);
+
     // Socket::ICallback implementation...
     private:
         // Called when a new client connection has been made to a listening socket.
-        // Called on the GATEWAY thread.
+        // Called on the thread of the acceptor loop for the listening socket.
         void onNewConnection(SocketPtr pClientSocket);
 
         // Called when data has been received on the socket.
@@ -75,8 +118,13 @@ namespace MessagingMesh
 
     // Private functions...
     private:
-        // Creates the socket to listen for client connections.
-        void createListeningSocket();
+        // Sets settings for a service which has not yet been created, using the function
+        // passed in. Logs a warning if the service has already been created.
+        void updateServiceSettings(const std::string& service, const std::function<void(ServiceManager::Settings&)>& update);
+
+        // Creates the socket to listen for client connections for the acceptor loop
+        // at the index specified.
+        void createListeningSocket(size_t acceptorIndex, bool reusePort);
 
         // Called when we receive a CONNECT message from a client.
         void onConnect(const std::string& socketName, const NetworkMessageHeader& header);
@@ -86,11 +134,14 @@ namespace MessagingMesh
         // The port on which we listen for client connections.
         int m_port;
 
-        // UV loop for listening for new client connections.
-        UVLoopPtr m_pUVLoop;
+        // UV loops for listening for new client connections...
+        std::vector<UVLoopPtr> m_acceptorLoops;
+
+        // Sockets listening for incoming connections, one for each acceptor loop...
+        std::vector<SocketPtr> m_listeningSockets;
 
-        // Socket listening for incoming connections.
-        SocketPtr m_listeningSocket;
+        // Lock for the pending-connection and service-manager collections...
+        std::mutex m_mutex;
 
         // Sockets for which we have not yet received a CONNECT message, keyed 
         // by socket name. We need to hold onto these to avoid the Sockets going
@@ -98,7 +149,10 @@ namespace MessagingMesh
         std::map<std::string, SocketPtr> m_pendingConnections;
 
         // Service managers, keyed by service name...
-        std::map<std::string, ServiceManager> m_serviceManagers;
+        std::map<std::string, std::unique_ptr<ServiceManager>> m_serviceManagers;
+
+        // Settings for services which do not use the defaults, keyed by service name...
+        std::map<std::string, ServiceManager::Settings> m_serviceSettings;
     };
 } // namespace
 
@@ -0,0 +1,125 @@
+#pragma once
+#include <atomic>
+#include <new>
+#include <utility>
+#include "BufferPool.h"
+
+namespace MessagingMesh
+{
+    /// <summary>
+    /// A lock-free, unbounded, multi-producer / single-consumer queue.
+    /// 
+    /// Items can be pushed from any thread, and are popped from one consumer
+    /// thread (for example, the thread running a UV loop).
+    /// 
+    /// Implementation
+    /// --------------
+    /// This is Dmitry Vyukov's intrusive MPSC queue. Items are held in a linked list
+    /// of nodes with a 'stub' node at the tail:
+    /// - push() swaps the new node in as the head with one atomic exchange and then
+    ///   links the previous head to it. Producers never wait for each other.
+    /// - pop() takes the item from the node after the tail, and that node becomes the
+    ///   new stub. Only the consumer touches the tail, so this needs no atomic RMW.
+    /// 
+    /// A producer which has swapped in its node but not yet linked it makes the queue
+    /// look empty to the consumer for a moment, so pop() can return false while a push
+    /// is in progress. Callers which signal the consumer after pushing (as UVLoop does)
+    /// will be woken again once the push has completed.
+    /// 
+    /// Nodes
+    /// -----
+    /// Nodes are allocated from the BufferPool, so in the steady state pushing and
+    /// popping recycle nodes from the pool's per-thread caches rather than going to
+    /// the heap.
+    /// </summary>
+    template<typename ItemType>
+    class MPSCQueue
+    {
+    // Public methods...
+    public:
+        // Constructor.
+        MPSCQueue() :
+            m_pHead(createNode()),
+            m_pTail(m_pHead.load(std::memory_order_relaxed))
+        {
+        }
+
+        // Destructor.
+        ~MPSCQueue()
+        {
+            // We release any items still in the queue, and then the stub...
+            ItemType item;
+            while (pop(item))
+            {
+            }
+            releaseNode(m_pTail);
+        }
+
+        // Deleted methods.
+        MPSCQueue(const MPSCQueue&) = delete;
+        MPSCQueue& operator=(const MPSCQueue&) = delete;
+
+        // Adds an item to the queue.
+        // Can be called from any thread.
+        void push(ItemType item)
+        {
+            auto pNode = createNode();
+            pNode->item = std::move(item);
+            auto pPrevious = m_pHead.exchange(pNode, std::memory_order_acq_rel);
+            pPrevious->pNext.store(pNode, std::memory_order_release);
+        }
+
+        // Takes the item at the front of the queue. Returns false if the queue is empty.
+        // Must only be called from the consumer thread.
+        bool pop(ItemType& item)
+        {
+            auto pTail = m_pTail;
+            auto pNext = pTail->pNext.load(std::memory_order_acquire);
+            if (!pNext)
+            {
+                return false;
+            }
+
+            // We take the item from the next node, which becomes the new stub. We
+            // reset the item in the stub so that it does not hold on to resources...
+            item = std::move(pNext->item);
+            pNext->item = ItemType();
+            m_pTail = pNext;
+            releaseNode(pTail);
+            return true;
+        }
+
+    // Private types...
+    private:
+        // A node in the queue.
+        struct Node
+        {
+            std::atomic<Node*> pNext{ nullptr };
+            ItemType item;
+        };
+
+    // Private functions...
+    private:
+        // Creates a node.
+        static Node* createNode()
+        {
+            return new (BufferPool::allocate(sizeof(Node))) Node();
+        }
+
+        // Releases a node.
+        static void releaseNode(Node* pNode)
+        {
+            pNode->~Node();
+            BufferPool::release(pNode, sizeof(Node));
+        }
+
+    // Private data...
+    private:
+        // The most recently pushed node. Updated by producers.
+        std::atomic<Node*> m_pHead;
+
+        // The stub node before the next item to pop. Only accessed by the consumer.
+        Node* m_pTail;
+    };
+} // namespace
+
@@ -1,5 +1,6 @@
 #include "Message.h"
 #include "MessageImpl.h"
+#include "Buffer.h"
 using namespace MessagingMesh;
 
 Message::Message() :
@@ -15,6 +16,11 @@ const ConstFieldPtr& Message::getField(const std::string& name) const
     return m_pImpl->getField(name);
 }
 
+const ConstFieldPtr& Message::getField(const FieldKey& key) const
+{
+    return m_pImpl->getField(key);
+}
+
 void Message::addField(const std::string& name, const std::string& value)
 {
     m_pImpl->addField(name, value);
@@ -35,12 +41,58 @@ void Message::addField(const std::string& name, const ConstMessagePtr& value)
     m_pImpl->addField(name, value);
 }
 
-void Message::serialize(Buffer& buffer) const
+void Message::addField(const std::string& name, int64_t value)
+{
+    m_pImpl->addField(name, value);
+}
+
+void Message::addField(const std::string& name, uint64_t value)
+{
+    m_pImpl->addField(name, value);
+}
+
+void Message::addField(const std::string& name, bool value)
+{
+    m_pImpl->addField(name, value);
+}
+
+void Message::addField(const std::string& name, const char* value)
+{
+    m_pImpl->addField(name, value);
+}
+
+void Message::addField(const std::string& name, const std::vector<uint8_t>& value)
+{
+    m_pImpl->addField(name, value);
+}
+
+void Message::addField(const std::string& name, const std::vector<double>& value)
+{
+    m_pImpl->addField(name, value);
+}
+
+void Message::addField(const std::string& name, const std::vector<int32_t>& value)
+{
+    m_pImpl->addField(name, value);
+}
+
+void Message::addField(const std::string& name, const std::vector<int64_t>& value)
+{
+    m_pImpl->addField(name, value);
+}
+
+void Message::serialize(Buffer& buffer, MessageEncoding encoding, FieldNameDictionary* pFieldNames) const
+{
+    m_pImpl->serialize(buffer, encoding, pFieldNames);
+}
+
+void Message::deserialize(Buffer& buffer, MessageEncoding encoding, FieldNameDictionary* pFieldNames)
 {
-    m_pImpl->serialize(buffer);
+    m_pImpl->deserialize(buffer, encoding, pFieldNames);
 }
 
-void Message::deserialize(Buffer& buffer)
+void Message::deserializeLazily(const BufferPtr& pBuffer, MessageEncoding encoding)
 {
-    m_pImpl->deserialize(buffer);
+    m_pImpl->deserializeLazily(pBuffer, pBuffer->getPosition(), encoding);
+    pBuffer->setPosition(pBuffer->getBufferSize());
 }
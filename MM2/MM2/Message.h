@@ -1,17 +1,28 @@
 #pragma once
 #include <string>
 #include <memory>
+#include <vector>
+#include <cstdint>
 #include "SharedPointers.h"
+#include "MessageEncoding.h"
 
 namespace MessagingMesh
 {
     // Forward declarations...
     class MessageImpl;
+    class FieldKey;
+    class FieldNameDictionary;
 
     // A message which can be sent via the Messaging Mesh.
     // Holds a vector of named Fields which can be accessed by
     // name or by index. You can add multiple fields with the
     // same name.
+    //
+    // Threading: A message is not threadsafe, even for reading. getField() is const, but
+    // creates the Field it returns the first time it is asked for, and for a message which
+    // was deserialized lazily (such as one received by a subscription callback) it decodes
+    // the fields the first time any of them is asked for. So a message must not be read
+    // from more than one thread at the same time unless the reads are synchronized.
     class Message
     {
     // Public methods...
@@ -23,14 +34,32 @@ namespace MessagingMesh
         ~Message();
 
         // Gets a field by name.
+        // The reference returned is valid until the message is destroyed.
         // Throws a MessagingMesh::Exception if the field is not in the message.
         const ConstFieldPtr& getField(const std::string& name) const;
 
-        // Serializes the message to the current position in the buffer.
-        void serialize(Buffer& buffer) const;
+        // Gets a field by key.
+        // This is faster than getting it by name, as the key holds the hash of the name.
+        // The reference returned is valid until the message is destroyed.
+        // Throws a MessagingMesh::Exception if the field is not in the message.
+        const ConstFieldPtr& getField(const FieldKey& key) const;
+
+        // Serializes the message to the current position in the buffer, with the encoding specified.
+        // If pFieldNames is not null, field names are written using the dictionary (and added to it).
+        void serialize(Buffer& buffer, MessageEncoding encoding = MessageEncoding::STANDARD, FieldNameDictionary* pFieldNames = nullptr) const;
+
+        // Deserializes the message with the encoding specified from the current position in the buffer.
+        // If pFieldNames is not null, field names are read using the dictionary (and added to it).
+        void deserialize(Buffer& buffer, MessageEncoding encoding = MessageEncoding::STANDARD, FieldNameDictionary* pFieldNames = nullptr);
 
-        // Deserializes the message from the current position in the buffer.
-        void deserialize(Buffer& buffer);
+        // Deserializes the message from the current position in the buffer lazily.
+        // Fields are only decoded when they are asked for, and the message holds a
+        // reference to the buffer until it is released. The message must be the last
+        // item in the buffer, and the position is moved to the end of the data.
+        // Note: If the buffer is a view of received data (see Buffer::createView()), the
+        //       message keeps the whole receive buffer alive, so use Buffer::detachView()
+        //       first for a message which may be kept.
+        void deserializeLazily(const BufferPtr& pBuffer, MessageEncoding encoding = MessageEncoding::STANDARD);
 
     // Helper methods to add fields of various types...
     public:
@@ -45,6 +74,31 @@ namespace MessagingMesh
 
         // Adds a message field to the message. 
         void addField(const std::string& name, const ConstMessagePtr& value);
+
+        // Adds a signed int64 field to the message.
+        void addField(const std::string& name, int64_t value);
+
+        // Adds an unsigned int64 field to the message.
+        void addField(const std::string& name, uint64_t value);
+
+        // Adds a bool field to the message.
+        void addField(const std::string& name, bool value);
+
+        // Adds a string field to the message.
+        // (This makes sure that string literals are not converted to bool.)
+        void addField(const std::string& name, const char* value);
+
+        // Adds a byte array field to the message.
+        void addField(const std::string& name, const std::vector<uint8_t>& value);
+
+        // Adds a double array field to the message.
+        void addField(const std::string& name, const std::vector<double>& value);
+
+        // Adds a signed int32 array field to the message.
+        void addField(const std::string& name, const std::vector<int32_t>& value);
+
+        // Adds a signed int64 array field to the message.
+        void addField(const std::string& name, const std::vector<int64_t>& value);
     
     // Private functions...
     private:
@@ -55,6 +109,10 @@ namespace MessagingMesh
     // Implementation...
     private:
         std::unique_ptr<MessageImpl> m_pImpl;
+
+        // MessageImpl deserializes nested messages lazily from the position of
+        // the nested message in its buffer...
+        friend class MessageImpl;
     };
 
 } // namespace
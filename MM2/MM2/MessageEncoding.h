@@ -0,0 +1,36 @@
+#pragma once
+#include <cstdint>
+
+namespace MessagingMesh
+{
+    /// <summary>
+    /// The encoding used to serialize the fields of a Message.
+    ///
+    /// STANDARD
+    /// --------
+    /// Lengths, counts and integers are written as fixed-size little-endian values,
+    /// and each field is written as [name][data-type][value].
+    ///
+    /// COMPACT
+    /// -------
+    /// Written for links where bandwidth matters more than the cost of decoding:
+    /// - The field count and lengths are written as LEB128 varints.
+    /// - Signed integers are zig-zag encoded varints, and unsigned integers varints.
+    /// - The data-type is written in the low four bits of one byte. For strings and byte
+    ///   arrays shorter than 15 bytes the high four bits hold the length plus one, so the
+    ///   type and length take one byte. (Zero means a varint length follows.) For bools
+    ///   the high four bits hold the value.
+    /// - Doubles, and the items of arrays, are written unchanged so that arrays can still
+    ///   be copied with one memcpy.
+    ///
+    /// The encoding is chosen for each client connection in the CONNECT handshake, and
+    /// is held in the header of each SEND_MESSAGE, so a client can decode either encoding.
+    /// The gateway re-encodes messages for subscribers which use a different encoding.
+    /// </summary>
+    enum class MessageEncoding : int8_t
+    {
+        STANDARD,
+        COMPACT
+    };
+} // namespace
+
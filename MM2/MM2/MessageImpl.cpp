@@ -1,86 +1,971 @@
 #include "MessageImpl.h"
+#include <cstring>
+#include <cstdint>
 #include "Field.h"
 #include "Buffer.h"
+#include "Message.h"
 #include "Exception.h"
+#include "FieldNameDictionary.h"
 using namespace MessagingMesh;
 
 MessageImpl::MessageImpl()
 {
 }
 
+// Gets a field by name.
+// Throws a MessagingMesh::Exception if the field is not in the message.
 const ConstFieldPtr& MessageImpl::getField(const std::string& name) const
 {
-    auto it = m_mapNameToField.find(name);
-    if (it == m_mapNameToField.end())
+    return getField(name, FieldKey::hash(name.data(), name.size()));
+}
+
+// Gets a field by key.
+// Throws a MessagingMesh::Exception if the field is not in the message.
+const ConstFieldPtr& MessageImpl::getField(const FieldKey& key) const
+{
+    return getField(key.getName(), key.getHash());
+}
+
+// Gets the field with the name and name-hash specified.
+// Throws a MessagingMesh::Exception if the field is not in the message.
+const ConstFieldPtr& MessageImpl::getField(const std::string& name, uint32_t nameHash) const
+{
+    // We find the first field with the name. For a lazy message this
+    // builds the entries the first time a field is asked for...
+    buildEntries();
+    auto index = findField(name, nameHash);
+    if (index == -1)
     {
         throw Exception("Field " + name + " not in message");
     }
-    return it->second;
+
+    // We create the Field object if it has not already been created...
+    if (m_fields.size() < m_entries.size())
+    {
+        m_fields.resize(m_entries.size());
+    }
+    auto& field = m_fields[index];
+    if (!field)
+    {
+        field = createField(index);
+    }
+    return field;
 }
 
+// Adds a string field to the message.
 void MessageImpl::addField(const std::string& name, const std::string& value)
 {
-    addField(name, [&value](const FieldPtr& field) {field->setString(value);});
+    auto& entry = addEntry(name, Field::STRING);
+    entry.value.string = addToArena(value.data(), static_cast<int32_t>(value.size()));
 }
 
+// Adds a signed int32 field to the message.
 void MessageImpl::addField(const std::string& name, int32_t value)
 {
-    addField(name, [&value](const FieldPtr& field) {field->setSignedInt32(value);});
+    auto& entry = addEntry(name, Field::SIGNED_INT32);
+    entry.value.int32 = value;
 }
 
+// Adds a double field to the message.
 void MessageImpl::addField(const std::string& name, double value)
 {
-    addField(name, [&value](const FieldPtr& field) {field->setDouble(value);});
+    auto& entry = addEntry(name, Field::DOUBLE);
+    entry.value.dbl = value;
 }
 
+// Adds a message field to the message.
 void MessageImpl::addField(const std::string& name, const ConstMessagePtr& value)
 {
-    addField(name, [&value](const FieldPtr& field) {field->setMessage(value);});
+    auto& entry = addEntry(name, Field::MESSAGE);
+    entry.value.message.index = static_cast<int32_t>(m_messages.size());
+    entry.value.message.wirePosition = -1;
+    m_messages.push_back(value);
 }
 
-/// <summary>
-/// Private addField helper used by the public addField methods to create
-/// and set up a field and add it to the message.
-/// </summary>
-void MessageImpl::addField(const std::string& name, std::function<void(const FieldPtr&)> valueSetter)
+// Adds a signed int64 field to the message.
+void MessageImpl::addField(const std::string& name, int64_t value)
 {
-    // We create a field and set its name...
-    auto field = Field::create();
-    field->setName(name);
+    auto& entry = addEntry(name, Field::SIGNED_INT64);
+    entry.value.int64 = value;
+}
+
+// Adds an unsigned int64 field to the message.
+void MessageImpl::addField(const std::string& name, uint64_t value)
+{
+    auto& entry = addEntry(name, Field::UNSIGNED_INT64);
+    entry.value.uint64 = value;
+}
 
-    // We call the function (lambda) to set the value...
-    valueSetter(field);
+// Adds a bool field to the message.
+void MessageImpl::addField(const std::string& name, bool value)
+{
+    auto& entry = addEntry(name, Field::BOOL);
+    entry.value.boolean = value;
+}
+
+// Adds a string field to the message.
+// (This makes sure that string literals are not converted to bool.)
+void MessageImpl::addField(const std::string& name, const char* value)
+{
+    auto& entry = addEntry(name, Field::STRING);
+    entry.value.string = addToArena(value, static_cast<int32_t>(std::strlen(value)));
+}
+
+// Adds a byte array field to the message.
+void MessageImpl::addField(const std::string& name, const std::vector<uint8_t>& value)
+{
+    addArrayField(name, Field::BYTES, value);
+}
 
-    // We add the field to the list of fields...
-    m_fields.push_back(field);
+// Adds a double array field to the message.
+void MessageImpl::addField(const std::string& name, const std::vector<double>& value)
+{
+    addArrayField(name, Field::DOUBLE_ARRAY, value);
+}
+
+// Adds a signed int32 array field to the message.
+void MessageImpl::addField(const std::string& name, const std::vector<int32_t>& value)
+{
+    addArrayField(name, Field::SIGNED_INT32_ARRAY, value);
+}
 
-    // We add the field to the map of name->first-field-for-name...
-    m_mapNameToField.insert({ name, field });
+// Adds a signed int64 array field to the message.
+void MessageImpl::addField(const std::string& name, const std::vector<int64_t>& value)
+{
+    addArrayField(name, Field::SIGNED_INT64_ARRAY, value);
 }
 
-void MessageImpl::serialize(Buffer& buffer) const
+// Serialized the message to the current position in the buffer, with the encoding specified.
+// If pFieldNames is not null, field names are written using the dictionary (and added to it).
+void MessageImpl::serialize(Buffer& buffer, MessageEncoding encoding, FieldNameDictionary* pFieldNames) const
 {
+    // A lazy message is written unchanged from the buffer it was received
+    // in, if it is to be written with the same encoding and with full names...
+    buildEntries();
+    if (m_pWireData && m_wireEncoding == encoding && !pFieldNames)
+    {
+        buffer.write_bytes(m_pWireData + m_wirePosition, m_wireEnd - m_wirePosition);
+        return;
+    }
+
     // We write the number of fields...
-    auto fieldCount = static_cast<int32_t>(m_fields.size());
-    buffer.write_int32(fieldCount);
+    auto compact = (encoding == MessageEncoding::COMPACT);
+    writeCount(buffer, static_cast<int32_t>(m_entries.size()), encoding);
 
-    // We write each field...
-    for (auto& field : m_fields)
+    // We write each field. This is the same format as Field::serialize(), ie
+    // [name][data-type][value], for the standard encoding without a field-name dictionary...
+    for (auto& entry : m_entries)
     {
-        buffer.write_field(field);
+        writeName(buffer, entry, encoding, pFieldNames);
+
+        // In the compact encoding the data-type byte can also hold the length of a
+        // short string or byte array, or the value of a bool (see MessageEncoding)...
+        auto typeByte = static_cast<uint8_t>(entry.dataType);
+        if (compact)
+        {
+            if ((entry.dataType == Field::STRING || entry.dataType == Field::BYTES) && getItems(entry).size < 15)
+            {
+                typeByte |= static_cast<uint8_t>((getItems(entry).size + 1) << 4);
+            }
+            else if (entry.dataType == Field::BOOL && entry.value.boolean)
+            {
+                typeByte |= 0x10;
+            }
+        }
+        buffer.write_int8(static_cast<int8_t>(typeByte));
+
+        switch (entry.dataType)
+        {
+        case Field::STRING:
+        case Field::BYTES:
+        case Field::DOUBLE_ARRAY:
+        case Field::SIGNED_INT32_ARRAY:
+        case Field::SIGNED_INT64_ARRAY:
+            if ((typeByte >> 4) == 0)
+            {
+                writeCount(buffer, getItems(entry).size / getElementSize(entry.dataType), encoding);
+            }
+            writeItems(buffer, getItems(entry));
+            break;
+
+        case Field::SIGNED_INT32:
+            if (compact)
+            {
+                buffer.write_signed_varint(entry.value.int32);
+            }
+            else
+            {
+                buffer.write_int32(entry.value.int32);
+            }
+            break;
+
+        case Field::DOUBLE:
+            buffer.write_double(entry.value.dbl);
+            break;
+
+        case Field::MESSAGE:
+            buffer.write_message(getMessage(entry), encoding, pFieldNames);
+            break;
+
+        case Field::SIGNED_INT64:
+            if (compact)
+            {
+                buffer.write_signed_varint(entry.value.int64);
+            }
+            else
+            {
+                buffer.write_int64(entry.value.int64);
+            }
+            break;
+
+        case Field::UNSIGNED_INT64:
+            if (compact)
+            {
+                buffer.write_varint(entry.value.uint64);
+            }
+            else
+            {
+                buffer.write_uint64(entry.value.uint64);
+            }
+            break;
+
+        case Field::BOOL:
+            if (!compact)
+            {
+                buffer.write_bool(entry.value.boolean);
+            }
+            break;
+
+        default:
+            throw Exception("MessageImpl::serialize data-type not handled");
+        }
     }
 }
 
-void MessageImpl::deserialize(Buffer& buffer)
+// Deserializes the message with the encoding specified from the current position in the buffer.
+// If pFieldNames is not null, field names are read using the dictionary (and added to it).
+void MessageImpl::deserialize(Buffer& buffer, MessageEncoding encoding, FieldNameDictionary* pFieldNames)
 {
-    // We find the number of fields...
-    auto fieldCount = buffer.read_int32();
+    // The fields are added to any we already hold, so if we are a
+    // lazy message we stop referring to our buffer...
+    releaseBuffer();
+
+    // We find the number of fields. Each field is at least five bytes (two in the
+    // compact encoding), so we check the count against the data remaining in the
+    // buffer before reserving entries...
+    auto compact = (encoding == MessageEncoding::COMPACT);
+    auto fieldCount = readCount(buffer, encoding);
+    auto minimumFieldSize = compact ? 2 : 5;
+    if (fieldCount > (buffer.getBufferSize() - buffer.getPosition()) / minimumFieldSize)
+    {
+        throw Exception("MessageImpl::deserialize invalid field count");
+    }
+
+    // We reserve space for the entries. We do not know the size of the names and
+    // strings until we read them, so the arena grows as we read...
+    m_entries.reserve(m_entries.size() + fieldCount);
 
-    // We read each field and add them to the message...
+    // We read each field into a new entry...
     for (auto i = 0; i < fieldCount; ++i)
     {
-        auto field = buffer.read_field();
-        m_fields.push_back(field);
-        m_mapNameToField.insert({ field->getName(), field });
+        FieldEntry entry;
+        readName(buffer, entry, encoding, pFieldNames);
+
+        // In the compact encoding the high bits of the data-type byte can hold
+        // the length of a short string or byte array, or the value of a bool...
+        auto typeByte = static_cast<uint8_t>(buffer.read_int8());
+        int32_t extra = 0;
+        if (compact)
+        {
+            extra = typeByte >> 4;
+            typeByte &= 0x0f;
+        }
+        entry.dataType = static_cast<Field::DataType>(typeByte);
+
+        switch (entry.dataType)
+        {
+        case Field::STRING:
+            entry.value.string = readToArena(buffer, extra != 0 ? extra - 1 : readCount(buffer, encoding));
+            break;
+
+        case Field::BYTES:
+            entry.value.array = readToArena(buffer, extra != 0 ? extra - 1 : readCount(buffer, encoding));
+            break;
+
+        case Field::DOUBLE_ARRAY:
+        case Field::SIGNED_INT32_ARRAY:
+        case Field::SIGNED_INT64_ARRAY:
+            entry.value.array = readToArena(buffer, readCount(buffer, encoding), getElementSize(entry.dataType));
+            break;
+
+        case Field::SIGNED_INT32:
+            entry.value.int32 = compact ? static_cast<int32_t>(buffer.read_signed_varint()) : buffer.read_int32();
+            break;
+
+        case Field::DOUBLE:
+            entry.value.dbl = buffer.read_double();
+            break;
+
+        case Field::MESSAGE:
+            entry.value.message.index = static_cast<int32_t>(m_messages.size());
+            entry.value.message.wirePosition = -1;
+            m_messages.push_back(buffer.read_message(encoding, pFieldNames));
+            break;
+
+        case Field::SIGNED_INT64:
+            entry.value.int64 = compact ? buffer.read_signed_varint() : buffer.read_int64();
+            break;
+
+        case Field::UNSIGNED_INT64:
+            entry.value.uint64 = compact ? buffer.read_varint() : buffer.read_uint64();
+            break;
+
+        case Field::BOOL:
+            entry.value.boolean = compact ? (extra != 0) : buffer.read_bool();
+            break;
+
+        default:
+            throw Exception("MessageImpl::deserialize data-type not handled");
+        }
+        m_entries.push_back(entry);
+    }
+}
+
+// Deserializes the message with the encoding specified at the position in the buffer lazily,
+// decoding fields only when they are asked for. The message holds a reference to the buffer.
+void MessageImpl::deserializeLazily(const BufferPtr& pBuffer, int32_t position, MessageEncoding encoding)
+{
+    // We can only refer to one buffer, so a message which already holds
+    // fields is deserialized in the usual way...
+    if (!m_entries.empty() || m_pWireData)
+    {
+        pBuffer->setPosition(position);
+        deserialize(*pBuffer, encoding, nullptr);
+        return;
+    }
+
+    // We hold the buffer and the position of the message in it. We do not read
+    // anything from it until a field is asked for...
+    m_pWireBuffer = pBuffer;
+    m_pWireData = pBuffer->getData();
+    m_wireSize = pBuffer->getBufferSize();
+    m_wirePosition = position;
+    m_wireEncoding = encoding;
+    m_hasEntries = false;
+}
+
+// Adds an entry for a field with the name specified, and returns it.
+MessageImpl::FieldEntry& MessageImpl::addEntry(const std::string& name, Field::DataType dataType)
+{
+    // If we are a lazy message we stop referring to our buffer, so that
+    // all the entries refer to the arena...
+    releaseBuffer();
+
+    FieldEntry entry;
+    entry.name = addToArena(name.data(), static_cast<int32_t>(name.size()));
+    entry.nameHash = FieldKey::hash(name.data(), name.size());
+    entry.dataType = dataType;
+    m_entries.push_back(entry);
+    return m_entries.back();
+}
+
+// Copies the data to the end of the arena, and returns its range.
+MessageImpl::ArenaRange MessageImpl::addToArena(const char* pData, int32_t size)
+{
+    ArenaRange range{ static_cast<int32_t>(m_arena.size()), size };
+    m_arena.insert(m_arena.end(), pData, pData + size);
+    return range;
+}
+
+// Reads the items of a string or array from the buffer to the end of the arena, and
+// returns their range. elementSize is the size of each item.
+MessageImpl::ArenaRange MessageImpl::readToArena(Buffer& buffer, int32_t count, int32_t elementSize)
+{
+    // We read the items directly into the arena, without creating a std::string
+    // or std::vector. The size of the items is checked when they are read...
+    if (count > INT32_MAX / elementSize)
+    {
+        throw Exception("MessageImpl::deserialize invalid string or array length");
+    }
+    auto length = count * elementSize;
+    ArenaRange range{ static_cast<int32_t>(m_arena.size()), length };
+    if (length > 0)
+    {
+        m_arena.resize(m_arena.size() + length);
+        buffer.read_bytes(m_arena.data() + range.offset, length);
+    }
+    return range;
+}
+
+// Writes the name of the entry to the buffer, as a reference to the field-name dictionary
+// if it holds the name, or in full (adding it to the dictionary) if not.
+void MessageImpl::writeName(Buffer& buffer, const FieldEntry& entry, MessageEncoding encoding, FieldNameDictionary* pFieldNames) const
+{
+    // Without a dictionary the name is written as its length and chars...
+    if (!pFieldNames)
+    {
+        writeCount(buffer, entry.name.size, encoding);
+        writeItems(buffer, entry.name);
+        return;
+    }
+
+    // With a dictionary we write an odd token holding the ID if the name is in it.
+    // Otherwise we write an even token holding the length, followed by the name, which
+    // the reader and writer both add to their dictionaries (see FieldNameDictionary)...
+    auto pName = getChars() + entry.name.offset;
+    auto id = pFieldNames->find(pName, entry.name.size, entry.nameHash);
+    if (id != -1)
+    {
+        writeCount(buffer, id * 2 + 1, encoding);
+        return;
+    }
+    if (entry.name.size > INT32_MAX / 2)
+    {
+        throw Exception("MessageImpl::serialize field name too long");
+    }
+    writeCount(buffer, entry.name.size * 2, encoding);
+    writeItems(buffer, entry.name);
+    pFieldNames->add(pName, entry.name.size, entry.nameHash);
+}
+
+// Reads a field name written by writeName() from the buffer into the entry.
+void MessageImpl::readName(Buffer& buffer, FieldEntry& entry, MessageEncoding encoding, FieldNameDictionary* pFieldNames)
+{
+    auto token = readCount(buffer, encoding);
+    if (!pFieldNames)
+    {
+        entry.name = readToArena(buffer, token);
+        entry.nameHash = FieldKey::hash(m_arena.data() + entry.name.offset, entry.name.size);
+        return;
+    }
+
+    // An odd token is the ID of a name in the dictionary, which we copy into the arena.
+    // An even token is the length of a name which follows, and which we add to it...
+    if (token & 1)
+    {
+        auto id = token / 2;
+        auto& name = pFieldNames->getName(id);
+        entry.name = addToArena(name.data(), static_cast<int32_t>(name.size()));
+        entry.nameHash = pFieldNames->getNameHash(id);
+    }
+    else
+    {
+        entry.name = readToArena(buffer, token / 2);
+        entry.nameHash = FieldKey::hash(m_arena.data() + entry.name.offset, entry.name.size);
+        pFieldNames->add(m_arena.data() + entry.name.offset, entry.name.size, entry.nameHash);
+    }
+}
+
+// Writes the items of a string or array held by the message to the buffer.
+void MessageImpl::writeItems(Buffer& buffer, const ArenaRange& range) const
+{
+    if (range.size > 0)
+    {
+        buffer.write_bytes(getChars() + range.offset, range.size);
+    }
+}
+
+// Reads a field count or string or array length with the encoding specified from the buffer.
+int32_t MessageImpl::readCount(Buffer& buffer, MessageEncoding encoding)
+{
+    int64_t count = (encoding == MessageEncoding::COMPACT) ? static_cast<int64_t>(buffer.read_varint() & INT64_MAX) : buffer.read_int32();
+    if (count < 0 || count > INT32_MAX)
+    {
+        throw Exception("MessageImpl::deserialize invalid count");
+    }
+    return static_cast<int32_t>(count);
+}
+
+// Writes a field count or string or array length with the encoding specified to the buffer.
+void MessageImpl::writeCount(Buffer& buffer, int32_t count, MessageEncoding encoding)
+{
+    if (encoding == MessageEncoding::COMPACT)
+    {
+        buffer.write_varint(static_cast<uint64_t>(count));
+    }
+    else
+    {
+        buffer.write_int32(count);
+    }
+}
+
+// Returns the range of the items held by a string, byte array or array field.
+const MessageImpl::ArenaRange& MessageImpl::getItems(const FieldEntry& entry)
+{
+    return (entry.dataType == Field::STRING) ? entry.value.string : entry.value.array;
+}
+
+// Returns the size of the items in a field of a string or array data-type, or
+// zero for other data-types.
+int32_t MessageImpl::getElementSize(Field::DataType dataType)
+{
+    switch (dataType)
+    {
+    case Field::STRING:
+    case Field::BYTES:
+        return static_cast<int32_t>(sizeof(uint8_t));
+
+    case Field::DOUBLE_ARRAY:
+        return static_cast<int32_t>(sizeof(double));
+
+    case Field::SIGNED_INT32_ARRAY:
+        return static_cast<int32_t>(sizeof(int32_t));
+
+    case Field::SIGNED_INT64_ARRAY:
+        return static_cast<int32_t>(sizeof(int64_t));
+
+    default:
+        return 0;
+    }
+}
+
+// Adds an array field to the message, copying the items into the arena.
+template <typename T>
+void MessageImpl::addArrayField(const std::string& name, Field::DataType dataType, const std::vector<T>& value)
+{
+    auto& entry = addEntry(name, dataType);
+    entry.value.array = addToArena(reinterpret_cast<const char*>(value.data()), static_cast<int32_t>(value.size() * sizeof(T)));
+}
+
+// Returns a copy of an array held in the arena (or the buffer of a lazy message).
+// The items may not be aligned in the arena, so we copy them with memcpy...
+template <typename T>
+std::vector<T> MessageImpl::copyArray(const ArenaRange& range) const
+{
+    std::vector<T> result(static_cast<size_t>(range.size) / sizeof(T));
+    if (!result.empty())
+    {
+        std::memcpy(result.data(), getChars() + range.offset, range.size);
+    }
+    return result;
+}
+
+// Returns the index of the first field with the name specified, or -1 if
+// there is no field with the name.
+int32_t MessageImpl::findField(const std::string& name, uint32_t nameHash) const
+{
+    // We scan the entries of small messages in order...
+    auto entryCount = static_cast<int32_t>(m_entries.size());
+    if (entryCount <= FIELD_INDEX_THRESHOLD)
+    {
+        for (int32_t i = 0; i < entryCount; ++i)
+        {
+            if (hasName(i, name, nameHash))
+            {
+                return i;
+            }
+        }
+        return -1;
+    }
+
+    // We look up the entries of larger messages in the field index...
+    updateFieldIndex();
+    auto mask = static_cast<uint32_t>(m_fieldIndex.size() - 1);
+    for (auto slot = nameHash & mask; m_fieldIndex[slot] != -1; slot = (slot + 1) & mask)
+    {
+        if (hasName(m_fieldIndex[slot], name, nameHash))
+        {
+            return m_fieldIndex[slot];
+        }
+    }
+    return -1;
+}
+
+// Returns true if the entry at the index has the name specified.
+bool MessageImpl::hasName(int32_t index, const std::string& name, uint32_t nameHash) const
+{
+    // We only compare the names if the hashes match...
+    auto& entry = m_entries[index];
+    auto nameSize = static_cast<int32_t>(name.size());
+    return entry.nameHash == nameHash
+        && entry.name.size == nameSize
+        && (nameSize == 0 || std::memcmp(getChars() + entry.name.offset, name.data(), nameSize) == 0);
+}
+
+// Adds entries which are not yet in the field index to it, resizing it if needed.
+void MessageImpl::updateFieldIndex() const
+{
+    auto entryCount = static_cast<int32_t>(m_entries.size());
+    if (m_indexedCount == entryCount)
+    {
+        return;
+    }
+
+    // We keep the index at most half full. If it needs to grow we rebuild it...
+    if (static_cast<size_t>(entryCount) * 2 > m_fieldIndex.size())
+    {
+        size_t size = 32;
+        while (size < static_cast<size_t>(entryCount) * 2)
+        {
+            size *= 2;
+        }
+        m_fieldIndex.assign(size, -1);
+        m_indexedCount = 0;
+    }
+
+    // We add the new entries. The index holds the first entry for each name,
+    // so an entry is not added if an earlier entry has the same name...
+    auto mask = static_cast<uint32_t>(m_fieldIndex.size() - 1);
+    auto pChars = getChars();
+    for (auto i = m_indexedCount; i < entryCount; ++i)
+    {
+        auto& entry = m_entries[i];
+        auto slot = entry.nameHash & mask;
+        for (; m_fieldIndex[slot] != -1; slot = (slot + 1) & mask)
+        {
+            auto& other = m_entries[m_fieldIndex[slot]];
+            if (other.nameHash == entry.nameHash
+                && other.name.size == entry.name.size
+                && (entry.name.size == 0 || std::memcmp(pChars + other.name.offset, pChars + entry.name.offset, entry.name.size) == 0))
+            {
+                break;
+            }
+        }
+        if (m_fieldIndex[slot] == -1)
+        {
+            m_fieldIndex[slot] = i;
+        }
+    }
+    m_indexedCount = entryCount;
+}
+
+// Creates a Field object from the entry at the index specified.
+ConstFieldPtr MessageImpl::createField(int32_t index) const
+{
+    auto pChars = getChars();
+    auto& entry = m_entries[index];
+    auto field = Field::create();
+    field->setName(std::string(pChars + entry.name.offset, entry.name.size));
+    switch (entry.dataType)
+    {
+    case Field::STRING:
+        field->setString(std::string(pChars + entry.value.string.offset, entry.value.string.size));
+        break;
+
+    case Field::SIGNED_INT32:
+        field->setSignedInt32(entry.value.int32);
+        break;
+
+    case Field::DOUBLE:
+        field->setDouble(entry.value.dbl);
+        break;
+
+    case Field::MESSAGE:
+        field->setMessage(getMessage(entry));
+        break;
+
+    case Field::SIGNED_INT64:
+        field->setSignedInt64(entry.value.int64);
+        break;
+
+    case Field::UNSIGNED_INT64:
+        field->setUnsignedInt64(entry.value.uint64);
+        break;
+
+    case Field::BOOL:
+        field->setBool(entry.value.boolean);
+        break;
+
+    case Field::BYTES:
+        field->setBytes(copyArray<uint8_t>(entry.value.array));
+        break;
+
+    case Field::DOUBLE_ARRAY:
+        field->setDoubleArray(copyArray<double>(entry.value.array));
+        break;
+
+    case Field::SIGNED_INT32_ARRAY:
+        field->setSignedInt32Array(copyArray<int32_t>(entry.value.array));
+        break;
+
+    case Field::SIGNED_INT64_ARRAY:
+        field->setSignedInt64Array(copyArray<int64_t>(entry.value.array));
+        break;
+
+    default:
+        throw Exception("MessageImpl::createField data-type not handled");
+    }
+    return field;
+}
+
+// Returns the message held by the entry, deserializing it if it is in the buffer
+// of a lazy message and has not been deserialized yet.
+const ConstMessagePtr& MessageImpl::getMessage(const FieldEntry& entry) const
+{
+    auto& pMessage = m_messages[entry.value.message.index];
+    if (!pMessage && entry.value.message.wirePosition != -1)
+    {
+        // The nested message is also deserialized lazily, from the same buffer...
+        auto pNestedMessage = Message::create();
+        pNestedMessage->m_pImpl->deserializeLazily(m_pWireBuffer, entry.value.message.wirePosition, m_wireEncoding);
+        pMessage = pNestedMessage;
+    }
+    return pMessage;
+}
+
+// Builds the entries for a lazy message if they have not already been built.
+void MessageImpl::buildEntries() const
+{
+    if (!m_pWireData || m_hasEntries)
+    {
+        return;
+    }
+
+    try
+    {
+        // We read the number of fields. Each field is at least five bytes (two in
+        // the compact encoding), so we check the count against the data we hold
+        // before reserving entries...
+        auto position = m_wirePosition;
+        auto fieldCount = readCount(position);
+        auto minimumFieldSize = (m_wireEncoding == MessageEncoding::COMPACT) ? 2 : 5;
+        if (fieldCount > (m_wireSize - position) / minimumFieldSize)
+        {
+            throw Exception("MessageImpl::buildEntries invalid field count");
+        }
+        m_entries.reserve(fieldCount);
+
+        // We scan each field to build its entry. Nested messages are skipped, and
+        // have a null message until they are asked for...
+        for (auto i = 0; i < fieldCount; ++i)
+        {
+            FieldEntry entry;
+            position = scanField(position, entry);
+            if (entry.dataType == Field::MESSAGE)
+            {
+                entry.value.message.index = static_cast<int32_t>(m_messages.size());
+                m_messages.push_back(nullptr);
+            }
+            m_entries.push_back(entry);
+        }
+        m_wireEnd = position;
+        m_hasEntries = true;
+    }
+    catch (...)
+    {
+        // We do not keep a partial set of entries...
+        m_entries.clear();
+        m_messages.clear();
+        throw;
+    }
+}
+
+// Copies the names and strings of a lazy message into the arena, and releases
+// the buffer, so that the message no longer refers to it.
+void MessageImpl::releaseBuffer()
+{
+    if (!m_pWireData)
+    {
+        return;
+    }
+
+    // We copy the names and strings and update the entries to refer to the copies.
+    // Nested messages are deserialized (lazily) so that they hold the buffer themselves...
+    buildEntries();
+    for (auto& entry : m_entries)
+    {
+        entry.name = addToArena(m_pWireData + entry.name.offset, entry.name.size);
+        if (entry.dataType == Field::STRING)
+        {
+            entry.value.string = addToArena(m_pWireData + entry.value.string.offset, entry.value.string.size);
+        }
+        else if (getElementSize(entry.dataType) != 0)
+        {
+            entry.value.array = addToArena(m_pWireData + entry.value.array.offset, entry.value.array.size);
+        }
+        else if (entry.dataType == Field::MESSAGE)
+        {
+            getMessage(entry);
+            entry.value.message.wirePosition = -1;
+        }
+    }
+
+    m_pWireBuffer = nullptr;
+    m_pWireData = nullptr;
+    m_wireSize = 0;
+    m_wirePosition = 0;
+    m_hasEntries = false;
+    m_wireEnd = 0;
+}
+
+// Reads the field at the position in the buffer of a lazy message into the entry.
+// Returns the position after the field.
+int32_t MessageImpl::scanField(int32_t position, FieldEntry& entry) const
+{
+    // Numbers are read into the entry, and strings and arrays are referred to
+    // by their range in the buffer. See deserialize() for the format...
+    auto compact = (m_wireEncoding == MessageEncoding::COMPACT);
+    entry.name = readRange(position, readCount(position));
+    entry.nameHash = FieldKey::hash(m_pWireData + entry.name.offset, entry.name.size);
+
+    uint8_t typeByte;
+    readCopyable(position, typeByte);
+    int32_t extra = 0;
+    if (compact)
+    {
+        extra = typeByte >> 4;
+        typeByte &= 0x0f;
+    }
+    entry.dataType = static_cast<Field::DataType>(typeByte);
+
+    switch (entry.dataType)
+    {
+    case Field::STRING:
+        entry.value.string = readRange(position, extra != 0 ? extra - 1 : readCount(position));
+        break;
+
+    case Field::BYTES:
+        entry.value.array = readRange(position, extra != 0 ? extra - 1 : readCount(position));
+        break;
+
+    case Field::DOUBLE_ARRAY:
+    case Field::SIGNED_INT32_ARRAY:
+    case Field::SIGNED_INT64_ARRAY:
+        entry.value.array = readRange(position, readCount(position), getElementSize(entry.dataType));
+        break;
+
+    case Field::SIGNED_INT32:
+        if (compact)
+        {
+            entry.value.int32 = static_cast<int32_t>(readSignedVarint(position));
+        }
+        else
+        {
+            readCopyable(position, entry.value.int32);
+        }
+        break;
+
+    case Field::DOUBLE:
+        readCopyable(position, entry.value.dbl);
+        break;
+
+    case Field::MESSAGE:
+        entry.value.message.index = -1;
+        entry.value.message.wirePosition = position;
+        position = skipMessage(position);
+        break;
+
+    case Field::SIGNED_INT64:
+        if (compact)
+        {
+            entry.value.int64 = readSignedVarint(position);
+        }
+        else
+        {
+            readCopyable(position, entry.value.int64);
+        }
+        break;
+
+    case Field::UNSIGNED_INT64:
+        if (compact)
+        {
+            entry.value.uint64 = readVarint(position);
+        }
+        else
+        {
+            readCopyable(position, entry.value.uint64);
+        }
+        break;
+
+    case Field::BOOL:
+        if (compact)
+        {
+            entry.value.boolean = (extra != 0);
+        }
+        else
+        {
+            int8_t value;
+            readCopyable(position, value);
+            entry.value.boolean = (value != 0);
+        }
+        break;
+
+    default:
+        throw Exception("MessageImpl::scanField data-type not handled");
+    }
+    return position;
+}
+
+// Returns the position after the message at the position in the buffer of a lazy message.
+int32_t MessageImpl::skipMessage(int32_t position) const
+{
+    auto fieldCount = readCount(position);
+    FieldEntry entry;
+    for (auto i = 0; i < fieldCount; ++i)
+    {
+        position = scanField(position, entry);
+    }
+    return position;
+}
+
+// Reads the items of a string or array at the position in the buffer of a lazy message,
+// and returns their range. Updates the position to after the items.
+MessageImpl::ArenaRange MessageImpl::readRange(int32_t& position, int32_t count, int32_t elementSize) const
+{
+    if (count > (m_wireSize - position) / elementSize)
+    {
+        throw Exception("MessageImpl::readRange invalid string or array length");
+    }
+    auto length = count * elementSize;
+    ArenaRange range{ position, length };
+    position += length;
+    return range;
+}
+
+// Reads a field count or string or array length at the position in the buffer of
+// a lazy message. Updates the position to after the count.
+int32_t MessageImpl::readCount(int32_t& position) const
+{
+    int64_t count;
+    if (m_wireEncoding == MessageEncoding::COMPACT)
+    {
+        count = static_cast<int64_t>(readVarint(position) & INT64_MAX);
+    }
+    else
+    {
+        int32_t value;
+        readCopyable(position, value);
+        count = value;
+    }
+    if (count < 0 || count > INT32_MAX)
+    {
+        throw Exception("MessageImpl::readCount invalid count");
+    }
+    return static_cast<int32_t>(count);
+}
+
+// Reads a LEB128 varint at the position in the buffer of a lazy message.
+// Updates the position to after the varint.
+uint64_t MessageImpl::readVarint(int32_t& position) const
+{
+    uint64_t value;
+    auto size = Buffer::decodeVarint(m_pWireData + position, m_wireSize - position, value);
+    if (size == 0)
+    {
+        throw Exception("MessageImpl: Invalid varint");
+    }
+    position += size;
+    return value;
+}
+
+// Reads a zig-zag encoded LEB128 varint at the position in the buffer of a
+// lazy message. Updates the position to after the varint.
+int64_t MessageImpl::readSignedVarint(int32_t& position) const
+{
+    auto value = readVarint(position);
+    return static_cast<int64_t>((value >> 1) ^ (~(value & 1) + 1));
+}
+
+// Reads an item at the position in the buffer of a lazy message using
+// memcpy. Updates the position to after the item.
+template <typename T>
+void MessageImpl::readCopyable(int32_t& position, T& item) const
+{
+    auto size = static_cast<int32_t>(sizeof(T));
+    if (position < 0 || size > m_wireSize - position)
+    {
+        throw Exception("MessageImpl: Read beyond end of buffer");
     }
+    std::memcpy(&item, m_pWireData + position, size);
+    position += size;
 }
@@ -1,13 +1,69 @@
 #pragma once
 #include <vector>
-#include <map>
+#include <deque>
 #include <string>
-#include <functional>
 #include "SharedPointers.h"
+#include "Field.h"
+#include "FieldKey.h"
+#include "MessageEncoding.h"
 
 namespace MessagingMesh
 {
-    // Implementation of Message functionality.
+    // Forward declarations...
+    class FieldNameDictionary;
+
+    /// <summary>
+    /// Implementation of Message functionality.
+    ///
+    /// Field storage
+    /// -------------
+    /// We do not hold a Field object for each field. Instead each field is held as an entry
+    /// in a vector, with the field's name and any string value held in one arena of chars.
+    /// Entries refer to the arena by offset, so it can grow without the entries changing.
+    /// Numeric values are held in the entry itself, and nested messages in a separate vector.
+    ///
+    /// Byte arrays and arrays of numbers are held in the arena in the same way as strings.
+    ///
+    /// So adding fields, or deserializing a message, only allocates when the vectors need to
+    /// grow, rather than allocating a Field, a FieldImpl and strings for each field.
+    ///
+    /// Field objects
+    /// -------------
+    /// getField() returns a Field, so we create Field objects from the entries when they are
+    /// first asked for, and keep them for later calls. getField() returns a reference to the
+    /// Field held by the message, so we hold them in a deque, which does not move them when
+    /// it grows for fields added (and asked for) later.
+    ///
+    /// Finding fields
+    /// --------------
+    /// Each entry holds the hash of its name (see FieldKey), so when finding a field we
+    /// only compare the names of entries whose hash matches. Messages with a few fields
+    /// are scanned in order. For larger messages we build an open-addressed index of the
+    /// first entry for each name, which is updated as fields are added.
+    ///
+    /// Lazy deserialization
+    /// --------------------
+    /// A message deserialized with deserializeLazily() does not decode its fields. It holds
+    /// a reference to the Buffer and the position of the message in it. When a field is
+    /// first asked for we scan the message once to build the entries, with the names and
+    /// string values referring to the data in the Buffer rather than to the arena. Nested
+    /// messages are skipped over by the scan, and are only deserialized (again lazily) when
+    /// their field is asked for. Serializing a lazy message with the encoding it was received
+    /// in copies its bytes unchanged.
+    ///
+    /// A message whose field names refer to a FieldNameDictionary cannot be deserialized
+    /// lazily, as the dictionary must be updated in the order messages are received.
+    ///
+    /// If fields are added to a lazy message, we copy the names and strings into the arena
+    /// and release the Buffer, so that the message can be updated as normal.
+    ///
+    /// Note: A lazy message keeps the Buffer, and for a view the receive buffer holding it,
+    ///       alive until the message is released.
+    ///
+    /// Note: Field objects, the entries of a lazy message and its nested messages are created
+    ///       by (const) getField(), so a message should not be read from multiple threads at
+    ///       the same time.
+    /// </summary>
     class MessageImpl
     {
     // Public methods...
@@ -22,38 +78,238 @@ namespace MessagingMesh
         // Throws a MessagingMesh::Exception if the field is not in the message.
         const ConstFieldPtr& getField(const std::string& name) const;
 
-        // Serialized the message to the current position in the buffer.
-        void serialize(Buffer& buffer) const;
+        // Gets a field by key.
+        // Throws a MessagingMesh::Exception if the field is not in the message.
+        const ConstFieldPtr& getField(const FieldKey& key) const;
+
+        // Serialized the message to the current position in the buffer, with the encoding specified.
+        // If pFieldNames is not null, field names are written using the dictionary (and added to it).
+        void serialize(Buffer& buffer, MessageEncoding encoding, FieldNameDictionary* pFieldNames) const;
+
+        // Deserializes the message with the encoding specified from the current position in the buffer.
+        // If pFieldNames is not null, field names are read using the dictionary (and added to it).
+        void deserialize(Buffer& buffer, MessageEncoding encoding, FieldNameDictionary* pFieldNames);
 
-        // Deserializes the message from the current position in the buffer.
-        void deserialize(Buffer& buffer);
+        // Deserializes the message with the encoding specified at the position in the buffer lazily,
+        // decoding fields only when they are asked for. The message holds a reference to the buffer.
+        void deserializeLazily(const BufferPtr& pBuffer, int32_t position, MessageEncoding encoding);
 
     // Helper methods to add fields of various types...
     public:
-        // Adds a string field to the message. 
+        // Adds a string field to the message.
         void addField(const std::string& name, const std::string& value);
 
-        // Adds a signed int32 field to the message. 
+        // Adds a signed int32 field to the message.
         void addField(const std::string& name, int32_t value);
 
-        // Adds a double field to the message. 
+        // Adds a double field to the message.
         void addField(const std::string& name, double value);
 
-        // Adds a message field to the message. 
+        // Adds a message field to the message.
         void addField(const std::string& name, const ConstMessagePtr& value);
-    
+
+        // Adds a signed int64 field to the message.
+        void addField(const std::string& name, int64_t value);
+
+        // Adds an unsigned int64 field to the message.
+        void addField(const std::string& name, uint64_t value);
+
+        // Adds a bool field to the message.
+        void addField(const std::string& name, bool value);
+
+        // Adds a string field to the message.
+        // (This makes sure that string literals are not converted to bool.)
+        void addField(const std::string& name, const char* value);
+
+        // Adds a byte array field to the message.
+        void addField(const std::string& name, const std::vector<uint8_t>& value);
+
+        // Adds a double array field to the message.
+        void addField(const std::string& name, const std::vector<double>& value);
+
+        // Adds a signed int32 array field to the message.
+        void addField(const std::string& name, const std::vector<int32_t>& value);
+
+        // Adds a signed int64 array field to the message.
+        void addField(const std::string& name, const std::vector<int64_t>& value);
+
+    // Private types...
+    private:
+        // A range of chars in the arena.
+        struct ArenaRange
+        {
+            int32_t offset;
+            int32_t size;
+        };
+
+        // A field in the message.
+        struct FieldEntry
+        {
+            // The field name, in the arena, and its hash...
+            ArenaRange name;
+            uint32_t nameHash;
+
+            // The type of data held by the field...
+            Field::DataType dataType;
+
+            // The value. (Strings and arrays are held in the arena, with the range of an array
+            // being its size in bytes, and messages are held in m_messages.)
+            // For a nested message in a lazy message, wirePosition is the position of the
+            // nested message in the buffer. It is -1 for other messages.
+            union
+            {
+                int32_t int32;
+                double dbl;
+                int64_t int64;
+                uint64_t uint64;
+                bool boolean;
+                ArenaRange string;
+                ArenaRange array;
+                struct
+                {
+                    int32_t index;
+                    int32_t wirePosition;
+                } message;
+            } value;
+        };
+
     // Private functions...
     private:
-        // Adds a field to the message, setting its value using the valueSetter function (lambda).
-        void addField(const std::string& name, std::function<void(const FieldPtr&)> valueSetter);
+        // Adds an entry for a field with the name specified, and returns it.
+        FieldEntry& addEntry(const std::string& name, Field::DataType dataType);
+
+        // Copies the data to the end of the arena, and returns its range.
+        ArenaRange addToArena(const char* pData, int32_t size);
+
+        // Reads the items of a string or array from the buffer to the end of the arena, and
+        // returns their range. elementSize is the size of each item.
+        ArenaRange readToArena(Buffer& buffer, int32_t count, int32_t elementSize = 1);
+
+        // Writes the name of the entry to the buffer, as a reference to the field-name dictionary
+        // if it holds the name, or in full (adding it to the dictionary) if not.
+        void writeName(Buffer& buffer, const FieldEntry& entry, MessageEncoding encoding, FieldNameDictionary* pFieldNames) const;
+
+        // Reads a field name written by writeName() from the buffer into the entry.
+        void readName(Buffer& buffer, FieldEntry& entry, MessageEncoding encoding, FieldNameDictionary* pFieldNames);
+
+        // Writes the items of a string or array held by the message to the buffer.
+        void writeItems(Buffer& buffer, const ArenaRange& range) const;
+
+        // Reads a field count or string or array length with the encoding specified from the buffer.
+        static int32_t readCount(Buffer& buffer, MessageEncoding encoding);
+
+        // Writes a field count or string or array length with the encoding specified to the buffer.
+        static void writeCount(Buffer& buffer, int32_t count, MessageEncoding encoding);
+
+        // Returns the range of the items held by a string, byte array or array field.
+        static const ArenaRange& getItems(const FieldEntry& entry);
+
+        // Returns the size of the items in a field of a string or array data-type, or
+        // zero for other data-types.
+        static int32_t getElementSize(Field::DataType dataType);
+
+        // Adds an array field to the message, copying the items into the arena.
+        template <typename T> void addArrayField(const std::string& name, Field::DataType dataType, const std::vector<T>& value);
+
+        // Returns a copy of an array held in the arena (or the buffer of a lazy message).
+        template <typename T> std::vector<T> copyArray(const ArenaRange& range) const;
+
+        // Gets the field with the name and name-hash specified.
+        // Throws a MessagingMesh::Exception if the field is not in the message.
+        const ConstFieldPtr& getField(const std::string& name, uint32_t nameHash) const;
+
+        // Returns the index of the first field with the name specified, or -1 if
+        // there is no field with the name.
+        int32_t findField(const std::string& name, uint32_t nameHash) const;
+
+        // Returns true if the entry at the index has the name specified.
+        bool hasName(int32_t index, const std::string& name, uint32_t nameHash) const;
+
+        // Adds entries which are not yet in the field index to it, resizing it if needed.
+        void updateFieldIndex() const;
+
+        // Creates a Field object from the entry at the index specified.
+        ConstFieldPtr createField(int32_t index) const;
+
+        // Returns the chars that the name and string ranges in the entries refer to.
+        // These are in the buffer for a lazy message, and in the arena otherwise.
+        const char* getChars() const { return m_pWireData ? m_pWireData : m_arena.data(); }
+
+        // Returns the message held by the entry, deserializing it if it is in the buffer
+        // of a lazy message and has not been deserialized yet.
+        const ConstMessagePtr& getMessage(const FieldEntry& entry) const;
+
+        // Builds the entries for a lazy message if they have not already been built.
+        void buildEntries() const;
+
+        // Copies the names and strings of a lazy message into the arena, and releases
+        // the buffer, so that the message no longer refers to it.
+        void releaseBuffer();
+
+        // Reads the field at the position in the buffer of a lazy message into the entry.
+        // Returns the position after the field.
+        int32_t scanField(int32_t position, FieldEntry& entry) const;
+
+        // Returns the position after the message at the position in the buffer of a lazy message.
+        int32_t skipMessage(int32_t position) const;
+
+        // Reads the items of a string or array at the position in the buffer of a lazy message,
+        // and returns their range. Updates the position to after the items.
+        ArenaRange readRange(int32_t& position, int32_t count, int32_t elementSize = 1) const;
+
+        // Reads a field count or string or array length at the position in the buffer of
+        // a lazy message. Updates the position to after the count.
+        int32_t readCount(int32_t& position) const;
+
+        // Reads a LEB128 varint at the position in the buffer of a lazy message.
+        // Updates the position to after the varint.
+        uint64_t readVarint(int32_t& position) const;
+
+        // Reads a zig-zag encoded LEB128 varint at the position in the buffer of a
+        // lazy message. Updates the position to after the varint.
+        int64_t readSignedVarint(int32_t& position) const;
+
+        // Reads an item at the position in the buffer of a lazy message using
+        // memcpy. Updates the position to after the item.
+        template <typename T> void readCopyable(int32_t& position, T& item) const;
 
     // Private data...
     private:
-        // Vector of fields in the message, in the order they were added...
-        std::vector<ConstFieldPtr> m_fields;
+        // Fields in the message, in the order they were added.
+        // (These are built by getField() for a lazy message, so they are mutable.)
+        mutable std::vector<FieldEntry> m_entries;
+
+        // Field names and string values...
+        std::vector<char> m_arena;
+
+        // Values of message fields. For a lazy message these are null until they are asked for...
+        mutable std::vector<ConstMessagePtr> m_messages;
+
+        // For a lazy message, the buffer holding it, its data and size, and the position
+        // and encoding of the message in it. m_pWireData is null if the message is not lazy...
+        BufferPtr m_pWireBuffer;
+        const char* m_pWireData = nullptr;
+        int32_t m_wireSize = 0;
+        int32_t m_wirePosition = 0;
+        MessageEncoding m_wireEncoding = MessageEncoding::STANDARD;
+
+        // For a lazy message, whether the entries have been built, and the position
+        // after the end of the message (which we know once they have been built)...
+        mutable bool m_hasEntries = false;
+        mutable int32_t m_wireEnd = 0;
+
+        // Field objects created by getField(), by field index. This is a deque so that the
+        // references returned by getField() stay valid when it grows...
+        mutable std::deque<ConstFieldPtr> m_fields;
+
+        // Messages with more fields than this are searched using the field index...
+        static const int32_t FIELD_INDEX_THRESHOLD = 8;
 
-        // Map of field name to the first field with that name...
-        std::map<std::string, ConstFieldPtr> m_mapNameToField;
+        // Open-addressed index of the first entry for each field name, by name-hash. Slots
+        // hold entry indexes, or -1 if empty. The size is a power of two. m_indexedCount is
+        // the number of entries which have been added to the index...
+        mutable std::vector<int32_t> m_fieldIndex;
+        mutable int32_t m_indexedCount = 0;
     };
 } // namespace
 
@@ -1,6 +1,8 @@
 #include "NetworkMessage.h"
 #include "Message.h"
+#include "Buffer.h"
 #include "Logger.h"
+#include "Exception.h"
 using namespace MessagingMesh;
 
 // Constructor.
@@ -27,14 +29,18 @@ void NetworkMessage::setMessage(const MessagePtr& pMessage)
 }
 
 // Serializes the network message to the current position of the buffer.
-void NetworkMessage::serialize(Buffer& buffer) const
+// pFieldNames is the dictionary for the connection, used if the header says so.
+void NetworkMessage::serialize(Buffer& buffer, FieldNameDictionary* pFieldNames) const
 {
     // Header...
     m_header.serialize(buffer);
 
     // Message.
     createMessageIfItDoesNotExist();
-    m_pMessage->serialize(buffer);
+    m_pMessage->serialize(buffer, m_header.getMessageEncoding(), getFieldNames(pFieldNames));
+
+    // We write the size, so that the buffer can be shared with other threads...
+    buffer.finalizeSize();
 }
 
 // Deserializes the network message from the current position in the buffer.
@@ -51,10 +57,25 @@ void NetworkMessage::deserializeHeader(Buffer& buffer)
 }
 
 // Deserializes the message from the current position in the buffer.
-void NetworkMessage::deserializeMessage(Buffer& buffer)
+// pFieldNames is the dictionary for the connection, used if the header says so.
+void NetworkMessage::deserializeMessage(Buffer& buffer, FieldNameDictionary* pFieldNames)
 {
     createMessageIfItDoesNotExist();
-    m_pMessage->deserialize(buffer);
+    m_pMessage->deserialize(buffer, m_header.getMessageEncoding(), getFieldNames(pFieldNames));
+}
+
+// Deserializes the message from the current position in the buffer lazily,
+// so that its fields are only decoded when they are asked for.
+void NetworkMessage::deserializeMessageLazily(const BufferPtr& pBuffer)
+{
+    // The names in a message using a field-name dictionary can only be read in
+    // the order messages were received, so it cannot be deserialized lazily...
+    if (m_header.getAction() == NetworkMessageHeader::Action::SEND_MESSAGE && m_header.usesFieldNameDictionary())
+    {
+        throw Exception("Cannot lazily deserialize a message using a field-name dictionary");
+    }
+    createMessageIfItDoesNotExist();
+    m_pMessage->deserializeLazily(pBuffer, m_header.getMessageEncoding());
 }
 
 // Creates the message we hold if it does not already exist.
@@ -65,3 +86,20 @@ void NetworkMessage::createMessageIfItDoesNotExist() const
         m_pMessage = Message::create();
     }
 }
+
+// Returns the field-name dictionary to use for the message, ie pFieldNames if the
+// header is for a SEND_MESSAGE using one, or null if not. (For other actions the header
+// only says whether a dictionary is asked for or accepted.)
+// Throws a MessagingMesh::Exception if the message uses one and pFieldNames is null.
+FieldNameDictionary* NetworkMessage::getFieldNames(FieldNameDictionary* pFieldNames) const
+{
+    if (m_header.getAction() != NetworkMessageHeader::Action::SEND_MESSAGE || !m_header.usesFieldNameDictionary())
+    {
+        return nullptr;
+    }
+    if (!pFieldNames)
+    {
+        throw Exception("No field-name dictionary for a message using one");
+    }
+    return pFieldNames;
+}
@@ -4,6 +4,9 @@
 
 namespace MessagingMesh
 {
+    // Forward declarations...
+    class FieldNameDictionary;
+
     /// <summary>
     /// Message sent between messaging-mesh clients and gateways for
     /// updates and events. Includes a header indicating the type of
@@ -32,7 +35,8 @@ namespace MessagingMesh
         void setMessage(const MessagePtr& pMessage);
 
         // Serializes the network message to the current position of the buffer.
-        void serialize(Buffer& buffer) const;
+        // pFieldNames is the dictionary for the connection, used if the header says so.
+        void serialize(Buffer& buffer, FieldNameDictionary* pFieldNames = nullptr) const;
 
         // Deserializes the network message from the current position in the buffer.
         void deserialize(Buffer& buffer);
@@ -41,12 +45,22 @@ namespace MessagingMesh
         void deserializeHeader(Buffer& buffer);
 
         // Deserializes the message from the current position in the buffer.
-        void deserializeMessage(Buffer& buffer);
+        // pFieldNames is the dictionary for the connection, used if the header says so.
+        void deserializeMessage(Buffer& buffer, FieldNameDictionary* pFieldNames = nullptr);
+
+        // Deserializes the message from the current position in the buffer lazily,
+        // so that its fields are only decoded when they are asked for.
+        void deserializeMessageLazily(const BufferPtr& pBuffer);
 
     // Private functions...
     private:
         // Creates the message we hold if it does not already exist.
         void createMessageIfItDoesNotExist() const;
+
+        // Returns the field-name dictionary to use for the message, ie pFieldNames if the
+        // header is for a SEND_MESSAGE using one, or null if not.
+        // Throws a MessagingMesh::Exception if the message uses one and pFieldNames is null.
+        FieldNameDictionary* getFieldNames(FieldNameDictionary* pFieldNames) const;
         
     // Private data...
     private:
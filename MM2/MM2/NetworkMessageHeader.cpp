@@ -1,40 +1,110 @@
 #include "NetworkMessageHeader.h"
 #include "Buffer.h"
+#include "Exception.h"
+#include <cstring>
 using namespace MessagingMesh;
 
+// Gets the action from the data for a serialized network-message (including its four
+// bytes of size), without deserializing the header. Returns false if the data is too
+// short to hold the header's fixed-size prefix.
+bool NetworkMessageHeader::peekAction(const char* pData, int32_t dataSize, Action& action)
+{
+    if (dataSize < SUBJECTS_OFFSET) return false;
+    action = static_cast<Action>(static_cast<int8_t>(pData[ACTION_OFFSET]));
+    return true;
+}
+
+// Gets the message encoding from the data for a serialized network-message (including
+// its four bytes of size), without deserializing the header. Returns false if the data
+// is too short to hold the header's fixed-size prefix.
+bool NetworkMessageHeader::peekMessageEncoding(const char* pData, int32_t dataSize, MessageEncoding& messageEncoding)
+{
+    if (dataSize < SUBJECTS_OFFSET) return false;
+    messageEncoding = static_cast<MessageEncoding>(static_cast<int8_t>(pData[MESSAGE_ENCODING_OFFSET]));
+    return true;
+}
+
+// Gets whether the message in the data for a serialized network-message (including its
+// four bytes of size) uses a field-name dictionary, without deserializing the header.
+// Returns false if the data is too short to hold the header's fixed-size prefix.
+bool NetworkMessageHeader::peekUsesFieldNameDictionary(const char* pData, int32_t dataSize, bool& usesFieldNameDictionary)
+{
+    if (dataSize < SUBJECTS_OFFSET) return false;
+    auto flags = static_cast<uint8_t>(pData[FLAGS_OFFSET]);
+    usesFieldNameDictionary = (flags & FLAG_USES_FIELD_NAME_DICTIONARY) != 0;
+    return true;
+}
+
+// Finds the subject in the data for a serialized SEND_MESSAGE network-message (including
+// its four bytes of size), without deserializing the header. Returns false if the data
+// is not for a SEND_MESSAGE. On success, pSubject points to the subject in the data.
+bool NetworkMessageHeader::peekMessageSubject(const char* pData, int32_t dataSize, const char*& pSubject, int32_t& subjectLength)
+{
+    // The action and the subject length are at fixed offsets (see Layout in the header
+    // file), and the subject follows the fixed-size prefix. We check the length, so that
+    // we do not read past the end of the data...
+    Action action;
+    if (!peekAction(pData, dataSize, action) || action != Action::SEND_MESSAGE) return false;
+    std::memcpy(&subjectLength, pData + SUBJECT_LENGTH_OFFSET, sizeof(int32_t));
+    if (subjectLength < 0 || subjectLength > dataSize - SUBJECTS_OFFSET) return false;
+    pSubject = pData + SUBJECTS_OFFSET;
+    return true;
+}
+
 // Constructor.
 NetworkMessageHeader::NetworkMessageHeader()
 {
 }
 
 // Serializes the network message header to the current position of the buffer.
+// This must be the start of the network-message, after its size.
 void NetworkMessageHeader::serialize(Buffer& buffer) const
 {
-    // Subscription ID...
-    buffer.write_uint32(m_subscriptionID);
+    // We write the fixed-size prefix in one go. We lay it out at the same offsets as in
+    // the network-message, and write it from ACTION_OFFSET, so the first bytes of the
+    // array are not used. (Multi-byte fields are copied as-is as the messaging-mesh
+    // network protocol for integers is little-endian.)...
+    auto subjectLength = static_cast<int32_t>(m_subject.size());
+    auto replySubjectLength = static_cast<int32_t>(m_replySubject.size());
+    uint8_t flags = m_usesFieldNameDictionary ? FLAG_USES_FIELD_NAME_DICTIONARY : 0;
+    char prefix[SUBJECTS_OFFSET] = {};
+    prefix[ACTION_OFFSET] = static_cast<char>(m_action);
+    prefix[MESSAGE_ENCODING_OFFSET] = static_cast<char>(m_messageEncoding);
+    prefix[FLAGS_OFFSET] = static_cast<char>(flags);
+    std::memcpy(prefix + SUBSCRIPTION_ID_OFFSET, &m_subscriptionID, sizeof(uint32_t));
+    std::memcpy(prefix + SUBJECT_LENGTH_OFFSET, &subjectLength, sizeof(int32_t));
+    std::memcpy(prefix + REPLY_SUBJECT_LENGTH_OFFSET, &replySubjectLength, sizeof(int32_t));
+    buffer.write_bytes(prefix + ACTION_OFFSET, PREFIX_SIZE);
 
-    // Subject...
-    buffer.write_string(m_subject);
-
-    // Reply subject...
-    buffer.write_string(m_replySubject);
-
-    // Action...
-    buffer.write_int8(static_cast<int8_t>(m_action));
+    // Subject and reply subject...
+    buffer.write_bytes(m_subject.data(), subjectLength);
+    buffer.write_bytes(m_replySubject.data(), replySubjectLength);
 }
 
 // Deserialized the network message header from the current position in the buffer.
 void NetworkMessageHeader::deserialize(Buffer& buffer)
 {
-    // Subscription ID...
-    m_subscriptionID = buffer.read_uint32();
-
-    // Subject...
-    m_subject = buffer.read_string();
-
-    // Reply subject...
-    m_replySubject = buffer.read_string();
+    // We read the fixed-size prefix in one go, to the same offsets as in the network-message...
+    char prefix[SUBJECTS_OFFSET];
+    buffer.read_bytes(prefix + ACTION_OFFSET, PREFIX_SIZE);
+    m_action = static_cast<Action>(static_cast<int8_t>(prefix[ACTION_OFFSET]));
+    m_messageEncoding = static_cast<MessageEncoding>(static_cast<int8_t>(prefix[MESSAGE_ENCODING_OFFSET]));
+    auto flags = static_cast<uint8_t>(prefix[FLAGS_OFFSET]);
+    m_usesFieldNameDictionary = (flags & FLAG_USES_FIELD_NAME_DICTIONARY) != 0;
+    int32_t subjectLength;
+    int32_t replySubjectLength;
+    std::memcpy(&m_subscriptionID, prefix + SUBSCRIPTION_ID_OFFSET, sizeof(uint32_t));
+    std::memcpy(&subjectLength, prefix + SUBJECT_LENGTH_OFFSET, sizeof(int32_t));
+    std::memcpy(&replySubjectLength, prefix + REPLY_SUBJECT_LENGTH_OFFSET, sizeof(int32_t));
+    auto sizeAvailable = buffer.getBufferSize() - buffer.getPosition();
+    if (subjectLength < 0 || replySubjectLength < 0 || subjectLength > sizeAvailable - replySubjectLength)
+    {
+        throw Exception("NetworkMessageHeader::deserialize invalid subject length");
+    }
 
-    // Action...
-    m_action = static_cast<Action>(buffer.read_int8());
+    // Subject and reply subject...
+    m_subject.resize(subjectLength);
+    buffer.read_bytes(&m_subject[0], subjectLength);
+    m_replySubject.resize(replySubjectLength);
+    buffer.read_bytes(&m_replySubject[0], replySubjectLength);
 }
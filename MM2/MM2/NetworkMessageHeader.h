@@ -1,6 +1,7 @@
 #pragma once
 #include <cstdint>
 #include <string>
+#include "MessageEncoding.h"
 
 namespace MessagingMesh
 {
@@ -9,6 +10,25 @@ namespace MessagingMesh
 
     /// <summary>
     /// Header sent with NetworkMessages.
+    ///
+    /// Layout
+    /// ------
+    /// The header starts with a fixed-size prefix, so that the action and other fields can
+    /// be read from a serialized network-message (see the peek functions) without
+    /// deserializing the header, and without allocating strings for the subjects. Offsets
+    /// are from the start of the network-message, ie they include its four bytes of size:
+    ///
+    ///     4   action                   (int8)
+    ///     5   message encoding         (int8)
+    ///     6   flags                    (uint8)
+    ///     7   reserved                 (zero)
+    ///     8   subscription ID          (uint32)
+    ///     12  subject length           (int32)
+    ///     16  reply subject length     (int32)
+    ///     20  subject, then reply subject (chars)
+    ///
+    /// The prefix is the same size for every action, and its multi-byte fields are at
+    /// offsets aligned to their size.
     /// </summary>
     class NetworkMessageHeader
     {
@@ -26,12 +46,53 @@ namespace MessagingMesh
             SEND_MESSAGE
         };
 
+    // Public constants...
+    public:
+        // Offsets of the fields in the fixed-size prefix of the header in a Buffer holding
+        // a serialized NetworkMessage (see Layout above).
+        static const int32_t ACTION_OFFSET = 4;
+        static const int32_t MESSAGE_ENCODING_OFFSET = 5;
+        static const int32_t FLAGS_OFFSET = 6;
+        static const int32_t SUBJECT_LENGTH_OFFSET = 12;
+        static const int32_t REPLY_SUBJECT_LENGTH_OFFSET = 16;
+        static const int32_t SUBJECTS_OFFSET = 20;
+
+        // The offset of the subscription ID. This lets us change the subscription ID
+        // without re-serializing.
+        static const int32_t SUBSCRIPTION_ID_OFFSET = 8;
+
+        // Bits in the flags...
+        static const uint8_t FLAG_USES_FIELD_NAME_DICTIONARY = 0x01;
+
+    // Public functions...
+    public:
+        // Gets the action from the data for a serialized network-message (including its four
+        // bytes of size), without deserializing the header. Returns false if the data is too
+        // short to hold the header's fixed-size prefix.
+        static bool peekAction(const char* pData, int32_t dataSize, Action& action);
+
+        // Gets the message encoding from the data for a serialized network-message (including
+        // its four bytes of size), without deserializing the header. Returns false if the data
+        // is too short to hold the header's fixed-size prefix.
+        static bool peekMessageEncoding(const char* pData, int32_t dataSize, MessageEncoding& messageEncoding);
+
+        // Gets whether the message in the data for a serialized network-message (including its
+        // four bytes of size) uses a field-name dictionary, without deserializing the header.
+        // Returns false if the data is too short to hold the header's fixed-size prefix.
+        static bool peekUsesFieldNameDictionary(const char* pData, int32_t dataSize, bool& usesFieldNameDictionary);
+
+        // Finds the subject in the data for a serialized SEND_MESSAGE network-message (including
+        // its four bytes of size), without deserializing the header. Returns false if the data
+        // is not for a SEND_MESSAGE. On success, pSubject points to the subject in the data.
+        static bool peekMessageSubject(const char* pData, int32_t dataSize, const char*& pSubject, int32_t& subjectLength);
+
     // Public methods...
     public:
         // Constructor.
         NetworkMessageHeader();
 
         // Serializes the network message header to the current position of the buffer.
+        // This must be the start of the network-message, after its size.
         void serialize(Buffer& buffer) const;
 
         // Deserialized the network message header from the current position in the buffer.
@@ -61,6 +122,23 @@ namespace MessagingMesh
         // Gets the action.
         Action getAction() const { return m_action; }
 
+        // Sets the message encoding.
+        void setMessageEncoding(MessageEncoding messageEncoding) { m_messageEncoding = messageEncoding; }
+
+        // Gets the message encoding.
+        MessageEncoding getMessageEncoding() const { return m_messageEncoding; }
+
+        // Sets whether field names use a field-name dictionary.
+        void setUsesFieldNameDictionary(bool usesFieldNameDictionary) { m_usesFieldNameDictionary = usesFieldNameDictionary; }
+
+        // Gets whether field names use a field-name dictionary.
+        bool usesFieldNameDictionary() const { return m_usesFieldNameDictionary; }
+
+
+    // Private constants...
+    private:
+        // The size of the fixed-size prefix of the header, after the four bytes of size...
+        static const int32_t PREFIX_SIZE = SUBJECTS_OFFSET - ACTION_OFFSET;
 
     // Private data...
     private:
@@ -76,6 +154,17 @@ namespace MessagingMesh
         
         // Action...
         Action m_action = Action::NONE;
+
+        // Message encoding. For a CONNECT this is the encoding requested by the client, for
+        // an ACK the encoding selected by the gateway, and for a SEND_MESSAGE the encoding
+        // of the message which follows the header...
+        MessageEncoding m_messageEncoding = MessageEncoding::STANDARD;
+
+        // Field-name dictionary (see FieldNameDictionary). For a CONNECT this is true if the
+        // client asks to send messages using a dictionary, for an ACK if the gateway accepts
+        // them, and for a SEND_MESSAGE if the names in the message refer to the dictionary
+        // for messages from the sender's connection...
+        bool m_usesFieldNameDictionary = false;
     };
 } // namespace
 
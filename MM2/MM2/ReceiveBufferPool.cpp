@@ -0,0 +1,109 @@
+#include "ReceiveBufferPool.h"
+#include <new>
+using namespace MessagingMesh;
+
+// Constructor.
+ReceiveBufferPool::ReceiveBufferPool() :
+    m_pState(new State()),
+    m_pFreeBlocks(nullptr)
+{
+}
+
+// Destructor.
+ReceiveBufferPool::~ReceiveBufferPool()
+{
+    // We free the blocks which are not in use. Any buffers still in use are
+    // freed when they are released...
+    freeBlocks(m_pFreeBlocks);
+    freeBlocks(m_pState->pReleasedBlocks.exchange(nullptr, std::memory_order_acquire));
+    releaseState(m_pState);
+}
+
+// Allocates a buffer for a UV read.
+// Must be called from the UV loop thread which owns the pool.
+void ReceiveBufferPool::allocate(uv_buf_t* pBuffer)
+{
+    // If we have no free blocks, we take the blocks which have been released...
+    if (!m_pFreeBlocks)
+    {
+        m_pFreeBlocks = m_pState->pReleasedBlocks.exchange(nullptr, std::memory_order_acquire);
+    }
+
+    // We take a free block, or allocate a new one if there are none...
+    BlockHeader* pBlock = m_pFreeBlocks;
+    if (pBlock)
+    {
+        m_pFreeBlocks = pBlock->pNext;
+    }
+    else
+    {
+        pBlock = new (::operator new(sizeof(BlockHeader) + BUFFER_SIZE)) BlockHeader();
+        pBlock->pState = m_pState;
+    }
+    pBlock->pNext = nullptr;
+    pBlock->referenceCount.store(1, std::memory_order_relaxed);
+    m_pState->referenceCount.fetch_add(1, std::memory_order_relaxed);
+
+    // The buffer data follows the header...
+    *pBuffer = uv_buf_init((char*)(pBlock + 1), (unsigned int)BUFFER_SIZE);
+}
+
+// Adds references to a buffer allocated by a pool.
+// pData must be the start of the buffer data.
+void ReceiveBufferPool::addReference(char* pData, int32_t count)
+{
+    auto pBlock = (BlockHeader*)pData - 1;
+    pBlock->referenceCount.fetch_add(count, std::memory_order_relaxed);
+}
+
+// Releases a reference to a buffer allocated by a pool, returning it to the
+// pool which owns it when the last reference is released.
+// Can be called from any thread. Does nothing if pData is nullptr.
+void ReceiveBufferPool::release(char* pData)
+{
+    if (!pData) return;
+    auto pBlock = (BlockHeader*)pData - 1;
+    if (pBlock->referenceCount.fetch_sub(1, std::memory_order_acq_rel) == 1)
+    {
+        returnBlock(pBlock);
+    }
+}
+
+// Returns a block to the pool.
+void ReceiveBufferPool::returnBlock(BlockHeader* pBlock)
+{
+    // We push the block onto the released list. Blocks are only ever taken from
+    // this list all at once, so a simple compare-and-swap push is safe...
+    auto pState = pBlock->pState;
+    auto pHead = pState->pReleasedBlocks.load(std::memory_order_relaxed);
+    do
+    {
+        pBlock->pNext = pHead;
+    } while (!pState->pReleasedBlocks.compare_exchange_weak(pHead, pBlock, std::memory_order_release, std::memory_order_relaxed));
+
+    // The block is no longer in use...
+    releaseState(pState);
+}
+
+// Releases a reference to the state, deleting it (and any released blocks)
+// if it is the last reference.
+void ReceiveBufferPool::releaseState(State* pState)
+{
+    if (pState->referenceCount.fetch_sub(1, std::memory_order_acq_rel) == 1)
+    {
+        freeBlocks(pState->pReleasedBlocks.exchange(nullptr, std::memory_order_acquire));
+        delete pState;
+    }
+}
+
+// Frees the blocks in a list.
+void ReceiveBufferPool::freeBlocks(BlockHeader* pBlock)
+{
+    while (pBlock)
+    {
+        auto pNext = pBlock->pNext;
+        pBlock->~BlockHeader();
+        ::operator delete(pBlock);
+        pBlock = pNext;
+    }
+}
@@ -0,0 +1,126 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <atomic>
+#include "uv.h"
+
+namespace MessagingMesh
+{
+    /// <summary>
+    /// A pool of buffers for reading data from sockets.
+    /// 
+    /// libuv asks us for a buffer (typically 64KB) before each read from a socket
+    /// and we release it once we have processed the data. Rather than allocating
+    /// and freeing memory for each read, we recycle the buffers using this pool.
+    /// 
+    /// Each UVLoop owns a pool which is used by the sockets managed by the loop.
+    /// 
+    /// Blocks
+    /// ------
+    /// Each buffer is a block of memory with a small header before the data, which
+    /// holds the pool which owns the block and a reference count. This lets a buffer
+    /// be referenced and released from just a pointer to its data.
+    /// 
+    /// Reference counting
+    /// ------------------
+    /// A buffer is allocated with one reference, which is released once the socket has
+    /// processed the data read into it. Buffers which refer to messages in the data (see
+    /// Buffer::createView()) add references, so the buffer is only returned to the pool
+    /// once all of them have been released.
+    /// 
+    /// Threading
+    /// ---------
+    /// Buffers are allocated from the UV loop thread which owns the pool, so the free
+    /// list used for allocation needs no synchronization. Buffers can be released from
+    /// any thread. Released buffers are pushed onto a lock-free list and are taken back
+    /// onto the free list (all at once) when the free list is empty.
+    /// 
+    /// Lifetime
+    /// --------
+    /// Buffers can outlive the pool, for example if a message is still queued to be
+    /// written to a socket on another loop when this pool's loop is destroyed. So the
+    /// released list is held in a State object which is shared by the pool and the
+    /// buffers in use, and is deleted (along with any blocks in it) by whichever of
+    /// them is released last.
+    /// 
+    /// The pool grows to the peak number of buffers in use at any one time.
+    /// </summary>
+    class ReceiveBufferPool
+    {
+    // Public methods...
+    public:
+        // Constructor.
+        ReceiveBufferPool();
+
+        // Destructor.
+        ~ReceiveBufferPool();
+
+        // Allocates a buffer for a UV read.
+        // Must be called from the UV loop thread which owns the pool.
+        void allocate(uv_buf_t* pBuffer);
+
+    // Public functions...
+    public:
+        // Adds references to a buffer allocated by a pool.
+        // pData must be the start of the buffer data.
+        static void addReference(char* pData, int32_t count = 1);
+
+        // Releases a reference to a buffer allocated by a pool, returning it to the
+        // pool which owns it when the last reference is released.
+        // Can be called from any thread. Does nothing if pData is nullptr.
+        static void release(char* pData);
+
+    // Private types...
+    private:
+        struct State;
+
+        // Header at the start of each block, before the buffer data.
+        struct alignas(std::max_align_t) BlockHeader
+        {
+            // The state of the pool which owns the block...
+            State* pState;
+
+            // The next block in the free or released list...
+            BlockHeader* pNext;
+
+            // References to the block...
+            std::atomic<int32_t> referenceCount;
+        };
+
+        // State shared by the pool and the buffers in use.
+        struct State
+        {
+            // Blocks released (from any thread) since the pool last took them onto its free list...
+            std::atomic<BlockHeader*> pReleasedBlocks{ nullptr };
+
+            // One for the pool, plus one for each buffer in use...
+            std::atomic<int32_t> referenceCount{ 1 };
+        };
+
+    // Private functions...
+    private:
+        // Returns a block to the pool.
+        static void returnBlock(BlockHeader* pBlock);
+
+        // Releases a reference to the state, deleting it (and any released blocks)
+        // if it is the last reference.
+        static void releaseState(State* pState);
+
+        // Frees the blocks in a list.
+        static void freeBlocks(BlockHeader* pBlock);
+
+    // Private data...
+    private:
+        // State shared with the buffers in use...
+        State* m_pState;
+
+        // Free blocks, only accessed from the UV loop thread...
+        BlockHeader* m_pFreeBlocks;
+
+    // Constants...
+    private:
+        // The size of the data in each buffer. This is the size libuv suggests for reads.
+        static const size_t BUFFER_SIZE = 65536;
+    };
+} // namespace
+
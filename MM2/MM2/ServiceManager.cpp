@@ -1,97 +1,42 @@
 #include "ServiceManager.h"
-#include "UVLoop.h"
 #include "Socket.h"
-#include "Logger.h"
 #include "Utils.h"
-#include "NetworkMessage.h"
 using namespace MessagingMesh;
 
 // Constructor.
-ServiceManager::ServiceManager(const std::string& serviceName) :
+ServiceManager::ServiceManager(const std::string& serviceName, const Settings& settings) :
     m_serviceName(serviceName),
-    m_pUVLoop(UVLoop::create(serviceName))
+    m_settings(settings)
 {
-}
-
-// Registers a client socket to be managed for this service.
-void ServiceManager::registerSocket(SocketPtr pSocket)
-{
-    // We add the socket to the collection of active clients...
-    m_clientSockets[pSocket->getName()] = pSocket;
-
-    // We observe updates from the socket...
-    pSocket->setCallback(this);
-
-    // We move the socket to our UV loop...
-    pSocket->moveToLoop(m_pUVLoop);
-}
-
-// Called when data has been received on the socket.
-// Called on the thread of the client socket.
-void ServiceManager::onDataReceived(Socket* pSocket, BufferPtr pBuffer)
-{
-    try
-    {
-        // The buffer holds a serialized NetworkMessage. We deserialize
-        // the header and check the action.
-        NetworkMessage networkMessage;
-        networkMessage.deserializeHeader(*pBuffer);
-        auto& header = networkMessage.getHeader();
-        auto action = header.getAction();
-
-        // RSSTODO: REMOVE THIS!!!
-        Logger::info(Utils::format("ServiceManager::onDataReceived, action=%d", static_cast<int8_t>(action)));
-
-        switch (action)
-        {
-        case NetworkMessageHeader::Action::SEND_MESSAGE:
-            onMessage(pSocket, header, pBuffer);
-            break;
-        }
-    }
-    catch (const std::exception& ex)
+    // We create the shards. The UV loop for each shard is named from the service, with
+    // a shard number if there is more than one of them...
+    auto shardCount = settings.shardCount;
+    if (shardCount < 1)
     {
-        Logger::error(Utils::format("%s: %s", __func__, ex.what()));
+        shardCount = 1;
     }
-}
-
-// Called when a socket has been disconnected.
-// Called on the socket's thread.
-void ServiceManager::onDisconnected(Socket* pSocket)
-{
-    try
-    {
-        // We remove the socket from the collection of client sockets...
-        auto& socketName = pSocket->getName();
-        m_clientSockets.erase(socketName);
-    }
-    catch (const std::exception& ex)
+    for (int i = 0; i < shardCount; ++i)
     {
-        Logger::error(Utils::format("%s: %s", __func__, ex.what()));
+        auto name = (shardCount == 1) ? serviceName : Utils::format("%s-%d", serviceName.c_str(), i + 1);
+        m_shards.push_back(std::make_unique<ServiceShard>(*this, name));
     }
 }
 
-// Called when the movement of the socket to a new UV loop has been completed.
-void ServiceManager::onMoveToLoopComplete(Socket* pSocket)
+// Registers a client socket to be managed for this service.
+// Called on the thread of the gateway acceptor loop which received the CONNECT.
+void ServiceManager::registerSocket(SocketPtr pSocket)
 {
-    try
-    {
-        // We send an ACK message to the client to let them know that the
-        // CONNECT has completed successfully...
-        NetworkMessage connectMessage;
-        auto& header = connectMessage.getHeader();
-        header.setAction(NetworkMessageHeader::Action::ACK);
-        Utils::sendNetworkMessage(connectMessage, pSocket);
-    }
-    catch (const std::exception& ex)
+    // We set the service's policies for the socket, and register it with the
+    // shard which has the fewest clients...
+    auto pShard = m_shards[0].get();
+    for (auto& pCandidate : m_shards)
     {
-        Logger::error(Utils::format("%s: %s", __func__, ex.what()));
+        if (pCandidate->getClientCount() < pShard->getClientCount())
+        {
+            pShard = pCandidate.get();
+        }
     }
+    pSocket->setFlushPolicy(m_settings.flushPolicy);
+    pSocket->setSlowConsumerPolicy(m_settings.slowConsumerPolicy);
+    pShard->registerSocket(pSocket);
 }
-
-// Called when we receive a message.
-void ServiceManager::onMessage(const Socket* /*pSocket*/, const NetworkMessageHeader& /*header*/, BufferPtr /*pBuffer*/)
-{
-}
-
-
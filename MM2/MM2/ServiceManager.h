@@ -1,14 +1,12 @@
 #pragma once
-#include <map>
 #include <string>
+#include <vector>
+#include <memory>
 #include "SharedPointers.h"
-#include "Socket.h"
+#include "ServiceShard.h"
 
 namespace MessagingMesh
 {
-    // Forward declarations...
-    class NetworkMessageHeader;
-
     /// <summary>
     /// Manages a messaging-mesh service. 
     /// 
@@ -16,58 +14,56 @@ namespace MessagingMesh
     /// can send messages to each other, with message sent subjects only matching
     /// to subscriptions to the same service.
     /// 
-    /// UV loop and thread
-    /// ------------------
-    /// Each service runs it own UV loop, so message processing for each service is
-    /// managed on its own thread. As all updates on the UV loop take place on the
-    /// (single) UV loop thread, this means that we do not have to lock service
-    /// specific code such as the subject-matching engine.
+    /// Shards
+    /// ------
+    /// The clients of a service are managed by one or more ServiceShards, each of which
+    /// runs its own UV loop. By default a service has one shard, so all its messaging is
+    /// processed on one thread. A busy service can be created with more shards, to spread
+    /// its clients - and the work of routing the messages they send - across more threads.
+    /// 
+    /// Each client socket is registered with the shard which has the fewest clients.
+    /// Subscriptions are replicated to all shards, and messages are delivered directly
+    /// to subscribers on other shards. See ServiceShard for details.
     /// </summary>
-    class ServiceManager : public Socket::ICallback
+    class ServiceManager
     {
+    // Public types...
+    public:
+        // Settings for a service.
+        // The flush and slow-consumer policies are used for the sockets of all clients of the service.
+        struct Settings
+        {
+            int shardCount = 1;
+            Socket::FlushPolicy flushPolicy;
+            Socket::SlowConsumerPolicy slowConsumerPolicy;
+        };
+
     // Public methods...
     public:
         // Constructor.
-        ServiceManager(const std::string& serviceName);
+        ServiceManager(const std::string& serviceName, const Settings& settings);
 
         // Destructor.
         ~ServiceManager() = default;
 
         // Registers a client socket to be managed for this service.
+        // Called on the thread of the gateway acceptor loop which received the CONNECT.
         void registerSocket(SocketPtr pSocket);
 
-    // Socket::ICallback implementation...
-    private:
-        // Called when a new client connection has been made to a listening socket.
-        // Called on the GATEWAY thread.
-        void onNewConnection(SocketPtr /*pClientSocket*/) {}
-
-        // Called when data has been received on the socket.
-        // Called on the thread of the client socket.
-        void onDataReceived(Socket* pSocket, BufferPtr pBuffer);
-
-        // Called when a socket has been disconnected.
-        // Called on the socket's thread.
-        void onDisconnected(Socket* pSocket);
-
-        // Called when the movement of the socket to a new UV loop has been completed.
-        void onMoveToLoopComplete(Socket* pSocket);
-
-    // Private functions...
-    private:
-        // Called when we receive a message.
-        void onMessage(const Socket* pSocket, const NetworkMessageHeader& header, BufferPtr pBuffer);
+        // Gets the shards for the service.
+        // Note: The collection is not changed after construction, so it can be read from any thread.
+        const std::vector<std::unique_ptr<ServiceShard>>& getShards() const { return m_shards; }
 
     // Private data...
     private:
         // The service name...
         std::string m_serviceName;
 
-        // UV loop for processing client messages...
-        UVLoopPtr m_pUVLoop;
+        // The service settings...
+        Settings m_settings;
 
-        // Client sockets, keyed by socket name...
-        std::map<std::string, SocketPtr> m_clientSockets;
+        // The shards managing the clients of the service...
+        std::vector<std::unique_ptr<ServiceShard>> m_shards;
     };
 } // namespace
 
@@ -0,0 +1,388 @@
+#include "ServiceShard.h"
+#include "ServiceManager.h"
+#include "UVLoop.h"
+#include "Socket.h"
+#include "Logger.h"
+#include "Utils.h"
+#include "NetworkMessage.h"
+#include "Buffer.h"
+#include "Message.h"
+#include "Exception.h"
+using namespace MessagingMesh;
+
+// Constructor.
+ServiceShard::ServiceShard(ServiceManager& serviceManager, const std::string& name) :
+    m_serviceManager(serviceManager),
+    m_pUVLoop(UVLoop::create(name)),
+    m_clientCount(0)
+{
+}
+
+// Registers a client socket to be managed by this shard.
+// Called on the thread of the gateway acceptor loop which received the CONNECT.
+void ServiceShard::registerSocket(SocketPtr pSocket)
+{
+    // We add the socket to the collection of active clients. The collection is only
+    // accessed from our UV loop, so we marshall this to it. The event runs before the
+    // socket's move to our loop completes, as that is marshalled later in the move...
+    m_clientCount.fetch_add(1, std::memory_order_relaxed);
+    m_pUVLoop->marshallEvent(
+        [this, pSocket](uv_loop_t* /*pLoop*/)
+        {
+            m_clientSockets[pSocket->getName()] = pSocket;
+        }
+    );
+
+    // We observe updates from the socket...
+    pSocket->setCallback(this);
+
+    // We move the socket to our UV loop...
+    pSocket->moveToLoop(m_pUVLoop);
+}
+
+// Called when data has been received on the socket.
+// Called on the shard's thread.
+void ServiceShard::onDataReceived(Socket* pSocket, BufferPtr pBuffer)
+{
+    try
+    {
+        // The buffer holds a serialized NetworkMessage. We check the action without
+        // deserializing the header, as messages are forwarded using only the fields
+        // we read from the header in place...
+        if (isSendMessage(*pBuffer))
+        {
+            onMessage(decodeFieldNames(pSocket, pBuffer));
+            return;
+        }
+        onSubscriptionUpdate(pSocket, *pBuffer);
+    }
+    catch (const std::exception& ex)
+    {
+        Logger::error(Utils::format("%s: %s", __func__, ex.what()));
+    }
+}
+
+// Called with all the complete messages from one read of the socket.
+// Called on the shard's thread.
+size_t ServiceShard::onDataReceivedBatch(Socket* pSocket, const std::vector<BufferPtr>& messages)
+{
+    // A single message is forwarded directly, without collecting destinations...
+    if (messages.size() == 1)
+    {
+        onDataReceived(pSocket, messages[0]);
+        return 1;
+    }
+
+    // We process the messages in order, so that a subscription made by a message in the
+    // batch applies to the messages after it. Messages to forward are added to the writes
+    // for each destination, and these are written once all the messages are processed.
+    // As in onDataReceived(), we only deserialize the headers of subscription updates...
+    for (auto& pBuffer : messages)
+    {
+        try
+        {
+            if (isSendMessage(*pBuffer))
+            {
+                addToDestinations(decodeFieldNames(pSocket, pBuffer));
+                continue;
+            }
+            onSubscriptionUpdate(pSocket, *pBuffer);
+        }
+        catch (const std::exception& ex)
+        {
+            Logger::error(Utils::format("%s: %s", __func__, ex.what()));
+        }
+    }
+    writeToDestinations();
+    return messages.size();
+}
+
+// Called when a socket has been disconnected.
+// Called on the shard's thread.
+void ServiceShard::onDisconnected(Socket* pSocket)
+{
+    try
+    {
+        auto it = m_clientSockets.find(pSocket->getName());
+        if (it == m_clientSockets.end())
+        {
+            return;
+        }
+
+        // We remove the socket's subscriptions from all shards. The update holds
+        // the shared pointer to the socket, so that the socket (and its address)
+        // stays alive until every shard has removed its subscriptions...
+        auto pClientSocket = it->second;
+        updateAllShards(
+            [pClientSocket](SubjectMatchingEngine& engine)
+            {
+                engine.removeAllSubscriptions(pClientSocket.get());
+            }
+        );
+
+        // We remove the socket from the collection of client sockets, and
+        // remove its field-name dictionary...
+        m_fieldNames.erase(pSocket);
+        m_clientSockets.erase(it);
+        m_clientCount.fetch_sub(1, std::memory_order_relaxed);
+    }
+    catch (const std::exception& ex)
+    {
+        Logger::error(Utils::format("%s: %s", __func__, ex.what()));
+    }
+}
+
+// Called when the movement of the socket to a new UV loop has been completed.
+void ServiceShard::onMoveToLoopComplete(Socket* pSocket)
+{
+    try
+    {
+        // We send an ACK message to the client to let them know that the
+        // CONNECT has completed successfully, the message encoding we
+        // selected for the connection, and that we accept messages using
+        // a field-name dictionary...
+        NetworkMessage connectMessage;
+        auto& header = connectMessage.getHeader();
+        header.setAction(NetworkMessageHeader::Action::ACK);
+        header.setMessageEncoding(pSocket->getMessageEncoding());
+        header.setUsesFieldNameDictionary(true);
+        Utils::sendNetworkMessage(connectMessage, pSocket);
+    }
+    catch (const std::exception& ex)
+    {
+        Logger::error(Utils::format("%s: %s", __func__, ex.what()));
+    }
+}
+
+// Called when we receive a SUBSCRIBE message.
+void ServiceShard::onSubscribe(Socket* pSocket, const NetworkMessageHeader& header)
+{
+    // We find the shared pointer for the socket. The subject-matching engine holds
+    // this to make sure that the socket is alive while it has subscriptions...
+    auto it = m_clientSockets.find(pSocket->getName());
+    if (it == m_clientSockets.end())
+    {
+        Logger::warn(Utils::format("SUBSCRIBE from unregistered socket %s", pSocket->getName().c_str()));
+        return;
+    }
+
+    // We add the subscription to all shards...
+    auto pClientSocket = it->second;
+    auto subject = header.getSubject();
+    auto subscriptionID = header.getSubscriptionID();
+    updateAllShards(
+        [pClientSocket, subject, subscriptionID](SubjectMatchingEngine& engine)
+        {
+            engine.addSubscription(subject, pClientSocket, subscriptionID);
+        }
+    );
+}
+
+// Called when we receive an UNSUBSCRIBE message.
+void ServiceShard::onUnsubscribe(Socket* pSocket, const NetworkMessageHeader& header)
+{
+    // We remove the subscription from all shards. The socket is alive until all shards
+    // have processed this, as it cannot disconnect (and remove its subscriptions) until
+    // after the update has been marshalled...
+    auto subscriptionID = header.getSubscriptionID();
+    updateAllShards(
+        [pSocket, subscriptionID](SubjectMatchingEngine& engine)
+        {
+            engine.removeSubscription(pSocket, subscriptionID);
+        }
+    );
+}
+
+// Returns true if the buffer holds a SEND_MESSAGE, checking the action without
+// deserializing the header.
+// Throws a MessagingMesh::Exception if the buffer is too short to hold a header.
+bool ServiceShard::isSendMessage(const Buffer& buffer)
+{
+    NetworkMessageHeader::Action action;
+    if (!NetworkMessageHeader::peekAction(buffer.getData(), buffer.getBufferSize(), action))
+    {
+        throw Exception("Network message is too short to hold a header");
+    }
+    return action == NetworkMessageHeader::Action::SEND_MESSAGE;
+}
+
+// Called when we receive a message other than a SEND_MESSAGE. We deserialize
+// the header, and process SUBSCRIBE and UNSUBSCRIBE messages.
+void ServiceShard::onSubscriptionUpdate(Socket* pSocket, Buffer& buffer)
+{
+    NetworkMessageHeader header;
+    buffer.resetPosition();
+    header.deserialize(buffer);
+    switch (header.getAction())
+    {
+    case NetworkMessageHeader::Action::SUBSCRIBE:
+        onSubscribe(pSocket, header);
+        break;
+
+    case NetworkMessageHeader::Action::UNSUBSCRIBE:
+        onUnsubscribe(pSocket, header);
+        break;
+
+    default:
+        break;
+    }
+}
+
+// Called when we receive a message.
+void ServiceShard::onMessage(const BufferPtr& pBuffer)
+{
+    // We find the subscribers for the message's subject and forward the message
+    // to each of them. The Buffer is shared between them, and only the subscription
+    // ID in its header is written differently for each subscriber.
+    //
+    // Subscribers may be managed by other shards. Writing to their sockets marshalls
+    // the data to the subscriber's loop...
+    MessageEncoding messageEncoding;
+    auto& subscribers = getSubscribers(*pBuffer, messageEncoding);
+    BufferPtr pReencodedBuffer;
+    for (auto& subscriber : subscribers)
+    {
+        auto& pSubscriberBuffer = getBufferForSubscriber(*subscriber.pSocket, messageEncoding, pBuffer, pReencodedBuffer);
+        Utils::forwardNetworkMessage(pSubscriberBuffer, subscriber.subscriptionID, subscriber.pSocket);
+    }
+}
+
+// Adds writes for a message in a batch to the destinations for its subscribers.
+void ServiceShard::addToDestinations(const BufferPtr& pBuffer)
+{
+    MessageEncoding messageEncoding;
+    auto& subscribers = getSubscribers(*pBuffer, messageEncoding);
+    BufferPtr pReencodedBuffer;
+    for (auto& subscriber : subscribers)
+    {
+        // We find the destination for the subscriber's socket, or add one...
+        auto it = m_destinationIndexes.find(subscriber.pSocket.get());
+        if (it == m_destinationIndexes.end())
+        {
+            it = m_destinationIndexes.insert({ subscriber.pSocket.get(), m_destinations.size() }).first;
+            m_destinations.push_back(Destination{ subscriber.pSocket, {} });
+        }
+
+        // We add a write of the message, patched with the subscription ID as in Utils::forwardNetworkMessage()...
+        auto subscriptionID = subscriber.subscriptionID;
+        auto& destination = m_destinations[it->second];
+        auto& pSubscriberBuffer = getBufferForSubscriber(*subscriber.pSocket, messageEncoding, pBuffer, pReencodedBuffer);
+        destination.queuedWrites.push_back(Socket::createQueuedWrite(pSubscriberBuffer, NetworkMessageHeader::SUBSCRIPTION_ID_OFFSET, &subscriptionID, sizeof(subscriptionID)));
+    }
+}
+
+// Returns the subscribers for the subject of the SEND_MESSAGE in the buffer, and gets
+// the encoding of the message. These are read from the header in place, so the header
+// is not deserialized and the subject is looked up without allocating a string for it.
+// Throws a MessagingMesh::Exception if the header is not valid.
+const SubjectMatchingEngine::VecSubscriber& ServiceShard::getSubscribers(const Buffer& buffer, MessageEncoding& messageEncoding)
+{
+    auto pData = buffer.getData();
+    auto dataSize = buffer.getBufferSize();
+    const char* pSubject;
+    int32_t subjectLength;
+    if (!NetworkMessageHeader::peekMessageSubject(pData, dataSize, pSubject, subjectLength) ||
+        !NetworkMessageHeader::peekMessageEncoding(pData, dataSize, messageEncoding))
+    {
+        throw Exception("Invalid SEND_MESSAGE header");
+    }
+    return m_subjectMatchingEngine.getSubscribers(pSubject, subjectLength);
+}
+
+// Writes the batches collected for each destination.
+void ServiceShard::writeToDestinations()
+{
+    for (auto& destination : m_destinations)
+    {
+        try
+        {
+            destination.pSocket->write(std::move(destination.queuedWrites));
+        }
+        catch (const std::exception& ex)
+        {
+            Logger::error(Utils::format("%s: %s", __func__, ex.what()));
+        }
+    }
+    m_destinations.clear();
+    m_destinationIndexes.clear();
+}
+
+// Returns the buffer to forward a message to a subscriber. If the subscriber uses a
+// different message encoding from the sender, this is a copy of the message re-encoded
+// for it. The copy is created once for each message, as there are only two encodings.
+// senderEncoding is the encoding of the message in pBuffer.
+const BufferPtr& ServiceShard::getBufferForSubscriber(const Socket& subscriberSocket, MessageEncoding senderEncoding, const BufferPtr& pBuffer, BufferPtr& pReencodedBuffer)
+{
+    auto messageEncoding = subscriberSocket.getMessageEncoding();
+    if (messageEncoding == senderEncoding)
+    {
+        return pBuffer;
+    }
+    if (!pReencodedBuffer)
+    {
+        // We deserialize the message lazily, so that it is written field-by-field
+        // from the received buffer without copying the fields into a new message...
+        NetworkMessage networkMessage;
+        pBuffer->resetPosition();
+        networkMessage.deserializeHeader(*pBuffer);
+        networkMessage.deserializeMessageLazily(pBuffer);
+        networkMessage.getHeader().setMessageEncoding(messageEncoding);
+        pReencodedBuffer = Buffer::create();
+        networkMessage.serialize(*pReencodedBuffer);
+    }
+    return pReencodedBuffer;
+}
+
+// Returns the buffer for a message from a client. If the message uses the field-name
+// dictionary for the client's connection, this is the message re-encoded with the
+// names written in full, and the dictionary is updated. If not, it is pBuffer.
+BufferPtr ServiceShard::decodeFieldNames(Socket* pSocket, const BufferPtr& pBuffer)
+{
+    bool usesFieldNameDictionary = false;
+    NetworkMessageHeader::peekUsesFieldNameDictionary(pBuffer->getData(), pBuffer->getBufferSize(), usesFieldNameDictionary);
+    if (!usesFieldNameDictionary)
+    {
+        return pBuffer;
+    }
+
+    // We deserialize the message using the client's dictionary, and serialize it
+    // again with the same encoding and header, but without the dictionary...
+    NetworkMessage networkMessage;
+    pBuffer->resetPosition();
+    networkMessage.deserializeHeader(*pBuffer);
+    networkMessage.deserializeMessage(*pBuffer, &m_fieldNames[pSocket]);
+    networkMessage.getHeader().setUsesFieldNameDictionary(false);
+    auto pDecodedBuffer = Buffer::create();
+    networkMessage.serialize(*pDecodedBuffer);
+    return pDecodedBuffer;
+}
+
+// Applies the update to the subject-matching engine of this shard, and marshalls
+// it to be applied by the other shards of the service.
+void ServiceShard::updateAllShards(const SubscriptionUpdate& update)
+{
+    // Updates marshalled from one shard to another are applied in the order they
+    // were made, so for example an UNSUBSCRIBE cannot overtake its SUBSCRIBE...
+    for (auto& pShard : m_serviceManager.getShards())
+    {
+        if (pShard.get() == this)
+        {
+            update(m_subjectMatchingEngine);
+            continue;
+        }
+        auto pOtherShard = pShard.get();
+        pOtherShard->m_pUVLoop->marshallEvent(
+            [pOtherShard, update](uv_loop_t* /*pLoop*/)
+            {
+                try
+                {
+                    update(pOtherShard->m_subjectMatchingEngine);
+                }
+                catch (const std::exception& ex)
+                {
+                    Logger::error(Utils::format("%s: %s", __func__, ex.what()));
+                }
+            }
+        );
+    }
+}
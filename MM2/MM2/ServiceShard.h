@@ -0,0 +1,214 @@
+#pragma once
+#include <map>
+#include <unordered_map>
+#include <vector>
+#include <string>
+#include <atomic>
+#include <functional>
+#include "SharedPointers.h"
+#include "Socket.h"
+#include "SubjectMatchingEngine.h"
+#include "FieldNameDictionary.h"
+
+namespace MessagingMesh
+{
+    // Forward declarations...
+    class NetworkMessageHeader;
+    class ServiceManager;
+
+    /// <summary>
+    /// Manages a subset of the client sockets connected to a service.
+    ///
+    /// A service can be split into more than one shard (see ServiceManager), so that
+    /// its messaging is spread across more than one thread.
+    ///
+    /// UV loop and thread
+    /// ------------------
+    /// Each shard runs it own UV loop. The client sockets for the shard are managed by
+    /// this loop, so all messages from them are processed on the shard's thread. As all
+    /// updates on the UV loop take place on the (single) UV loop thread, this means that
+    /// we do not have to lock shard specific code such as the subject-matching engine.
+    ///
+    /// Subject matching
+    /// ----------------
+    /// SUBSCRIBE and UNSUBSCRIBE messages from clients update the SubjectMatchingEngine.
+    /// When a client sends a message we use the engine to find the subscribers for the
+    /// message's subject and send the message to each of them, with the subscription ID
+    /// set in the header so that the client can find the callback for the subscription.
+    ///
+    /// Messages are forwarded without being deserialized. The Buffer we receive is shared
+    /// by all the subscribers and only the subscription ID is written for each of them.
+    /// We read the action, subject and encoding of a message from its header in place (see
+    /// the NetworkMessageHeader peek functions), and only deserialize the headers of
+    /// SUBSCRIBE and UNSUBSCRIBE messages.
+    ///
+    /// Replicated subscriptions
+    /// ------------------------
+    /// Each shard holds the subscriptions for all the clients of the service, not just for
+    /// its own clients. Subscription updates are applied to the shard receiving them and
+    /// marshalled to the other shards' loops. So each shard can find all the subscribers
+    /// for a message it receives without calling into the other shards.
+    ///
+    /// We do not partition subscriptions by subject, as wildcard subscriptions can match
+    /// subjects in any partition, and as it would mean an extra hop between threads for
+    /// each message sent.
+    ///
+    /// Cross-shard delivery
+    /// --------------------
+    /// A subscriber may be managed by a different shard from the publisher. We write to
+    /// its socket directly from the publisher's shard. Socket::write() queues the data on
+    /// a lock-free queue and marshalls the write to the subscriber's loop, so shards do
+    /// not contend on a lock when delivering to each other's clients.
+    ///
+    /// Message encodings
+    /// -----------------
+    /// Each client selects a MessageEncoding when it connects. Messages are forwarded as
+    /// they were received to subscribers using the sender's encoding. For subscribers using
+    /// the other encoding we re-encode the message once, and share that copy between them.
+    ///
+    /// Field-name dictionaries
+    /// -----------------------
+    /// A client can send messages whose field names refer to a FieldNameDictionary for its
+    /// connection. We hold the dictionary for each such client, and re-encode each message
+    /// from it with the names written in full, updating the dictionary with any names the
+    /// message adds. This is done for every message, even one with no subscribers, so that
+    /// the dictionary sees all the messages in order. The re-encoded message is forwarded
+    /// as above.
+    ///
+    /// We do not use dictionaries for messages sent to subscribers. The buffer for a message
+    /// is shared between its subscribers, and a subscriber's slow-consumer policy can drop or
+    /// conflate messages, so a subscriber could miss the message which added a name.
+    ///
+    /// Batches of messages
+    /// -------------------
+    /// We process all the messages from one read of a client socket together. Messages
+    /// to be forwarded are grouped by the subscriber's socket, and each socket is written
+    /// to once for the whole batch. So when a publisher sends a burst of small messages,
+    /// we queue one write per subscriber rather than one per message per subscriber.
+    /// </summary>
+    class ServiceShard : public Socket::ICallback
+    {
+    // Public methods...
+    public:
+        // Constructor.
+        ServiceShard(ServiceManager& serviceManager, const std::string& name);
+
+        // Destructor.
+        ~ServiceShard() = default;
+
+        // Gets the number of client sockets registered with the shard.
+        int getClientCount() const { return m_clientCount.load(std::memory_order_relaxed); }
+
+        // Registers a client socket to be managed by this shard.
+        // Called on the thread of the gateway acceptor loop which received the CONNECT.
+        void registerSocket(SocketPtr pSocket);
+
+    // Socket::ICallback implementation...
+    private:
+        // Called when a new client connection has been made to a listening socket.
+        // Not used by the shard.
+        void onNewConnection(SocketPtr /*pClientSocket*/) {}
+
+        // Called when data has been received on the socket.
+        // Called on the shard's thread.
+        void onDataReceived(Socket* pSocket, BufferPtr pBuffer);
+
+        // Called with all the complete messages from one read of the socket.
+        // Called on the shard's thread.
+        size_t onDataReceivedBatch(Socket* pSocket, const std::vector<BufferPtr>& messages);
+
+        // Called when a socket has been disconnected.
+        // Called on the shard's thread.
+        void onDisconnected(Socket* pSocket);
+
+        // Called when the movement of the socket to a new UV loop has been completed.
+        void onMoveToLoopComplete(Socket* pSocket);
+
+    // Private types...
+    private:
+        // An update to the subject-matching engine.
+        typedef std::function<void(SubjectMatchingEngine&)> SubscriptionUpdate;
+
+        // Writes to one subscriber's socket, collected while processing a batch of messages.
+        struct Destination
+        {
+            SocketPtr pSocket;
+            Socket::VecQueuedWrite queuedWrites;
+        };
+
+    // Private functions...
+    private:
+        // Returns true if the buffer holds a SEND_MESSAGE, checking the action without
+        // deserializing the header.
+        // Throws a MessagingMesh::Exception if the buffer is too short to hold a header.
+        static bool isSendMessage(const Buffer& buffer);
+
+        // Called when we receive a message other than a SEND_MESSAGE. We deserialize
+        // the header, and process SUBSCRIBE and UNSUBSCRIBE messages.
+        void onSubscriptionUpdate(Socket* pSocket, Buffer& buffer);
+
+        // Called when we receive a SUBSCRIBE message.
+        void onSubscribe(Socket* pSocket, const NetworkMessageHeader& header);
+
+        // Called when we receive an UNSUBSCRIBE message.
+        void onUnsubscribe(Socket* pSocket, const NetworkMessageHeader& header);
+
+        // Called when we receive a message.
+        void onMessage(const BufferPtr& pBuffer);
+
+        // Adds writes for a message in a batch to the destinations for its subscribers.
+        void addToDestinations(const BufferPtr& pBuffer);
+
+        // Returns the subscribers for the subject of the SEND_MESSAGE in the buffer, and gets
+        // the encoding of the message. These are read from the header in place, so the header
+        // is not deserialized and the subject is looked up without allocating a string for it.
+        // Throws a MessagingMesh::Exception if the header is not valid.
+        const SubjectMatchingEngine::VecSubscriber& getSubscribers(const Buffer& buffer, MessageEncoding& messageEncoding);
+
+        // Writes the batches collected for each destination.
+        void writeToDestinations();
+
+        // Returns the buffer to forward a message to a subscriber. If the subscriber uses a
+        // different message encoding from the sender, this is a copy of the message re-encoded
+        // for it. The copy is created once for each message, as there are only two encodings.
+        // senderEncoding is the encoding of the message in pBuffer.
+        const BufferPtr& getBufferForSubscriber(const Socket& subscriberSocket, MessageEncoding senderEncoding, const BufferPtr& pBuffer, BufferPtr& pReencodedBuffer);
+
+        // Returns the buffer for a message from a client. If the message uses the field-name
+        // dictionary for the client's connection, this is the message re-encoded with the
+        // names written in full, and the dictionary is updated. If not, it is pBuffer.
+        BufferPtr decodeFieldNames(Socket* pSocket, const BufferPtr& pBuffer);
+
+        // Applies the update to the subject-matching engine of this shard, and marshalls
+        // it to be applied by the other shards of the service.
+        void updateAllShards(const SubscriptionUpdate& update);
+
+    // Private data...
+    private:
+        // The service-manager which owns this shard...
+        ServiceManager& m_serviceManager;
+
+        // UV loop for processing client messages...
+        UVLoopPtr m_pUVLoop;
+
+        // Client sockets, keyed by socket name...
+        std::map<std::string, SocketPtr> m_clientSockets;
+
+        // The number of client sockets registered with the shard. This is also counted
+        // separately from m_clientSockets so that it can be read from other threads...
+        std::atomic<int> m_clientCount;
+
+        // Matches message subjects to client subscriptions...
+        SubjectMatchingEngine m_subjectMatchingEngine;
+
+        // Destinations for the messages in the batch being processed, and their indexes
+        // in m_destinations keyed by socket...
+        std::vector<Destination> m_destinations;
+        std::unordered_map<const Socket*, size_t> m_destinationIndexes;
+
+        // Field-name dictionaries for messages from our client sockets, keyed by socket.
+        // These are created for a socket when it first sends a message using one...
+        std::unordered_map<const Socket*, FieldNameDictionary> m_fieldNames;
+    };
+} // namespace
+
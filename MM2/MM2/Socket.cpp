@@ -4,8 +4,13 @@
 #include "UVUtils.h"
 #include "UVLoop.h"
 #include "Buffer.h"
+#include "NetworkMessageHeader.h"
 #include "OSSocketHolder.h"
 #include "Exception.h"
+#include "FieldKey.h"
+#include <cstring>
+#include <iterator>
+#include <algorithm>
 using namespace MessagingMesh;
 
 // Constructor.
@@ -15,7 +20,17 @@ Socket::Socket(UVLoopPtr pUVLoop) :
     m_connected(false),
     m_pCallback(nullptr),
     m_pSocket(nullptr),
-    m_pCurrentMessage(nullptr)
+    m_pCurrentMessage(nullptr),
+    m_moving(false),
+    m_writeScheduled(false),
+    m_pendingBytes(0),
+    m_pFlushTimer(nullptr),
+    m_aboveHighWaterMark(false),
+    m_disconnectedAsSlowConsumer(false),
+    m_conflatedWriteCount(0),
+    m_droppedMessageCount(0),
+    m_droppedByteCount(0),
+    m_messageEncoding(MessageEncoding::STANDARD)
 {
 }
 
@@ -28,9 +43,14 @@ Socket::~Socket()
     // one running the UV loop, so we marshall the socket close event
     // to the socket's UV loop.
     auto pSocket = m_pSocket;
+    auto pFlushTimer = m_pFlushTimer;
     m_pUVLoop->marshallEvent(
-        [pSocket](uv_loop_t* /*pLoop*/)
+        [pSocket, pFlushTimer](uv_loop_t* /*pLoop*/)
         {
+            if (pFlushTimer)
+            {
+                uv_close((uv_handle_t*)pFlushTimer, [](uv_handle_t* pHandle) { delete (uv_timer_t*)pHandle; });
+            }
             if (!pSocket) return;
             uv_close(
                 (uv_handle_t*)pSocket,
@@ -73,7 +93,12 @@ void Socket::onSocketConnected()
 
     // We note the the socket is connected and process any queued writes...
     m_connected = true;
+    // (Processing the writes disconnects the socket if its slow-consumer policy says so.)
     processQueuedWrites();
+    if (m_disconnectedAsSlowConsumer)
+    {
+        return;
+    }
 
     // We start reading data from the socket...
     uv_read_start(
@@ -88,7 +113,10 @@ void Socket::onSocketConnected()
 }
 
 // Connects a server socket to listen on the specified port.
-void Socket::listen(int port)
+// If reusePort is true the socket is bound with SO_REUSEPORT, so that other sockets
+// (also using reusePort) can listen on the same port. The OS spreads incoming
+// connections across them. See UVUtils::supportsReusePort().
+void Socket::listen(int port, bool reusePort)
 {
     // We create a name for the socket from its connection info...
     m_name = Utils::format("LISTENING-SOCKET:%d", port);
@@ -100,7 +128,13 @@ void Socket::listen(int port)
     // We bind to the specified port on all network interfaces...
     struct sockaddr_in addr;
     uv_ip4_addr("0.0.0.0", port, &addr);
-    uv_tcp_bind(m_pSocket, (const struct sockaddr*)&addr, 0);
+    unsigned int bindFlags = reusePort ? UV_TCP_REUSEPORT : 0;
+    int bindResult = uv_tcp_bind(m_pSocket, (const struct sockaddr*)&addr, bindFlags);
+    if (bindResult)
+    {
+        Logger::error(Utils::format("uv_tcp_bind error: %s", uv_strerror(bindResult)));
+        return;
+    }
 
     // We turn of Nagling...
     uv_tcp_nodelay(m_pSocket, 1);
@@ -274,20 +308,44 @@ void Socket::onConnectCompleted(uv_connect_t* pRequest, int status)
 void Socket::moveToLoop(UVLoopPtr pLoop)
 {
     // To move a socket to a new loop we:
+    // - Stop reading from the socket
     // - Create a duplicate socket
     // - Mark the socket as not connected (so that writes are queued)
     // - Close the original UV socket handle
     // - Wait for close to complete
     // - Change the Socket's UVLoop to the new one
     // - Register the duplicated socket on the new loop
+    // - Process any data we received before the move but had not yet processed
+    //
+    // The move is often started from a callback for a message received on the socket
+    // (for example, for a CONNECT message) and clients can send more messages straight
+    // after that one without waiting for a reply. So the data we were processing when
+    // the move started can hold more messages. We mark the socket as moving, which
+    // stops the callback processing them on this loop. The unprocessed messages and
+    // any partly received message are kept and processed on the new loop.
+    //
+    // Data which we have not yet read from the socket stays queued in the (duplicated)
+    // OS socket and is read by the new loop.
 
     Logger::info("Moving socket to loop: " + pLoop->getName());
 
+    // We stop reading, and note that we are moving...
+    uv_read_stop((uv_stream_t*)m_pSocket);
+    m_moving = true;
+
     // We duplicate the socket...
-    auto pNewOSSocket = UVUtils::duplicateSocket(m_pSocket->socket);
+    uv_os_fd_t fd;
+    auto status = uv_fileno((uv_handle_t*)m_pSocket, &fd);
+    if (status != 0)
+    {
+        throw Exception(Utils::format("uv_fileno failed: %s", uv_strerror(status)));
+    }
+    auto pNewOSSocket = UVUtils::duplicateSocket((uv_os_sock_t)fd);
 
-    // We mark the socket as not connected...
+    // We mark the socket as not connected. Pending writes held by the flush policy are
+    // kept and sent from the new loop, so we close the flush timer on this loop...
     m_connected = false;
+    closeFlushTimer();
 
     // We close the socket...
     auto pMoveInfo = new move_socket_t;
@@ -317,13 +375,22 @@ void Socket::moveToLoop_onSocketClosed(move_socket_t* pMoveInfo)
 
         // We are currently still running in the original UV loop.
         // We marshall the registration of the new (duplicated) socket to the new loop...
+        // If the socket has been released by then, we close the duplicated socket, as
+        // nothing else owns it...
         auto pNewUVLoop = pMoveInfo->pNewUVLoop;
         auto pNewOSSocket = pMoveInfo->pNewOSSocket;
+        std::weak_ptr<Socket> pWeakSelf = shared_from_this();
         pMoveInfo->pNewUVLoop->marshallEvent(
-            [this, pNewUVLoop, pNewOSSocket](uv_loop_t* /*pLoop*/)
+            [pWeakSelf, pNewUVLoop, pNewOSSocket](uv_loop_t* /*pLoop*/)
             {
                 // The move continues in moveToLoop_registerDuplicatedSocket()...
-                moveToLoop_registerDuplicatedSocket(pNewUVLoop, pNewOSSocket);
+                auto pSelf = pWeakSelf.lock();
+                if (!pSelf)
+                {
+                    UVUtils::closeSocket(pNewOSSocket->getSocket());
+                    return;
+                }
+                pSelf->moveToLoop_registerDuplicatedSocket(pNewUVLoop, pNewOSSocket);
             }
         );
 
@@ -356,14 +423,30 @@ void Socket::moveToLoop_registerDuplicatedSocket(UVLoopPtr pUVLoop, OSSocketHold
         if (status != 0)
         {
             Logger::error(Utils::format("uv_tcp_open failed: %s", uv_strerror(status)));
+
+            // The UV handle does not own the duplicated socket, so we close it ourselves,
+            // and close the UV handle. (The destructor does not close the handle again,
+            // as m_pSocket is null.)...
+            UVUtils::closeSocket(socket);
+            uv_close((uv_handle_t*)m_pSocket, [](uv_handle_t* pHandle) { delete (uv_tcp_t*)pHandle; });
+            m_pSocket = nullptr;
+            m_moving = false;
+
+            // The socket is no longer connected, so we notify the callback. This may
+            // release the socket, so we do not use it after this...
+            if (m_pCallback) m_pCallback->onDisconnected(this);
             return;
         }
 
         // We start reading and writing...
+        m_moving = false;
         onSocketConnected();
 
         // We notify that the move to the new loop has completed...
         if (m_pCallback) m_pCallback->onMoveToLoopComplete(this);
+
+        // We process data received before the move...
+        processUnreadData();
     }
     catch (const std::exception& ex)
     {
@@ -373,69 +456,552 @@ void Socket::moveToLoop_registerDuplicatedSocket(UVLoopPtr pUVLoop, OSSocketHold
 
 // Queues data to be written to the socket.
 // Can be called from any thread, not just from the uv loop thread.
-// Queued writes will be coalesced into one network update.
+// Queued writes will be sent together in one network update.
 // RSSTODO: We need some way to slow down the client if it publishes too much too fast.
 void Socket::write(BufferPtr pBuffer)
 {
-    // We queue the data to write...
-    m_queuedWrites.add(pBuffer);
+    write(pBuffer, 0, nullptr, 0);
+}
 
-    // We marshall an event to write the data. As this does not take place straight 
-    // away, this allows us to coalesce multiple queued writes...
-    m_pUVLoop->marshallUniqueEvent(
-        UVLoop::UniqueEventKey::SOCKET_QUEUE_WRITE,
-        [this](uv_loop_t* /*pLoop*/)
+// Queues data to be written to the socket, with the patch bytes written over
+// the data from the buffer at the offset specified. 
+// Can be called from any thread, not just from the uv loop thread.
+void Socket::write(BufferPtr pBuffer, int32_t patchOffset, const void* pPatch, int32_t patchSize)
+{
+    WriteQueueItem item;
+    item.queuedWrite = createQueuedWrite(pBuffer, patchOffset, pPatch, patchSize);
+    queueWrite(std::move(item));
+}
+
+// Queues a batch of writes to the socket.
+// The whole batch is queued in one operation, which is cheaper than writing each of
+// them separately when many messages are sent to the same socket at the same time.
+// Can be called from any thread, not just from the uv loop thread.
+void Socket::write(VecQueuedWrite&& queuedWrites)
+{
+    if (queuedWrites.empty()) return;
+    WriteQueueItem item;
+    item.batch = std::move(queuedWrites);
+    queueWrite(std::move(item));
+}
+
+// Creates a queued write for the buffer, with the patch bytes to be written over
+// its data at the offset specified. (See write() above.)
+Socket::QueuedWrite Socket::createQueuedWrite(BufferPtr pBuffer, int32_t patchOffset, const void* pPatch, int32_t patchSize)
+{
+    QueuedWrite queuedWrite;
+    queuedWrite.pBuffer = pBuffer;
+    if (patchSize > 0)
+    {
+        if (patchSize > static_cast<int32_t>(sizeof(queuedWrite.patch)) || patchOffset + patchSize > pBuffer->getBufferSize())
         {
-            processQueuedWrites();
+            throw Exception("Socket::write patch does not fit");
         }
-    );
+        queuedWrite.patchOffset = patchOffset;
+        queuedWrite.patchSize = patchSize;
+        std::memcpy(queuedWrite.patch, pPatch, patchSize);
+    }
+    return queuedWrite;
 }
 
-// Sends a coalesced network message for all queued writes.
+// Queues an item to be written and schedules the write.
+void Socket::queueWrite(WriteQueueItem&& item)
+{
+    // We queue the data to write...
+    m_queuedWrites.push(std::move(item));
+
+    // We marshall an event to write the data, unless one is already scheduled for this
+    // socket. As this does not take place straight away, this allows us to coalesce
+    // multiple queued writes.
+    //
+    // The event clears the flag before it takes the queued writes, so a write queued
+    // after that schedules a new event. We use exchange() in both places so that the
+    // event sees any write whose thread found the flag already set.
+    //
+    // The socket can be released (and its destructor run on another thread) while the
+    // event is queued, so the event holds a weak pointer to it. If the socket has been
+    // released, the writes are discarded with it. We do not hold a strong pointer, as
+    // that would run the destructor on the loop thread, where releasing the socket's
+    // reference to the loop could destroy the loop from inside itself...
+    if (!m_writeScheduled.exchange(true, std::memory_order_acq_rel))
+    {
+        std::weak_ptr<Socket> pWeakSelf = shared_from_this();
+        m_pUVLoop->marshallEvent(
+            [pWeakSelf](uv_loop_t* /*pLoop*/)
+            {
+                auto pSelf = pWeakSelf.lock();
+                if (!pSelf) return;
+                pSelf->m_writeScheduled.exchange(false, std::memory_order_acq_rel);
+                pSelf->processQueuedWrites();
+            }
+        );
+    }
+}
+
+// Moves queued writes to the pending writes, and sends them if the flush policy allows.
 void Socket::processQueuedWrites()
 {
     try
     {
+        // If we disconnected the socket as a slow consumer, we discard any writes
+        // queued before our owner released it...
+        if (m_disconnectedAsSlowConsumer)
+        {
+            WriteQueueItem discardedItem;
+            while (m_queuedWrites.pop(discardedItem)) {}
+            return;
+        }
+
         // We check if the socket is connected...
         if (!m_connected)
         {
             return;
         }
 
-        // We find the combined size of the queued writes...
-        auto queuedWrites = m_queuedWrites.getItems();
-        size_t totalSize = 0;
-        for (auto queuedWrite : *queuedWrites)
+        // We move the queued writes to the pending writes...
+        WriteQueueItem item;
+        while (m_queuedWrites.pop(item))
+        {
+            if (item.batch.empty())
+            {
+                m_pendingBytes += item.queuedWrite.pBuffer->getBufferSize();
+                m_pendingWrites.push_back(std::move(item.queuedWrite));
+                continue;
+            }
+            for (auto& queuedWrite : item.batch)
+            {
+                m_pendingBytes += queuedWrite.pBuffer->getBufferSize();
+            }
+            if (m_pendingWrites.empty())
+            {
+                m_pendingWrites = std::move(item.batch);
+            }
+            else
+            {
+                m_pendingWrites.insert(m_pendingWrites.end(), std::make_move_iterator(item.batch.begin()), std::make_move_iterator(item.batch.end()));
+            }
+            item.batch.clear();
+        }
+        if (m_pendingWrites.empty())
         {
-            totalSize += queuedWrite->getBufferSize();
+            return;
         }
 
-        // We create a write-request with a buffer to hold all the queued items...
-        auto pWriteRequest = UVUtils::allocateWriteRequest(totalSize);
-        pWriteRequest->write_request.data = this;
+        // We check that the peer is reading the data fast enough...
+        if (!applySlowConsumerPolicy())
+        {
+            return;
+        }
 
-        // We copy the data into the buffer...
-        size_t bufferPosition = 0;
-        for (auto queuedWrite : *queuedWrites)
+        // If the flush policy holds writes until there is enough data to send, and we do
+        // not yet have enough, we wait for more data or for the flush timer...
+        auto holdWrites = m_flushPolicy.flushDelayMilliseconds > 0 &&
+            (m_flushPolicy.flushBytes <= 0 || m_pendingBytes < m_flushPolicy.flushBytes);
+        if (holdWrites)
         {
-            auto itemSize = queuedWrite->getBufferSize();
-            auto itemData = queuedWrite->getBuffer();
-            std::memcpy(pWriteRequest->buffer.base + bufferPosition, itemData, itemSize);
-            bufferPosition += itemSize;
+            startFlushTimer();
+            return;
         }
+        flushPendingWrites();
+    }
+    catch (const std::exception& ex)
+    {
+        Logger::error(Utils::format("%s: %s", __func__, ex.what()));
+    }
+}
+
+// Applies the slow-consumer policy if the queued data is above the high-water mark.
+// Returns true if the pending writes can be sent now, or false if the socket was
+// disconnected or if the writes are being held for conflation.
+bool Socket::applySlowConsumerPolicy()
+{
+    auto highWaterMark = m_slowConsumerPolicy.highWaterMarkBytes;
+    if (highWaterMark <= 0)
+    {
+        return true;
+    }
+
+    // The queued data is the data libuv has not yet been able to write to the socket,
+    // plus the data we are holding in the pending writes...
+    auto writeQueueSize = static_cast<int64_t>(uv_stream_get_write_queue_size((uv_stream_t*)m_pSocket));
+    auto queuedBytes = writeQueueSize + m_pendingBytes;
+    if (queuedBytes <= highWaterMark)
+    {
+        if (m_aboveHighWaterMark)
+        {
+            Logger::info(Utils::format("Socket %s is below its high-water mark: dropped messages=%llu",
+                m_name.c_str(), (unsigned long long)getDroppedMessageCount()));
+            m_aboveHighWaterMark = false;
+        }
+        return true;
+    }
+    if (!m_aboveHighWaterMark)
+    {
+        Logger::warn(Utils::format("Socket %s is above its high-water mark: queued bytes=%lld",
+            m_name.c_str(), (long long)queuedBytes));
+        m_aboveHighWaterMark = true;
+    }
+
+    // We apply the policy. Data already passed to libuv cannot be taken back, so we can
+    // only drop pending writes. We drop whole messages, so that the stream of messages
+    // the peer receives is still correctly framed...
+    switch (m_slowConsumerPolicy.action)
+    {
+    case SlowConsumerAction::DISCONNECT:
+        disconnectSlowConsumer();
+        return false;
+
+    case SlowConsumerAction::CONFLATE:
+        conflatePendingWrites();
+        if (writeQueueSize + m_pendingBytes <= highWaterMark)
+        {
+            return true;
+        }
+
+        // If libuv has no writes in flight, no write will complete to check again, so
+        // we send the conflated writes now rather than holding them...
+        if (writeQueueSize == 0)
+        {
+            return true;
+        }
+
+        // Otherwise we hold the writes until libuv has written enough data to take us
+        // below the mark, as onWriteCompleted() checks again as each write completes.
+        // We only do this while the held writes are within the mark: if conflation does
+        // not bring them within it (for example, for messages to many distinct subjects)
+        // holding them would not bound them, so we drop the oldest as for DROP_OLDEST...
+        if (m_pendingBytes <= highWaterMark)
+        {
+            return false;
+        }
+        dropOldestPendingWrites(writeQueueSize, highWaterMark);
+        break;
+
+    case SlowConsumerAction::DROP_OLDEST:
+        dropOldestPendingWrites(writeQueueSize, highWaterMark);
+        break;
 
-        // We write the combined buffer...
-        uv_write(
+    case SlowConsumerAction::DROP_NEWEST:
+    {
+        auto keepCount = m_pendingWrites.size();
+        while (keepCount > 0 && writeQueueSize + m_pendingBytes > highWaterMark)
+        {
+            --keepCount;
+            m_pendingBytes -= m_pendingWrites[keepCount].pBuffer->getBufferSize();
+        }
+        dropPendingWrites(keepCount, m_pendingWrites.size());
+        detachPendingViews();
+        break;
+    }
+    }
+    return true;
+}
+
+// Drops the oldest pending writes until the queued data is within the high-water mark
+// (or there are no pending writes), and copies any views in the writes which are kept.
+void Socket::dropOldestPendingWrites(int64_t writeQueueSize, int64_t highWaterMark)
+{
+    size_t dropCount = 0;
+    while (dropCount < m_pendingWrites.size() && writeQueueSize + m_pendingBytes > highWaterMark)
+    {
+        m_pendingBytes -= m_pendingWrites[dropCount].pBuffer->getBufferSize();
+        ++dropCount;
+    }
+    dropPendingWrites(0, dropCount);
+    detachPendingViews();
+}
+
+// Replaces held messages with newer messages for the same subject and subscription.
+void Socket::conflatePendingWrites()
+{
+    // The writes before m_conflatedWriteCount have already been conflated and are in the
+    // index. We walk the writes added since then in order. A message for a subject and
+    // subscription ID in the index replaces the earlier write, in its place in the queue.
+    // Other writes are moved down over the slots of the ones which replaced earlier writes,
+    // and are added to the index. Writes which are not SEND_MESSAGEs are not conflated.
+    //
+    // Two subscriptions matching the same subject (for example "A.B" and "A.*") share a
+    // Buffer with different subscription IDs, so we conflate them separately.
+    //
+    // The writes are held while we are above the mark, so we copy any views...
+    size_t conflatedCount = 0;
+    uint64_t conflatedBytes = 0;
+    auto keepCount = m_conflatedWriteCount;
+    for (auto i = m_conflatedWriteCount; i < m_pendingWrites.size(); ++i)
+    {
+        auto& queuedWrite = m_pendingWrites[i];
+        Buffer::detachView(queuedWrite.pBuffer);
+        ConflationKey key;
+        if (getConflationKey(queuedWrite, key))
+        {
+            auto keyHash = getConflationKeyHash(key);
+            size_t replacedIndex;
+            if (findConflatedWrite(key, keyHash, replacedIndex))
+            {
+                auto& replacedWrite = m_pendingWrites[replacedIndex];
+                auto replacedSize = replacedWrite.pBuffer->getBufferSize();
+                m_pendingBytes -= replacedSize;
+                conflatedBytes += replacedSize;
+                ++conflatedCount;
+                replacedWrite = std::move(queuedWrite);
+                continue;
+            }
+            m_conflationIndexes.insert({ keyHash, keepCount });
+        }
+        if (i != keepCount)
+        {
+            m_pendingWrites[keepCount] = std::move(queuedWrite);
+        }
+        ++keepCount;
+    }
+    m_pendingWrites.erase(m_pendingWrites.begin() + keepCount, m_pendingWrites.end());
+    m_conflatedWriteCount = keepCount;
+    if (conflatedCount == 0)
+    {
+        return;
+    }
+    m_droppedMessageCount.fetch_add(conflatedCount, std::memory_order_relaxed);
+    m_droppedByteCount.fetch_add(conflatedBytes, std::memory_order_relaxed);
+}
+
+// Finds the index of the pending write already conflated with the key specified,
+// and returns true, or returns false if there is none.
+bool Socket::findConflatedWrite(const ConflationKey& key, size_t keyHash, size_t& index) const
+{
+    // We check each write with the same hash, as different keys may have the same hash...
+    auto range = m_conflationIndexes.equal_range(keyHash);
+    for (auto it = range.first; it != range.second; ++it)
+    {
+        ConflationKey indexedKey;
+        getConflationKey(m_pendingWrites[it->second], indexedKey);
+        if (indexedKey.subscriptionID == key.subscriptionID &&
+            indexedKey.subjectLength == key.subjectLength &&
+            std::memcmp(indexedKey.pSubject, key.pSubject, key.subjectLength) == 0)
+        {
+            index = it->second;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Gets the conflation key for a queued write. Returns false if the write is not
+// for a SEND_MESSAGE, and so is not conflated.
+bool Socket::getConflationKey(const QueuedWrite& queuedWrite, ConflationKey& key)
+{
+    auto pData = queuedWrite.pBuffer->getData();
+    auto dataSize = queuedWrite.pBuffer->getBufferSize();
+    if (!NetworkMessageHeader::peekMessageSubject(pData, dataSize, key.pSubject, key.subjectLength))
+    {
+        return false;
+    }
+
+    // The subscription ID is the one patched over the header if there is one (see
+    // Utils::forwardNetworkMessage()), or otherwise the one in the Buffer...
+    if (queuedWrite.patchOffset == NetworkMessageHeader::SUBSCRIPTION_ID_OFFSET && queuedWrite.patchSize == sizeof(key.subscriptionID))
+    {
+        std::memcpy(&key.subscriptionID, queuedWrite.patch, sizeof(key.subscriptionID));
+    }
+    else
+    {
+        std::memcpy(&key.subscriptionID, pData + NetworkMessageHeader::SUBSCRIPTION_ID_OFFSET, sizeof(key.subscriptionID));
+    }
+    return true;
+}
+
+// Returns the hash of a conflation key.
+size_t Socket::getConflationKeyHash(const ConflationKey& key)
+{
+    return static_cast<size_t>(FieldKey::hash(key.pSubject, key.subjectLength)) * 31 + key.subscriptionID;
+}
+
+// Clears the conflation index, when pending writes are sent or dropped.
+void Socket::clearConflationIndex()
+{
+    m_conflationIndexes.clear();
+    m_conflatedWriteCount = 0;
+}
+
+// Copies the pending writes which are views, so that they do not hold on to the
+// receive buffers they refer to.
+void Socket::detachPendingViews()
+{
+    for (auto& queuedWrite : m_pendingWrites)
+    {
+        Buffer::detachView(queuedWrite.pBuffer);
+    }
+}
+
+// Drops the pending writes in the range specified, adding them to the dropped counts.
+// Note: This does not update m_pendingBytes.
+void Socket::dropPendingWrites(size_t first, size_t last)
+{
+    if (first >= last) return;
+    uint64_t droppedBytes = 0;
+    for (auto i = first; i < last; ++i)
+    {
+        droppedBytes += m_pendingWrites[i].pBuffer->getBufferSize();
+    }
+    m_droppedMessageCount.fetch_add(last - first, std::memory_order_relaxed);
+    m_droppedByteCount.fetch_add(droppedBytes, std::memory_order_relaxed);
+    m_pendingWrites.erase(m_pendingWrites.begin() + first, m_pendingWrites.begin() + last);
+    clearConflationIndex();
+}
+
+// Disconnects the socket as its peer is not reading data fast enough.
+void Socket::disconnectSlowConsumer()
+{
+    Logger::warn(Utils::format("Disconnecting slow consumer: %s", m_name.c_str()));
+
+    // We drop the pending writes, and note that we have disconnected the socket so
+    // that any further writes are discarded...
+    dropPendingWrites(0, m_pendingWrites.size());
+    m_pendingBytes = 0;
+    m_connected = false;
+    m_disconnectedAsSlowConsumer = true;
+    closeFlushTimer();
+
+    // We close the UV socket. Writes which libuv has not yet completed are cancelled.
+    // (The destructor does not close the socket again, as m_pSocket is null.)
+    uv_read_stop((uv_stream_t*)m_pSocket);
+    uv_close((uv_handle_t*)m_pSocket, [](uv_handle_t* pHandle) { delete (uv_tcp_t*)pHandle; });
+    m_pSocket = nullptr;
+
+    // We notify the callback. This may release the socket, so we marshall it to run
+    // after the code which is writing to the socket has completed. If the owner has
+    // already released the socket, there is no one to notify...
+    std::weak_ptr<Socket> pWeakSelf = shared_from_this();
+    m_pUVLoop->marshallEvent(
+        [pWeakSelf](uv_loop_t* /*pLoop*/)
+        {
+            auto pSelf = pWeakSelf.lock();
+            if (pSelf && pSelf->m_pCallback) pSelf->m_pCallback->onDisconnected(pSelf.get());
+        }
+    );
+}
+
+// Starts the timer to flush the pending writes, if it is not already running.
+void Socket::startFlushTimer()
+{
+    // We create the timer on the socket's loop if we do not already have one...
+    if (!m_pFlushTimer)
+    {
+        m_pFlushTimer = new uv_timer_t;
+        uv_timer_init(m_pUVLoop->getUVLoop(), m_pFlushTimer);
+        m_pFlushTimer->data = this;
+    }
+
+    // The timer runs from when the oldest pending data was queued, so we do not
+    // restart it if it is already running...
+    if (uv_is_active((uv_handle_t*)m_pFlushTimer))
+    {
+        return;
+    }
+    uv_timer_start(
+        m_pFlushTimer,
+        [](uv_timer_t* pTimer)
+        {
+            auto self = (Socket*)pTimer->data;
+            if (self->applySlowConsumerPolicy()) self->flushPendingWrites();
+        },
+        m_flushPolicy.flushDelayMilliseconds,
+        0
+    );
+}
+
+// Closes the flush timer.
+void Socket::closeFlushTimer()
+{
+    if (!m_pFlushTimer) return;
+    uv_close((uv_handle_t*)m_pFlushTimer, [](uv_handle_t* pHandle) { delete (uv_timer_t*)pHandle; });
+    m_pFlushTimer = nullptr;
+}
+
+// Sends all pending writes in one network update.
+void Socket::flushPendingWrites()
+{
+    try
+    {
+        // We check if the socket is connected and if there is anything to send...
+        if (!m_connected || m_pendingWrites.empty())
+        {
+            return;
+        }
+
+        // We are sending all the pending data, so we stop the flush timer...
+        if (m_pFlushTimer)
+        {
+            uv_timer_stop(m_pFlushTimer);
+        }
+
+        // We create a write-request and move the pending writes into it. This keeps
+        // their Buffers (and patches) alive until the write has completed...
+        auto pWriteRequest = new write_request_t;
+        pWriteRequest->self = this;
+        pWriteRequest->write_request.data = pWriteRequest;
+        auto& queuedWrites = pWriteRequest->queuedWrites;
+        queuedWrites.swap(m_pendingWrites);
+        m_pendingBytes = 0;
+        clearConflationIndex();
+
+        // If the socket has a high-water mark and libuv is still writing earlier data,
+        // this write waits behind it for the peer to read. So we copy any views rather
+        // than holding their receive buffers for that time. (See SlowConsumerPolicy.)...
+        auto detachViews = m_slowConsumerPolicy.highWaterMarkBytes > 0 &&
+            uv_stream_get_write_queue_size((uv_stream_t*)m_pSocket) > 0;
+
+        // We add a UV buffer pointing to the data for each queued write, so the data is
+        // sent directly from the Buffers without being copied. If a queued write has a
+        // patch, the data before the patch, the patch itself and the data after it are
+        // added as separate UV buffers...
+        auto& buffers = pWriteRequest->buffers;
+        buffers.reserve(queuedWrites.size() * 3);
+        for (auto& queuedWrite : queuedWrites)
+        {
+            if (detachViews)
+            {
+                Buffer::detachView(queuedWrite.pBuffer);
+            }
+
+            // Note: The buffer may be shared with other sockets, so we use getData(), which
+            //       does not write to it. libuv does not write to the data it sends...
+            auto pData = const_cast<char*>(queuedWrite.pBuffer->getData());
+            auto dataSize = queuedWrite.pBuffer->getBufferSize();
+            if (queuedWrite.patchSize == 0)
+            {
+                buffers.push_back(uv_buf_init(pData, static_cast<unsigned int>(dataSize)));
+                continue;
+            }
+            auto patchEnd = queuedWrite.patchOffset + queuedWrite.patchSize;
+            if (queuedWrite.patchOffset > 0)
+            {
+                buffers.push_back(uv_buf_init(pData, static_cast<unsigned int>(queuedWrite.patchOffset)));
+            }
+            buffers.push_back(uv_buf_init(queuedWrite.patch, static_cast<unsigned int>(queuedWrite.patchSize)));
+            if (patchEnd < dataSize)
+            {
+                buffers.push_back(uv_buf_init(pData + patchEnd, static_cast<unsigned int>(dataSize - patchEnd)));
+            }
+        }
+
+        // We write the buffers...
+        auto status = uv_write(
             &pWriteRequest->write_request,
             (uv_stream_t*)m_pSocket,
-            &pWriteRequest->buffer,
-            1,
+            buffers.data(),
+            static_cast<unsigned int>(buffers.size()),
             [](uv_write_t* r, int s)
             {
-                auto self = (Socket*)r->data;
-                self->onWriteCompleted(r, s);
+                auto pWriteRequest = (write_request_t*)r->data;
+                pWriteRequest->self->onWriteCompleted(r, s);
             }
         );
+        if (status != 0)
+        {
+            // The write could not be queued, so the completion callback will not be called...
+            Logger::error(Utils::format("uv_write failed: %s", uv_strerror(status)));
+            delete pWriteRequest;
+        }
     }
     catch (const std::exception& ex)
     {
@@ -454,9 +1020,17 @@ void Socket::onWriteCompleted(uv_write_t* pRequest, int status)
             Logger::error(Utils::format("Write error: %s", uv_strerror(status)));
         }
 
-        // We release the write request (including the buffer)...
-        auto pWriteRequest = (UVUtils::WriteRequest*)pRequest;
-        UVUtils::releaseWriteRequest(pWriteRequest);
+        // We release the write request, and with it our references to the Buffers written...
+        auto pWriteRequest = (write_request_t*)pRequest->data;
+        delete pWriteRequest;
+
+        // If we are holding writes for conflation, we check if we can now send them.
+        // (We only do this for successful writes, as writes are cancelled when the socket
+        // is closed.)
+        if (status == 0 && m_aboveHighWaterMark && !m_pendingWrites.empty())
+        {
+            processQueuedWrites();
+        }
     }
     catch (const std::exception& ex)
     {
@@ -499,6 +1073,10 @@ void Socket::onDataReceived(uv_stream_t* /*pStream*/, ssize_t nread, const uv_bu
         // We check for errors...
         if (nread < 1)
         {
+            // libuv may have allocated a buffer even if no data was read...
+            UVUtils::releaseBufferMemory(pBuffer);
+            if (nread == 0) return;
+
             auto error = uv_strerror((int)nread);
             Logger::info(Utils::format("onDataReceived: %s", error));
             if (nread == UV_EOF)
@@ -548,44 +1126,115 @@ void Socket::onDataReceived(uv_stream_t* /*pStream*/, ssize_t nread, const uv_bu
         // NOTE: We need to be careful when reading the size for a new message. It is
         //       possible that the size itself may only be received across multiple of
         //       these callbacks.
+        //
+        // Complete messages
+        // -----------------
+        // Most messages are small and arrive whole. If we are expecting a new message
+        // and all its data is in the buffer, we do not copy it into a new Buffer. Instead
+        // we give the callback a read-only view of the message in the receive buffer.
+        // The view holds a reference to the receive buffer, so it can be kept after the
+        // callback returns. We only copy messages which are split across updates.
+        //
+        // We find the complete messages with one pass over their sizes (see
+        // Buffer::scanNetworkMessages()), and then create the views for all of them.
+
+        //
+        // Batches of messages
+        // -------------------
+        // We collect the complete messages from the read and pass them to the callback
+        // together. When a publisher sends a burst of small messages, this lets the
+        // callback spread its per-call costs across all the messages in the read.
+
+        // We process the data, and call back with the messages it holds...
+        processReceivedData(pBuffer->base, nread);
+        dispatchReceivedMessages();
+
+        // We release the buffer memory. (Any views of the messages in it hold
+        // their own references to it.)
+        UVUtils::releaseBufferMemory(pBuffer);
+    }
+    catch (const std::exception& ex)
+    {
+        Logger::error(Utils::format("%s: %s", __func__, ex.what()));
+    }
+}
 
-        // We read the buffer...
-        size_t bufferSize = nread;
-        size_t bufferPosition = 0;
-        while (bufferPosition < bufferSize)
+// Processes data from a receive buffer, adding the complete messages it holds
+// to m_receivedMessages.
+void Socket::processReceivedData(char* pReceiveBuffer, size_t bufferSize)
+{
+    // See the comments in onDataReceived() about how the data is processed...
+    size_t bufferPosition = 0;
+    while (bufferPosition < bufferSize)
+    {
+        // If we are expecting a new message, we find all the complete messages from
+        // this position in one pass, and add views of them. If that is all the data
+        // we are done, and otherwise the next message is not all in the buffer...
+        if (!m_pCurrentMessage)
         {
-            // If we do not have a current message we create one...
-            if (!m_pCurrentMessage)
+            m_receivedFrames.clear();
+            bufferPosition = Buffer::scanNetworkMessages(pReceiveBuffer, bufferSize, bufferPosition, m_receivedFrames);
+            Buffer::createViews(pReceiveBuffer, m_receivedFrames, m_receivedMessages);
+            if (bufferPosition >= bufferSize)
             {
-                m_pCurrentMessage = Buffer::create();
+                break;
             }
+        }
 
-            // We read data into the current message...
-            size_t bytesRead = m_pCurrentMessage->readNetworkMessage(pBuffer->base, bufferSize, bufferPosition);
+        // If we do not have a current message we create one...
+        if (!m_pCurrentMessage)
+        {
+            m_pCurrentMessage = Buffer::create();
+        }
 
-            // If we have read all data for the current message we call back with it...
-            if (m_pCurrentMessage->hasAllData())
-            {
-                // We reset the position of the message / buffer so that it is 
-                // ready to be read by the client in the callback...
-                m_pCurrentMessage->resetPosition();
-                if (m_pCallback) m_pCallback->onDataReceived(this, m_pCurrentMessage);
+        // We read data into the current message...
+        size_t bytesRead = m_pCurrentMessage->readNetworkMessage(pReceiveBuffer, bufferSize, bufferPosition);
 
-                // We clear the current message to start a new one...
-                m_pCurrentMessage = nullptr;
-            }
+        // If we have read all data for the current message we add it...
+        if (m_pCurrentMessage->hasAllData())
+        {
+            // We reset the position of the message / buffer so that it is 
+            // ready to be read by the client in the callback...
+            m_pCurrentMessage->resetPosition();
+            m_receivedMessages.push_back(std::move(m_pCurrentMessage));
 
-            // We update the buffer position and loop to check if there is
-            // more data to read...
-            bufferPosition += bytesRead;
+            // We clear the current message to start a new one...
+            m_pCurrentMessage = nullptr;
         }
 
-        // We release the buffer memory...
-        UVUtils::releaseBufferMemory(pBuffer);
+        // We update the buffer position and loop to check if there is
+        // more data to read...
+        bufferPosition += bytesRead;
     }
-    catch (const std::exception& ex)
+}
+
+// Calls back with the received messages. If the socket starts moving to another
+// UV loop during the callback, we keep the messages not yet processed.
+void Socket::dispatchReceivedMessages()
+{
+    if (m_receivedMessages.empty()) return;
+
+    // We call back with the messages. If they were not all processed we keep the
+    // rest to process on the new loop...
+    size_t processedCount = m_receivedMessages.size();
+    if (m_pCallback) processedCount = m_pCallback->onDataReceivedBatch(this, m_receivedMessages);
+    if (processedCount < m_receivedMessages.size())
     {
-        Logger::error(Utils::format("%s: %s", __func__, ex.what()));
+        m_unreadMessages.insert(
+            m_unreadMessages.end(),
+            std::make_move_iterator(m_receivedMessages.begin() + processedCount),
+            std::make_move_iterator(m_receivedMessages.end()));
     }
+    m_receivedMessages.clear();
+}
+
+// Processes messages which were received before the socket moved to its new UV loop
+// but which had not been processed when the move started.
+void Socket::processUnreadData()
+{
+    // We take the unread messages and call back with them. If processing them starts
+    // another move, the messages still not processed are kept again...
+    m_receivedMessages.swap(m_unreadMessages);
+    dispatchReceivedMessages();
 }
 
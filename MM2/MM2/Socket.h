@@ -1,8 +1,14 @@
 #pragma once
 #include <string>
+#include <vector>
+#include <memory>
+#include <unordered_map>
+#include <atomic>
 #include "uv.h"
 #include "SharedPointers.h"
-#include "ThreadsafeConsumableVector.h"
+#include "MPSCQueue.h"
+#include "Buffer.h"
+#include "MessageEncoding.h"
 
 namespace MessagingMesh
 {
@@ -15,8 +21,12 @@ namespace MessagingMesh
     /// 
     /// Can either be a client socket making a connection to a server
     /// or a server socket listening for client connections.
+    /// 
+    /// Sockets are always held by shared pointer (see create()). Events the socket
+    /// marshalls to its UV loop hold a weak pointer to it, as the socket can be
+    /// released by its owner on another thread before the event runs.
     /// </summary>
-    class Socket
+    class Socket : public std::enable_shared_from_this<Socket>
     {
     public:
         // Interface for socket callbacks.
@@ -31,6 +41,26 @@ namespace MessagingMesh
             // Called on the UV loop thread.
             virtual void onDataReceived(Socket* pSocket, BufferPtr pBuffer) = 0;
 
+            // Called with all the complete messages from one read of the socket.
+            // Called on the UV loop thread.
+            // 
+            // Returns the number of messages processed. This is less than the number of messages
+            // passed in if the socket starts moving to another UV loop while they are processed,
+            // in which case the remaining messages are passed to the callback on the new loop.
+            // 
+            // The default implementation calls onDataReceived() for each message. Override this
+            // to process the messages together, for example to make one write to each socket
+            // they are forwarded to.
+            virtual size_t onDataReceivedBatch(Socket* pSocket, const std::vector<BufferPtr>& messages)
+            {
+                for (size_t i = 0; i < messages.size(); ++i)
+                {
+                    if (pSocket->isMoving()) return i;
+                    onDataReceived(pSocket, messages[i]);
+                }
+                return messages.size();
+            }
+
             // Called when a socket has been disconnected.
             virtual void onDisconnected(Socket* pSocket) = 0;
 
@@ -38,6 +68,73 @@ namespace MessagingMesh
             virtual void onMoveToLoopComplete(Socket* pSocket) = 0;
         };
 
+        // Data queued for writing to the socket.
+        // The Buffer may be shared with other sockets, so any bytes specific to this
+        // socket are held in the patch and written over the Buffer's data when sent.
+        struct QueuedWrite
+        {
+            BufferPtr pBuffer;
+            int32_t patchOffset = 0;
+            int32_t patchSize = 0;
+            char patch[8] = {};
+        };
+
+        // Vector of queued writes.
+        typedef std::vector<QueuedWrite> VecQueuedWrite;
+
+        // When data queued for writing is sent to the network.
+        // - If flushDelayMilliseconds is zero (the default), queued data is written on the
+        //   next iteration of the UV loop. This gives the lowest latency.
+        // - Otherwise queued data is held until at least flushBytes are queued (if flushBytes
+        //   is set), or until flushDelayMilliseconds after the oldest data was queued. This
+        //   sends fewer, larger writes, at the cost of latency.
+        struct FlushPolicy
+        {
+            int32_t flushBytes = 0;
+            uint32_t flushDelayMilliseconds = 0;
+        };
+
+        // What we do when the data queued for a socket is above its high-water mark.
+        // - DROP_OLDEST: Drop the oldest messages not yet passed to libuv.
+        // - DROP_NEWEST: Drop the newest messages.
+        // - DISCONNECT:  Disconnect the socket.
+        // - CONFLATE:    Hold messages until the socket is below the mark. A message replaces
+        //                any held message for the same subject and subscription, in the older
+        //                message's place in the queue. So only the latest message for each
+        //                subscription to a subject is sent. If the held messages are still
+        //                above the mark after this (for example, for many distinct subjects),
+        //                the oldest are dropped as for DROP_OLDEST. If libuv is not writing
+        //                any data, the held messages are sent, as nothing would release them.
+        enum class SlowConsumerAction
+        {
+            DROP_OLDEST,
+            DROP_NEWEST,
+            DISCONNECT,
+            CONFLATE
+        };
+
+        // Limits the data queued for a socket whose peer is not reading it fast enough.
+        // The queued data is the data held by libuv waiting for the socket to be writable,
+        // plus data held by the flush policy. If this is more than highWaterMarkBytes, the
+        // action is applied. A highWaterMarkBytes of zero (the default) means no limit.
+        //
+        // Received messages are forwarded as views of the receive buffers they arrived in
+        // (see Buffer::createView()), and each view keeps its whole receive buffer (typically
+        // 64KB) alive. So we copy views into Buffers of their own size when they would be
+        // held: while the socket is above the mark, and when they are passed to libuv while
+        // it is still writing earlier data. Views are only passed to libuv uncopied when it
+        // has nothing queued, and it sends what it can of them straight away. So the memory
+        // held for the socket is the queued data plus the receive buffers referred to by
+        // the one write libuv could not finish when it was passed (in the worst case, one
+        // receive buffer for each view in that write). The queued data is bounded by the
+        // mark, except that a write passed to libuv when it had nothing queued can be
+        // larger than the mark.
+        struct SlowConsumerPolicy
+        {
+            int64_t highWaterMarkBytes = 0;
+            SlowConsumerAction action = SlowConsumerAction::DROP_OLDEST;
+        };
+
     // Public methods...
     public:
         // Creates a Socket instance to be managed by the uv loop specified.
@@ -55,8 +152,32 @@ namespace MessagingMesh
         // Sets the callback.
         void setCallback(ICallback* pCallback);
 
+        // Sets when queued data is sent to the network.
+        // Call this on the socket's UV loop thread, or before the socket is connected.
+        void setFlushPolicy(const FlushPolicy& flushPolicy) { m_flushPolicy = flushPolicy; }
+
+        // Sets the limit on data queued for the socket, and what we do when it is reached.
+        // Call this on the socket's UV loop thread, or before the socket is connected.
+        void setSlowConsumerPolicy(const SlowConsumerPolicy& slowConsumerPolicy) { m_slowConsumerPolicy = slowConsumerPolicy; }
+
+        // Gets the number of messages, and their total size, dropped (or replaced by newer
+        // messages for the same subject) by the slow-consumer policy.
+        // Can be called from any thread.
+        uint64_t getDroppedMessageCount() const { return m_droppedMessageCount.load(std::memory_order_relaxed); }
+        uint64_t getDroppedByteCount() const { return m_droppedByteCount.load(std::memory_order_relaxed); }
+
+        // Sets the encoding of messages sent to the peer, as selected by the CONNECT handshake.
+        // Call this before the socket is registered with a service.
+        void setMessageEncoding(MessageEncoding messageEncoding) { m_messageEncoding = messageEncoding; }
+
+        // Gets the encoding of messages sent to the peer.
+        MessageEncoding getMessageEncoding() const { return m_messageEncoding; }
+
         // Connects a server socket to listen on the specified port.
-        void listen(int port);
+        // If reusePort is true the socket is bound with SO_REUSEPORT, so that other sockets
+        // (also using reusePort) can listen on the same port. The OS spreads incoming
+        // connections across them. See UVUtils::supportsReusePort().
+        void listen(int port, bool reusePort = false);
 
         // Connects the socket by accepting a listen request received by the server.
         void accept(uv_stream_t* server);
@@ -66,12 +187,35 @@ namespace MessagingMesh
 
         // Queues data to be written to the socket.
         // Can be called from any thread, not just from the uv loop thread.
-        // Queued writes will be coalesced into one network update.
+        // Queued writes will be sent together in one network update.
         void write(BufferPtr pBuffer);
 
+        // Queues data to be written to the socket, with the patch bytes written over
+        // the data from the buffer at the offset specified. 
+        // 
+        // The Buffer itself is not changed, so the same Buffer can be written to multiple
+        // sockets each with their own patch. For example, when a message is sent to many
+        // subscribers, with only the subscription ID in the header differing for each one.
+        // 
+        // Can be called from any thread, not just from the uv loop thread.
+        void write(BufferPtr pBuffer, int32_t patchOffset, const void* pPatch, int32_t patchSize);
+
+        // Queues a batch of writes to the socket.
+        // The whole batch is queued in one operation, which is cheaper than writing each of
+        // them separately when many messages are sent to the same socket at the same time.
+        // Can be called from any thread, not just from the uv loop thread.
+        void write(VecQueuedWrite&& queuedWrites);
+
+        // Creates a queued write for the buffer, with the patch bytes to be written over
+        // its data at the offset specified. (See write() above.)
+        static QueuedWrite createQueuedWrite(BufferPtr pBuffer, int32_t patchOffset, const void* pPatch, int32_t patchSize);
+
         // Moves the socket to be managed by the UV loop specified.
         void moveToLoop(UVLoopPtr pLoop);
 
+        // Returns true while the socket is moving to another UV loop.
+        bool isMoving() const { return m_moving; }
+
     // Private types...
     private:
 
@@ -84,6 +228,34 @@ namespace MessagingMesh
             UVLoopPtr pNewUVLoop;
         };
 
+        // An item in the queue of writes: either one queued write or, if the batch
+        // is not empty, a batch of them.
+        struct WriteQueueItem
+        {
+            QueuedWrite queuedWrite;
+            VecQueuedWrite batch;
+        };
+
+        // The subject and subscription ID of a queued SEND_MESSAGE, used when conflating.
+        // The subject points into the write's Buffer.
+        struct ConflationKey
+        {
+            const char* pSubject = nullptr;
+            int32_t subjectLength = 0;
+            uint32_t subscriptionID = 0;
+        };
+
+        // A UV write request for a set of queued writes.
+        // We hold the queued writes so that their Buffers stay alive until the write has
+        // completed, as the UV buffers point directly to the data in them.
+        struct write_request_t
+        {
+            Socket* self = nullptr;
+            uv_write_t write_request{};
+            std::vector<uv_buf_t> buffers;
+            VecQueuedWrite queuedWrites;
+        };
+
         // Context information used when connecting to a socket using (hostname, port).
         struct connect_hostname_t
         {
@@ -121,12 +293,73 @@ namespace MessagingMesh
         // Called when data has been received on a socket.
         void onDataReceived(uv_stream_t* pClientStream, ssize_t bufferSize, const uv_buf_t* pBuffer);
 
+        // Processes data from a receive buffer, adding the complete messages it holds
+        // to m_receivedMessages.
+        void processReceivedData(char* pReceiveBuffer, size_t bufferSize);
+
+        // Calls back with the received messages. If the socket starts moving to another
+        // UV loop during the callback, we keep the messages not yet processed.
+        void dispatchReceivedMessages();
+
+        // Processes messages which were received before the socket moved to its new UV loop
+        // but which had not been processed when the move started.
+        void processUnreadData();
+
+        // Queues an item to be written and schedules the write.
+        void queueWrite(WriteQueueItem&& item);
+
         // Called when a write request has completed.
         void onWriteCompleted(uv_write_t* pRequest, int status);
 
-        // Sends a coalesced network message for all queued writes.
+        // Moves queued writes to the pending writes, and sends them if the flush policy allows.
         void processQueuedWrites();
 
+        // Sends all pending writes in one network update.
+        void flushPendingWrites();
+
+        // Starts the timer to flush the pending writes, if it is not already running.
+        void startFlushTimer();
+
+        // Closes the flush timer.
+        void closeFlushTimer();
+
+        // Applies the slow-consumer policy if the queued data is above the high-water mark.
+        // Returns true if the pending writes can be sent now, or false if the socket was
+        // disconnected or if the writes are being held for conflation.
+        bool applySlowConsumerPolicy();
+
+        // Drops the oldest pending writes until the queued data is within the high-water mark
+        // (or there are no pending writes), and copies any views in the writes which are kept.
+        void dropOldestPendingWrites(int64_t writeQueueSize, int64_t highWaterMark);
+
+        // Replaces held messages with newer messages for the same subject and subscription.
+        void conflatePendingWrites();
+
+        // Finds the index of the pending write already conflated with the key specified,
+        // and returns true, or returns false if there is none.
+        bool findConflatedWrite(const ConflationKey& key, size_t keyHash, size_t& index) const;
+
+        // Gets the conflation key for a queued write. Returns false if the write is not
+        // for a SEND_MESSAGE, and so is not conflated.
+        static bool getConflationKey(const QueuedWrite& queuedWrite, ConflationKey& key);
+
+        // Returns the hash of a conflation key.
+        static size_t getConflationKeyHash(const ConflationKey& key);
+
+        // Clears the conflation index, when pending writes are sent or dropped.
+        void clearConflationIndex();
+
+        // Copies the pending writes which are views, so that they do not hold on to the
+        // receive buffers they refer to.
+        void detachPendingViews();
+
+        // Drops the pending writes in the range specified, adding them to the dropped counts.
+        // Note: This does not update m_pendingBytes.
+        void dropPendingWrites(size_t first, size_t last);
+
+        // Disconnects the socket as its peer is not reading data fast enough.
+        void disconnectSlowConsumer();
+
         // Called after the original socket is closed as part of moving the socket to another UV loop.
         void moveToLoop_onSocketClosed(move_socket_t* pMoveInfo);
 
@@ -155,8 +388,63 @@ namespace MessagingMesh
         // The message being currently read (possibly across multiple onDataReceived callbacks).
         BufferPtr m_pCurrentMessage;
 
+        // True while the socket is moving to another UV loop.
+        bool m_moving;
+
+        // Complete messages from the current read, to be passed to the callback together.
+        // We reuse this to avoid allocating for each read.
+        std::vector<BufferPtr> m_receivedMessages;
+
+        // The positions and sizes of the complete messages found in a receive buffer,
+        // before views of them are added to m_receivedMessages. We reuse this too.
+        std::vector<Buffer::NetworkMessageFrame> m_receivedFrames;
+
+        // Messages received but not processed when the socket started moving to another UV loop.
+        std::vector<BufferPtr> m_unreadMessages;
+
         // Data queued for writing.
-        ThreadsafeConsumableVector<BufferPtr> m_queuedWrites;
+        MPSCQueue<WriteQueueItem> m_queuedWrites;
+
+        // True if an event has been marshalled to the UV loop to process the queued
+        // writes, and it has not yet started processing them.
+        std::atomic<bool> m_writeScheduled;
+
+        // When queued data is sent to the network.
+        FlushPolicy m_flushPolicy;
+
+        // Writes taken from the queue but held until the flush policy allows them to be sent,
+        // and their total size. Only accessed from the UV loop thread.
+        VecQueuedWrite m_pendingWrites;
+        int64_t m_pendingBytes;
+
+        // Timer to flush the pending writes, created when first needed.
+        // Note: Like m_pSocket, this is deleted asynchronously when it is closed.
+        uv_timer_t* m_pFlushTimer;
+
+        // Limit on the data queued for the socket.
+        SlowConsumerPolicy m_slowConsumerPolicy;
+
+        // True while the queued data is above the high-water mark. (We use this to log
+        // when the mark is crossed, rather than for each write.)
+        bool m_aboveHighWaterMark;
+
+        // True if we disconnected the socket by applying the slow-consumer policy.
+        bool m_disconnectedAsSlowConsumer;
+
+        // Indexes of the pending writes which have been conflated, keyed by the hash of their
+        // subject and subscription ID, and the number of pending writes conflated so far.
+        // Conflating only looks at the writes added since it last ran, and the index is
+        // cleared when the pending writes are sent or dropped...
+        std::unordered_multimap<size_t, size_t> m_conflationIndexes;
+        size_t m_conflatedWriteCount;
+
+        // Messages, and their total size, dropped by the slow-consumer policy.
+        std::atomic<uint64_t> m_droppedMessageCount;
+        std::atomic<uint64_t> m_droppedByteCount;
+
+        // The encoding of messages sent to the peer. This is set before the socket is
+        // registered with a service and not changed, so it can be read from any thread.
+        MessageEncoding m_messageEncoding;
 
     // Constants...
     private:
@@ -0,0 +1,379 @@
+#include "SubjectMatchingEngine.h"
+#include <algorithm>
+#include "Socket.h"
+using namespace MessagingMesh;
+
+// Constructor.
+SubjectMatchingEngine::SubjectMatchingEngine() :
+    m_pRoot(std::make_unique<Node>())
+{
+}
+
+// Destructor.
+SubjectMatchingEngine::~SubjectMatchingEngine()
+{
+}
+
+// Adds a subscription to the subject for the socket and subscription ID.
+// The subject can include wildcards.
+void SubjectMatchingEngine::addSubscription(const std::string& subject, const SocketPtr& pSocket, uint32_t subscriptionID)
+{
+    // If the client is reusing a subscription ID we remove the previous subscription...
+    removeSubscription(pSocket.get(), subscriptionID);
+
+    // We add the subscription to the node for the subject...
+    Subscriber subscriber{ pSocket, subscriptionID };
+    bool isTail;
+    auto pNode = getOrCreateNode(subject, isTail);
+    if (isTail)
+    {
+        pNode->tailSubscribers.push_back(subscriber);
+    }
+    else
+    {
+        pNode->subscribers.push_back(subscriber);
+    }
+
+    // We add the subscriber to the cached subjects it matches...
+    addToCache(subject, subscriber);
+
+    // We note the subject so that we can find the subscription when unsubscribing...
+    m_socketSubscriptions[pSocket.get()][subscriptionID] = subject;
+}
+
+// Removes the subscription for the socket and subscription ID.
+void SubjectMatchingEngine::removeSubscription(const Socket* pSocket, uint32_t subscriptionID)
+{
+    // We find the subject for the subscription...
+    auto it_socket = m_socketSubscriptions.find(pSocket);
+    if (it_socket == m_socketSubscriptions.end())
+    {
+        return;
+    }
+    auto& subscriptionSubjects = it_socket->second;
+    auto it_subscription = subscriptionSubjects.find(subscriptionID);
+    if (it_subscription == subscriptionSubjects.end())
+    {
+        return;
+    }
+
+    // We remove the subscriber from the trie and from the cache...
+    auto& subject = it_subscription->second;
+    removeSubscriber(subject, pSocket, subscriptionID);
+    removeFromCache(subject, pSocket, subscriptionID);
+
+    // We remove the subscription from the socket's collection...
+    subscriptionSubjects.erase(it_subscription);
+    if (subscriptionSubjects.empty())
+    {
+        m_socketSubscriptions.erase(it_socket);
+    }
+}
+
+// Removes all subscriptions for the socket.
+void SubjectMatchingEngine::removeAllSubscriptions(const Socket* pSocket)
+{
+    auto it_socket = m_socketSubscriptions.find(pSocket);
+    if (it_socket == m_socketSubscriptions.end())
+    {
+        return;
+    }
+
+    // We remove the subscriptions from the trie and from the cache. (If any of them
+    // have wildcards this makes the whole cache out of date, rather than each of them
+    // checking the cache.)...
+    auto hadWildcards = false;
+    for (auto& pair : it_socket->second)
+    {
+        removeSubscriber(pair.second, pSocket, pair.first);
+        removeFromCache(pair.second, pSocket, pair.first);
+        hadWildcards = hadWildcards || hasWildcards(pair.second);
+    }
+    m_socketSubscriptions.erase(it_socket);
+
+    // Out of date matches are only made again when their subjects are next looked up,
+    // so those for a wildcard subscription could hold on to the socket indefinitely.
+    // The socket is being closed, so we remove it from them now...
+    if (hadWildcards)
+    {
+        removeSocketFromCache(pSocket);
+    }
+}
+
+// Returns the subscribers for the subject.
+// Note: The reference returned is only valid until the next call to the engine.
+const SubjectMatchingEngine::VecSubscriber& SubjectMatchingEngine::getSubscribers(const std::string& subject)
+{
+    // We check if we have already matched the subject. If the match is from an earlier
+    // generation of the cache we match it again...
+    bool isTail;
+    auto it = m_matchCache.find(subject);
+    if (it != m_matchCache.end())
+    {
+        auto& cachedMatch = it->second;
+        if (cachedMatch.generation != m_generation)
+        {
+            cachedMatch.subscribers.clear();
+            splitSubject(subject, isTail);
+            match(m_pRoot.get(), subject, 0, cachedMatch.subscribers);
+            cachedMatch.generation = m_generation;
+        }
+        return cachedMatch.subscribers;
+    }
+
+    // We have not seen this subject (since the cache was last cleared), so we match
+    // it against the trie. We use m_scratchMatch so that we do not allocate a vector
+    // for a subject we do not cache...
+    m_scratchMatch.clear();
+    splitSubject(subject, isTail);
+    match(m_pRoot.get(), subject, 0, m_scratchMatch);
+
+    // We cache the result, even if there are no subscribers. If the cache is full, we
+    // do not cache a subject with no subscribers, and otherwise we clear the cache...
+    if (m_matchCache.size() >= MAX_CACHED_SUBJECTS)
+    {
+        if (m_scratchMatch.empty())
+        {
+            return m_noSubscribers;
+        }
+        m_matchCache.clear();
+    }
+    auto& cachedMatch = m_matchCache[subject];
+    cachedMatch.subscribers = m_scratchMatch;
+    cachedMatch.generation = m_generation;
+    return cachedMatch.subscribers;
+}
+
+// Returns the subscribers for the subject, which is not null-terminated. This is for
+// subjects read in place from received data, and does not allocate a string for them.
+// Note: The reference returned is only valid until the next call to the engine.
+const SubjectMatchingEngine::VecSubscriber& SubjectMatchingEngine::getSubscribers(const char* pSubject, int32_t subjectLength)
+{
+    // We copy the subject into the lookup string, which only allocates when it needs
+    // more capacity than it has held before...
+    m_lookupSubject.assign(pSubject, subjectLength);
+    return getSubscribers(m_lookupSubject);
+}
+
+// Finds the node for a subscription subject, creating it (and its parents) if needed.
+// Sets isTail to true if the subscription is for the node's tail-subscribers.
+SubjectMatchingEngine::Node* SubjectMatchingEngine::getOrCreateNode(const std::string& subscriptionSubject, bool& isTail)
+{
+    auto pNode = m_pRoot.get();
+    auto tokenCount = splitSubject(subscriptionSubject, isTail);
+    for (size_t i = 0; i < tokenCount; ++i)
+    {
+        // We find the child for the token, creating it if it does not exist...
+        setToken(subscriptionSubject, i);
+        auto& pChild = pNode->children[m_token];
+        if (!pChild)
+        {
+            pChild = std::make_unique<Node>();
+            pChild->pParent = pNode;
+            pChild->token = m_token;
+            if (m_token.length() == 1 && m_token[0] == SINGLE_TOKEN_WILDCARD)
+            {
+                pNode->pWildcardChild = pChild.get();
+            }
+        }
+        pNode = pChild.get();
+    }
+    return pNode;
+}
+
+// Finds the node for a subscription subject, or nullptr if there is no node for it.
+// Sets isTail to true if the subscription is for the node's tail-subscribers.
+SubjectMatchingEngine::Node* SubjectMatchingEngine::findNode(const std::string& subscriptionSubject, bool& isTail)
+{
+    auto pNode = m_pRoot.get();
+    auto tokenCount = splitSubject(subscriptionSubject, isTail);
+    for (size_t i = 0; i < tokenCount; ++i)
+    {
+        setToken(subscriptionSubject, i);
+        auto it = pNode->children.find(m_token);
+        if (it == pNode->children.end())
+        {
+            return nullptr;
+        }
+        pNode = it->second.get();
+    }
+    return pNode;
+}
+
+// Finds the start of each token in the subject, and returns the number of tokens
+// which make up the path to the subject's node in the trie.
+size_t SubjectMatchingEngine::splitSubject(const std::string& subject, bool& isTail)
+{
+    m_tokenStarts.clear();
+    m_tokenStarts.push_back(0);
+    for (size_t i = 0; i < subject.length(); ++i)
+    {
+        if (subject[i] == '.') m_tokenStarts.push_back(i + 1);
+    }
+
+    // If the last token is a tail wildcard, it is not part of the path in the trie...
+    auto tokenCount = m_tokenStarts.size();
+    auto lastTokenStart = m_tokenStarts.back();
+    isTail = subject.length() - lastTokenStart == 1 && subject[lastTokenStart] == TAIL_WILDCARD;
+    return isTail ? tokenCount - 1 : tokenCount;
+}
+
+// Sets m_token to the token at the index specified (from the last split subject).
+void SubjectMatchingEngine::setToken(const std::string& subject, size_t tokenIndex)
+{
+    auto tokenStart = m_tokenStarts[tokenIndex];
+    auto tokenEnd = (tokenIndex + 1 < m_tokenStarts.size()) ? m_tokenStarts[tokenIndex + 1] - 1 : subject.length();
+    m_token.assign(subject, tokenStart, tokenEnd - tokenStart);
+}
+
+// Removes one subscription from the trie.
+void SubjectMatchingEngine::removeSubscriber(const std::string& subscriptionSubject, const Socket* pSocket, uint32_t subscriptionID)
+{
+    bool isTail;
+    auto pNode = findNode(subscriptionSubject, isTail);
+    if (!pNode)
+    {
+        return;
+    }
+    removeFromVector(isTail ? pNode->tailSubscribers : pNode->subscribers, pSocket, subscriptionID);
+
+    // We remove the node if it is no longer needed...
+    pruneNode(pNode);
+}
+
+// Removes the node, and any parents which become empty, from the trie.
+void SubjectMatchingEngine::pruneNode(Node* pNode)
+{
+    while (pNode != m_pRoot.get() && pNode->subscribers.empty() && pNode->tailSubscribers.empty() && pNode->children.empty())
+    {
+        // Note: Erasing the node from its parent deletes it, so we
+        //       get the parent and iterator first.
+        auto pParent = pNode->pParent;
+        if (pParent->pWildcardChild == pNode)
+        {
+            pParent->pWildcardChild = nullptr;
+        }
+        auto it = pParent->children.find(pNode->token);
+        pParent->children.erase(it);
+        pNode = pParent;
+    }
+}
+
+// Adds the subscribers for the tokens of the subject from tokenIndex onwards,
+// starting at the node specified, to the result.
+void SubjectMatchingEngine::match(const Node* pNode, const std::string& subject, size_t tokenIndex, VecSubscriber& result)
+{
+    // If we have matched all the tokens, the node's subscribers match the subject...
+    if (tokenIndex == m_tokenStarts.size())
+    {
+        result.insert(result.end(), pNode->subscribers.begin(), pNode->subscribers.end());
+        return;
+    }
+
+    // There is at least one token left, so the node's tail-wildcard subscribers match...
+    result.insert(result.end(), pNode->tailSubscribers.begin(), pNode->tailSubscribers.end());
+
+    // We match the child for the next token...
+    setToken(subject, tokenIndex);
+    auto it = pNode->children.find(m_token);
+    if (it != pNode->children.end() && it->second.get() != pNode->pWildcardChild)
+    {
+        match(it->second.get(), subject, tokenIndex + 1, result);
+    }
+
+    // We match the single-token wildcard child, which matches any token...
+    if (pNode->pWildcardChild)
+    {
+        match(pNode->pWildcardChild, subject, tokenIndex + 1, result);
+    }
+}
+
+// Adds the subscriber to the cached subjects which match the subscription subject.
+void SubjectMatchingEngine::addToCache(const std::string& subscriptionSubject, const Subscriber& subscriber)
+{
+    // A subscription with wildcards makes the cached matches out of date...
+    if (hasWildcards(subscriptionSubject))
+    {
+        ++m_generation;
+        return;
+    }
+
+    // The subscription has no wildcards so it can only match one subject. (If the match
+    // for the subject is out of date, this is harmless as it will be made again.)...
+    auto it = m_matchCache.find(subscriptionSubject);
+    if (it != m_matchCache.end())
+    {
+        it->second.subscribers.push_back(subscriber);
+    }
+}
+
+// Removes the subscriber from the cached subjects which match the subscription subject.
+void SubjectMatchingEngine::removeFromCache(const std::string& subscriptionSubject, const Socket* pSocket, uint32_t subscriptionID)
+{
+    // A subscription with wildcards makes the cached matches out of date...
+    if (hasWildcards(subscriptionSubject))
+    {
+        ++m_generation;
+        return;
+    }
+
+    // The subscription has no wildcards so it can only match one subject...
+    auto it = m_matchCache.find(subscriptionSubject);
+    if (it != m_matchCache.end())
+    {
+        removeFromVector(it->second.subscribers, pSocket, subscriptionID);
+    }
+}
+
+// Removes all subscribers for the socket from the cached matches.
+void SubjectMatchingEngine::removeSocketFromCache(const Socket* pSocket)
+{
+    auto isForSocket = [pSocket](const Subscriber& subscriber) { return subscriber.pSocket.get() == pSocket; };
+    for (auto& pair : m_matchCache)
+    {
+        auto& subscribers = pair.second.subscribers;
+        subscribers.erase(std::remove_if(subscribers.begin(), subscribers.end(), isForSocket), subscribers.end());
+    }
+    m_scratchMatch.clear();
+}
+
+// Removes one subscriber from a vector of subscribers.
+void SubjectMatchingEngine::removeFromVector(VecSubscriber& subscribers, const Socket* pSocket, uint32_t subscriptionID)
+{
+    // We find the subscriber and remove it by swapping it with the last one.
+    // (The order in which subscribers are held does not matter.)
+    for (size_t i = 0; i < subscribers.size(); ++i)
+    {
+        auto& subscriber = subscribers[i];
+        if (subscriber.pSocket.get() == pSocket && subscriber.subscriptionID == subscriptionID)
+        {
+            if (i != subscribers.size() - 1)
+            {
+                subscriber = std::move(subscribers.back());
+            }
+            subscribers.pop_back();
+            return;
+        }
+    }
+}
+
+// Returns true if the subscription subject includes wildcards.
+bool SubjectMatchingEngine::hasWildcards(const std::string& subscriptionSubject)
+{
+    size_t tokenStart = 0;
+    for (;;)
+    {
+        auto tokenEnd = subscriptionSubject.find('.', tokenStart);
+        auto isLastToken = tokenEnd == std::string::npos;
+        if (isLastToken) tokenEnd = subscriptionSubject.length();
+        if (tokenEnd - tokenStart == 1)
+        {
+            auto c = subscriptionSubject[tokenStart];
+            if (c == SINGLE_TOKEN_WILDCARD) return true;
+            if (c == TAIL_WILDCARD && isLastToken) return true;
+        }
+        if (isLastToken) return false;
+        tokenStart = tokenEnd + 1;
+    }
+}
+
@@ -0,0 +1,237 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <memory>
+#include <unordered_map>
+#include "SharedPointers.h"
+
+namespace MessagingMesh
+{
+    /// <summary>
+    /// Matches message subjects to the client subscriptions for a service.
+    ///
+    /// Subjects
+    /// --------
+    /// Subjects are made up of dot-separated tokens, for example "PRICES.VOD.L".
+    ///
+    /// Wildcards
+    /// ---------
+    /// Subscriptions can use two wildcard tokens:
+    /// - *  Matches any one token. For example, A.*.C matches A.B.C and A.X.C.
+    /// - >  Matches one or more tokens at the end of the subject. For example, A.>
+    ///      matches A.B and A.B.C but not A. It is only a wildcard if it is the last
+    ///      token of the subscription subject.
+    ///
+    /// Trie of subject tokens
+    /// ----------------------
+    /// Subscriptions are held in a trie keyed by the subject tokens. Each node in
+    /// the trie holds the subscriptions for the subject made from the path of tokens
+    /// leading to it. A * token is a child like any other, and the node for the tokens
+    /// before a > holds the tail-wildcard subscriptions.
+    ///
+    /// Finding the subscribers for a subject walks the child for each token of the
+    /// subject, plus the * child at each level, so it takes time proportional to the
+    /// number of tokens in the subject, not to the number of subscriptions.
+    ///
+    /// Cached matches
+    /// --------------
+    /// Publishers tend to send many updates to the same subjects, so we cache the
+    /// subscribers for each subject we have matched. This means that we only walk the
+    /// trie (and its wildcard branches) the first time we see a subject.
+    ///
+    /// A subscription without wildcards can only match one subject, so when it is added
+    /// or removed we update the cached subscribers for that subject directly.
+    ///
+    /// A wildcard subscription can match any number of cached subjects. Rather than check
+    /// each of them when it is added or removed, we increment a generation number. Each
+    /// cached match holds the generation it was made in, and a match from an earlier
+    /// generation is made again from the trie when its subject is next looked up. So a
+    /// subscription update (or a disconnect) takes time proportional to the number of
+    /// subscriptions changed, not to the size of the cache. The exception is when a socket
+    /// with wildcard subscriptions disconnects: out of date matches would hold on to the
+    /// socket until their subjects are next looked up, so we remove it from each of them.
+    ///
+    /// Subjects with no subscribers are cached too, as publishers often send to subjects
+    /// no-one is subscribed to. But once the cache is full we do not add them, so they do
+    /// not cause the cache to be cleared.
+    ///
+    /// Unsubscribing
+    /// -------------
+    /// UNSUBSCRIBE messages only hold the subscription ID, not the subject, so we also
+    /// hold the subject for each (socket, subscription ID). This lets us find the node
+    /// in the trie from which to remove the subscription.
+    ///
+    /// Threading
+    /// ---------
+    /// The engine is not thread-safe. It is owned by a ServiceShard and is only
+    /// accessed from the shard's UV loop thread.
+    /// </summary>
+    class SubjectMatchingEngine
+    {
+    // Public types...
+    public:
+        // A client subscription, ie the socket to send updates to and the ID
+        // the client uses to match updates to the subscription.
+        struct Subscriber
+        {
+            SocketPtr pSocket;
+            uint32_t subscriptionID;
+        };
+
+        // Vector of subscribers.
+        typedef std::vector<Subscriber> VecSubscriber;
+
+    // Public methods...
+    public:
+        // Constructor.
+        SubjectMatchingEngine();
+
+        // Destructor.
+        ~SubjectMatchingEngine();
+
+        // Adds a subscription to the subject for the socket and subscription ID.
+        // The subject can include wildcards.
+        void addSubscription(const std::string& subject, const SocketPtr& pSocket, uint32_t subscriptionID);
+
+        // Removes the subscription for the socket and subscription ID.
+        void removeSubscription(const Socket* pSocket, uint32_t subscriptionID);
+
+        // Removes all subscriptions for the socket.
+        void removeAllSubscriptions(const Socket* pSocket);
+
+        // Returns the subscribers for the subject.
+        // Note: The reference returned is only valid until the next call to the engine.
+        const VecSubscriber& getSubscribers(const std::string& subject);
+
+        // Returns the subscribers for the subject, which is not null-terminated. This is for
+        // subjects read in place from received data, and does not allocate a string for them.
+        // Note: The reference returned is only valid until the next call to the engine.
+        const VecSubscriber& getSubscribers(const char* pSubject, int32_t subjectLength);
+
+    // Private types...
+    private:
+        // A node in the trie.
+        struct Node
+        {
+            // The parent node (nullptr for the root)...
+            Node* pParent = nullptr;
+
+            // The token for this node in its parent's collection of children...
+            std::string token;
+
+            // Child nodes, keyed by token...
+            std::unordered_map<std::string, std::unique_ptr<Node>> children;
+
+            // The child for the * token (also held in children), or nullptr if there is none...
+            Node* pWildcardChild = nullptr;
+
+            // Subscriptions for the subject matching the path to this node...
+            VecSubscriber subscribers;
+
+            // Subscriptions for the path to this node followed by the > wildcard...
+            VecSubscriber tailSubscribers;
+        };
+
+        // Subjects for the subscriptions made by one socket, keyed by subscription ID.
+        typedef std::unordered_map<uint32_t, std::string> SubscriptionSubjects;
+
+        // The subscribers for a subject we have matched, and the generation of the match.
+        struct CachedMatch
+        {
+            VecSubscriber subscribers;
+            uint64_t generation = 0;
+        };
+
+        // Subscribers for subjects we have matched, keyed by subject.
+        typedef std::unordered_map<std::string, CachedMatch> MatchCache;
+
+    // Private functions...
+    private:
+        // Finds the node for a subscription subject, creating it (and its parents) if needed.
+        // Sets isTail to true if the subscription is for the node's tail-subscribers.
+        Node* getOrCreateNode(const std::string& subscriptionSubject, bool& isTail);
+
+        // Finds the node for a subscription subject, or nullptr if there is no node for it.
+        // Sets isTail to true if the subscription is for the node's tail-subscribers.
+        Node* findNode(const std::string& subscriptionSubject, bool& isTail);
+
+        // Finds the start of each token in the subject, and returns the number of tokens
+        // which make up the path to the subject's node in the trie.
+        size_t splitSubject(const std::string& subject, bool& isTail);
+
+        // Sets m_token to the token at the index specified (from the last split subject).
+        void setToken(const std::string& subject, size_t tokenIndex);
+
+        // Removes one subscription from the trie.
+        void removeSubscriber(const std::string& subscriptionSubject, const Socket* pSocket, uint32_t subscriptionID);
+
+        // Removes the node, and any parents which become empty, from the trie.
+        void pruneNode(Node* pNode);
+
+        // Adds the subscribers for the tokens of the subject from tokenIndex onwards,
+        // starting at the node specified, to the result.
+        void match(const Node* pNode, const std::string& subject, size_t tokenIndex, VecSubscriber& result);
+
+        // Adds the subscriber to the cached subjects which match the subscription subject.
+        void addToCache(const std::string& subscriptionSubject, const Subscriber& subscriber);
+
+        // Removes the subscriber from the cached subjects which match the subscription subject.
+        void removeFromCache(const std::string& subscriptionSubject, const Socket* pSocket, uint32_t subscriptionID);
+
+        // Removes all subscribers for the socket from the cached matches.
+        void removeSocketFromCache(const Socket* pSocket);
+
+        // Removes one subscriber from a vector of subscribers.
+        static void removeFromVector(VecSubscriber& subscribers, const Socket* pSocket, uint32_t subscriptionID);
+
+        // Returns true if the subscription subject includes wildcards.
+        static bool hasWildcards(const std::string& subscriptionSubject);
+
+    // Private data...
+    private:
+        // Root of the trie. Its tail-subscribers are the subscriptions to '>'.
+        std::unique_ptr<Node> m_pRoot;
+
+        // Subjects for subscriptions, keyed by socket...
+        std::unordered_map<const Socket*, SubscriptionSubjects> m_socketSubscriptions;
+
+        // Cached subscribers for subjects...
+        MatchCache m_matchCache;
+
+        // The generation of the cache. This is incremented when a wildcard subscription
+        // is added or removed, which makes all the cached matches out of date...
+        uint64_t m_generation = 0;
+
+        // Subject looked up by getSubscribers(pSubject, subjectLength). We reuse this so that
+        // looking up a subject read in place from received data does not allocate.
+        std::string m_lookupSubject;
+
+        // Token used when walking the trie. We reuse this to avoid allocating
+        // a string for each token of each subject looked up.
+        std::string m_token;
+
+        // Start positions of the tokens in the subject being matched. We reuse
+        // this to avoid allocating for each match.
+        std::vector<size_t> m_tokenStarts;
+
+        // Subscribers matched for a subject before it is added to the cache. We reuse
+        // this to avoid allocating for subjects we do not cache.
+        VecSubscriber m_scratchMatch;
+
+        // Returned when a subject has no subscribers...
+        const VecSubscriber m_noSubscribers;
+
+    // Constants...
+    private:
+        // The maximum number of subjects we cache. If we see more subjects (with
+        // subscribers) than this the cache is cleared and rebuilt from the subjects
+        // seen after that.
+        const size_t MAX_CACHED_SUBJECTS = 100000;
+
+        // Wildcard tokens...
+        static const char SINGLE_TOKEN_WILDCARD = '*';
+        static const char TAIL_WILDCARD = '>';
+    };
+} // namespace
+
@@ -29,6 +29,9 @@ namespace MessagingMesh
         // into it if the lifetime of this object is longer than that of the Connection.
         void resetConnection();
 
+        // Gets the callback for updates to the subscription.
+        const SubscriptionCallback& getCallback() const { return m_callback; }
+
     // Private functions...
     private:
         // Constructor.
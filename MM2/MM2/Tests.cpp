@@ -1,7 +1,20 @@
 #include "Tests.h"
+#include <cstring>
+#include <atomic>
+#include <thread>
+#include <chrono>
 #include "Message.h"
 #include "Field.h"
+#include "FieldKey.h"
+#include "FieldNameDictionary.h"
+#include "Exception.h"
 #include "Buffer.h"
+#include "NetworkMessageHeader.h"
+#include "NetworkMessage.h"
+#include "SubjectMatchingEngine.h"
+#include "Socket.h"
+#include "UVLoop.h"
+#include "ReceiveBufferPool.h"
 using namespace MessagingMesh;
 
 // Tests message serialization and deserialization.
@@ -41,4 +54,510 @@ void Tests::messageSerialization()
     assertEqual(pAddressResult->getField("HOUSE-NUMBER")->getSignedInt32(), houseNumber);
     assertEqual(pAddressResult->getField("STREET")->getString(), street);
     assertEqual(pAddressResult->getField("CITY")->getString(), city);
+
+    // A field count larger than the data could hold is not read...
+    auto pInvalidBuffer = Buffer::create();
+    pInvalidBuffer->write_int32(0x7fffffff);
+    pInvalidBuffer->resetPosition();
+    auto threw = false;
+    try
+    {
+        Message::create()->deserialize(*pInvalidBuffer);
+    }
+    catch (const Exception&)
+    {
+        threw = true;
+    }
+    assertEqual(threw, true);
+}
+
+// Tests lazy deserialization of messages.
+void Tests::messageLazyDeserialization()
+{
+    // We create a message with a sub-message, and serialize it...
+    auto pPerson = Message::create();
+    pPerson->addField("NAME", std::string("Charles"));
+    auto pAddress = Message::create();
+    pAddress->addField("HOUSE-NUMBER", 3);
+    pAddress->addField("CITY", std::string("Bristol"));
+    pPerson->addField("ADDRESS", pAddress);
+    pPerson->addField("AGE", 47.5);
+    auto pBuffer = Buffer::create();
+    pPerson->serialize(*pBuffer);
+
+    // We deserialize it lazily and read the fields...
+    pBuffer->resetPosition();
+    auto pResult = Message::create();
+    pResult->deserializeLazily(pBuffer);
+    assertEqual(pResult->getField("AGE")->getDouble(), 47.5);
+    assertEqual(pResult->getField("ADDRESS")->getMessage()->getField("CITY")->getString(), std::string("Bristol"));
+
+    // We add a field, which copies the lazy fields, and check that
+    // the message serializes with all its fields...
+    pResult->addField("STREET", std::string("London Road"));
+    auto pBuffer2 = Buffer::create();
+    pResult->serialize(*pBuffer2);
+    pBuffer2->resetPosition();
+    auto pResult2 = Message::create();
+    pResult2->deserialize(*pBuffer2);
+    assertEqual(pResult2->getField("NAME")->getString(), std::string("Charles"));
+    assertEqual(pResult2->getField("ADDRESS")->getMessage()->getField("HOUSE-NUMBER")->getSignedInt32(), 3);
+    assertEqual(pResult2->getField("STREET")->getString(), std::string("London Road"));
+}
+
+// Tests serialization of int64, bool, byte array and typed array fields.
+void Tests::messageTypedFields()
+{
+    int64_t timestamp = 1700000000123456789LL;
+    uint64_t orderID = 18000000000000000000ULL;
+    std::vector<uint8_t> bytes = { 0, 1, 2, 255 };
+    std::vector<double> prices = { 101.25, 101.5, 101.75 };
+    std::vector<int32_t> sizes = { 100, 200, -300 };
+    std::vector<int64_t> ids = { -1, 0, 1LL << 40 };
+
+    // We create a message with one field of each type...
+    auto pMessage = Message::create();
+    pMessage->addField("TIMESTAMP", timestamp);
+    pMessage->addField("ORDER-ID", orderID);
+    pMessage->addField("ACTIVE", true);
+    pMessage->addField("SYMBOL", "VOD.L");
+    pMessage->addField("BYTES", bytes);
+    pMessage->addField("PRICES", prices);
+    pMessage->addField("SIZES", sizes);
+    pMessage->addField("IDS", ids);
+
+    // We serialize the message, and deserialize it both eagerly and lazily...
+    auto pBuffer = Buffer::create();
+    pMessage->serialize(*pBuffer);
+    pBuffer->resetPosition();
+    auto pResult = Message::create();
+    pResult->deserialize(*pBuffer);
+    pBuffer->resetPosition();
+    auto pLazyResult = Message::create();
+    pLazyResult->deserializeLazily(pBuffer);
+
+    for (auto& pCheck : { pResult, pLazyResult })
+    {
+        assertEqual(pCheck->getField("TIMESTAMP")->getSignedInt64(), timestamp);
+        assertEqual(pCheck->getField("ORDER-ID")->getUnsignedInt64(), orderID);
+        assertEqual(pCheck->getField("ACTIVE")->getBool(), true);
+        assertEqual(pCheck->getField("SYMBOL")->getString(), std::string("VOD.L"));
+        assertEqual(pCheck->getField("BYTES")->getBytes() == bytes, true);
+        assertEqual(pCheck->getField("PRICES")->getDoubleArray() == prices, true);
+        assertEqual(pCheck->getField("SIZES")->getSignedInt32Array() == sizes, true);
+        assertEqual(pCheck->getField("IDS")->getSignedInt64Array() == ids, true);
+    }
+}
+
+// Tests serialization with the compact message encoding.
+void Tests::messageCompactEncoding()
+{
+    std::string longString(100, 'x');
+    std::vector<double> prices = { 101.25, 101.5 };
+
+    // We create a message with a sub-message...
+    auto pAddress = Message::create();
+    pAddress->addField("HOUSE-NUMBER", 3);
+    pAddress->addField("CITY", "Bristol");
+    auto pMessage = Message::create();
+    pMessage->addField("SMALL", 5);
+    pMessage->addField("NEGATIVE", int64_t(-123456789));
+    pMessage->addField("ORDER-ID", uint64_t(42));
+    pMessage->addField("ACTIVE", true);
+    pMessage->addField("SHORT", "VOD.L");
+    pMessage->addField("LONG", longString);
+    pMessage->addField("PRICES", prices);
+    pMessage->addField("ADDRESS", pAddress);
+
+    // The compact encoding is smaller than the standard one...
+    auto pStandardBuffer = Buffer::create();
+    pMessage->serialize(*pStandardBuffer);
+    auto pCompactBuffer = Buffer::create();
+    pMessage->serialize(*pCompactBuffer, MessageEncoding::COMPACT);
+    assertEqual(pCompactBuffer->getBufferSize() < pStandardBuffer->getBufferSize(), true);
+
+    // We deserialize the compact message eagerly and lazily. We also re-encode the lazy
+    // message with the standard encoding, as the gateway does for some subscribers...
+    pCompactBuffer->resetPosition();
+    auto pResult = Message::create();
+    pResult->deserialize(*pCompactBuffer, MessageEncoding::COMPACT);
+    pCompactBuffer->resetPosition();
+    auto pLazyResult = Message::create();
+    pLazyResult->deserializeLazily(pCompactBuffer, MessageEncoding::COMPACT);
+    auto pReencodedBuffer = Buffer::create();
+    pLazyResult->serialize(*pReencodedBuffer);
+    pReencodedBuffer->resetPosition();
+    auto pReencodedResult = Message::create();
+    pReencodedResult->deserialize(*pReencodedBuffer);
+
+    for (auto& pCheck : { pResult, pLazyResult, pReencodedResult })
+    {
+        assertEqual(pCheck->getField("SMALL")->getSignedInt32(), 5);
+        assertEqual(pCheck->getField("NEGATIVE")->getSignedInt64(), int64_t(-123456789));
+        assertEqual(pCheck->getField("ORDER-ID")->getUnsignedInt64(), uint64_t(42));
+        assertEqual(pCheck->getField("ACTIVE")->getBool(), true);
+        assertEqual(pCheck->getField("SHORT")->getString(), std::string("VOD.L"));
+        assertEqual(pCheck->getField("LONG")->getString(), longString);
+        assertEqual(pCheck->getField("PRICES")->getDoubleArray() == prices, true);
+        assertEqual(pCheck->getField("ADDRESS")->getMessage()->getField("CITY")->getString(), std::string("Bristol"));
+    }
+}
+
+// Tests serialization with a field-name dictionary.
+void Tests::messageFieldNameDictionary()
+{
+    for (auto encoding : { MessageEncoding::STANDARD, MessageEncoding::COMPACT })
+    {
+        // The writer and reader each have their own dictionary, as they would at each
+        // end of a connection. We write the same message twice, and a third message
+        // with a new field...
+        FieldNameDictionary writerNames;
+        FieldNameDictionary readerNames;
+        auto pAddress = Message::create();
+        pAddress->addField("CITY", "Bristol");
+        auto pMessage = Message::create();
+        pMessage->addField("INSTRUMENT-ID", "VOD.L");
+        pMessage->addField("BID-PRICE", 101.25);
+        pMessage->addField("ADDRESS", pAddress);
+
+        auto pFirstBuffer = Buffer::create();
+        pMessage->serialize(*pFirstBuffer, encoding, &writerNames);
+        auto pSecondBuffer = Buffer::create();
+        pMessage->serialize(*pSecondBuffer, encoding, &writerNames);
+        pMessage->addField("ASK-PRICE", 101.5);
+        auto pThirdBuffer = Buffer::create();
+        pMessage->serialize(*pThirdBuffer, encoding, &writerNames);
+
+        // The names are only written in full the first time...
+        assertEqual(writerNames.getCount(), 5);
+        assertEqual(pSecondBuffer->getBufferSize() < pFirstBuffer->getBufferSize(), true);
+
+        // The messages are read in order, with the names found in the reader's dictionary...
+        for (auto& pBuffer : { pFirstBuffer, pSecondBuffer, pThirdBuffer })
+        {
+            pBuffer->resetPosition();
+            auto pResult = Message::create();
+            pResult->deserialize(*pBuffer, encoding, &readerNames);
+            assertEqual(pResult->getField("INSTRUMENT-ID")->getString(), std::string("VOD.L"));
+            assertEqual(pResult->getField("BID-PRICE")->getDouble(), 101.25);
+            assertEqual(pResult->getField("ADDRESS")->getMessage()->getField("CITY")->getString(), std::string("Bristol"));
+        }
+        assertEqual(readerNames.getCount(), 5);
+        assertEqual(readerNames.getName(4), std::string("ASK-PRICE"));
+    }
+
+    // Names with IDs the dictionary does not hold are not read...
+    auto pMessage = Message::create();
+    pMessage->addField("A", 1);
+    FieldNameDictionary writerNames;
+    writerNames.add("A", 1, FieldKey::hash("A", 1));
+    auto pBuffer = Buffer::create();
+    pMessage->serialize(*pBuffer, MessageEncoding::STANDARD, &writerNames);
+    pBuffer->resetPosition();
+    FieldNameDictionary readerNames;
+    auto threw = false;
+    try
+    {
+        Message::create()->deserialize(*pBuffer, MessageEncoding::STANDARD, &readerNames);
+    }
+    catch (const Exception&)
+    {
+        threw = true;
+    }
+    assertEqual(threw, true);
+}
+
+// Tests finding fields by name and by key.
+void Tests::messageFieldLookup()
+{
+    // We create a message with enough fields to be searched using the field
+    // index, including two fields with the same name...
+    auto pMessage = Message::create();
+    for (int32_t i = 0; i < 20; ++i)
+    {
+        pMessage->addField("F" + std::to_string(i), i);
+    }
+    pMessage->addField("F5", 100);
+
+    // The first field with a name is found...
+    assertEqual(pMessage->getField("F5")->getSignedInt32(), 5);
+    assertEqual(pMessage->getField("F19")->getSignedInt32(), 19);
+
+    // Fields can be found by key, including fields added after the index was built...
+    pMessage->addField("LATE", 21);
+    FieldKey late("LATE");
+    assertEqual(pMessage->getField(late)->getSignedInt32(), 21);
+
+    // A field returned by getField() stays valid as more fields are added and asked for...
+    auto& pFirst = pMessage->getField("F0");
+    for (int32_t i = 0; i < 1000; ++i)
+    {
+        pMessage->addField("MORE" + std::to_string(i), i);
+        pMessage->getField("MORE" + std::to_string(i));
+    }
+    assertEqual(pFirst->getSignedInt32(), 0);
+
+    // Fields not in the message are not found...
+    auto found = true;
+    try
+    {
+        pMessage->getField("MISSING");
+    }
+    catch (const Exception&)
+    {
+        found = false;
+    }
+    assertEqual(found, false);
+}
+
+// Tests finding the network messages in received data.
+void Tests::networkMessageScanning()
+{
+    // We create received data holding three complete messages of different sizes, and
+    // the start of a fourth. The data starts one byte in, so the sizes are not aligned...
+    std::vector<char> data(1, 0);
+    std::vector<int32_t> offsets;
+    for (int32_t i = 0; i < 4; ++i)
+    {
+        auto pBuffer = Buffer::create();
+        pBuffer->write_string(std::string(i * 10, 'x'));
+        auto pData = pBuffer->getBuffer();
+        offsets.push_back(static_cast<int32_t>(data.size()));
+        data.insert(data.end(), pData, pData + pBuffer->getBufferSize());
+    }
+    data.resize(data.size() - 3);
+
+    // We find the three complete messages, and the position of the fourth...
+    std::vector<Buffer::NetworkMessageFrame> frames;
+    auto position = Buffer::scanNetworkMessages(data.data(), data.size(), 1, frames);
+    assertEqual(frames.size(), size_t(3));
+    assertEqual(position, static_cast<size_t>(offsets[3]));
+    for (size_t i = 0; i < frames.size(); ++i)
+    {
+        assertEqual(frames[i].offset, offsets[i]);
+        assertEqual(frames[i].size, offsets[i + 1] - offsets[i]);
+    }
+
+    // Data with only part of the first size holds no complete messages...
+    frames.clear();
+    position = Buffer::scanNetworkMessages(data.data(), 3, 1, frames);
+    assertEqual(frames.size(), size_t(0));
+    assertEqual(position, size_t(1));
+
+    // A message copied from data received in two parts, split within its size, holds
+    // the same data including the size, so it can be forwarded without writing to it...
+    auto pCopy = Buffer::create();
+    auto splitPosition = static_cast<size_t>(offsets[2] + 2);
+    auto bytesRead = pCopy->readNetworkMessage(data.data(), splitPosition, offsets[2]);
+    pCopy->readNetworkMessage(data.data(), data.size(), offsets[2] + bytesRead);
+    assertEqual(pCopy->hasAllData(), true);
+    assertEqual(pCopy->getBufferSize(), offsets[3] - offsets[2]);
+    assertEqual(std::memcmp(pCopy->getData(), data.data() + offsets[2], pCopy->getBufferSize()), 0);
+}
+
+// Tests serializing network-message headers, and reading them without deserializing.
+void Tests::networkMessageHeader()
+{
+    // We serialize a header...
+    NetworkMessageHeader header;
+    header.setAction(NetworkMessageHeader::Action::SEND_MESSAGE);
+    header.setSubscriptionID(42);
+    header.setSubject("PRICES.VOD.L");
+    header.setReplySubject("REPLY.1");
+    header.setMessageEncoding(MessageEncoding::COMPACT);
+    header.setUsesFieldNameDictionary(true);
+    auto pBuffer = Buffer::create();
+    header.serialize(*pBuffer);
+    auto pData = pBuffer->getBuffer();
+    auto dataSize = pBuffer->getBufferSize();
+
+    // We read the action, subject and subscription ID from the data...
+    NetworkMessageHeader::Action action;
+    assertEqual(NetworkMessageHeader::peekAction(pData, dataSize, action), true);
+    assertEqual(action == NetworkMessageHeader::Action::SEND_MESSAGE, true);
+    const char* pSubject;
+    int32_t subjectLength;
+    assertEqual(NetworkMessageHeader::peekMessageSubject(pData, dataSize, pSubject, subjectLength), true);
+    assertEqual(std::string(pSubject, subjectLength), std::string("PRICES.VOD.L"));
+    uint32_t subscriptionID;
+    std::memcpy(&subscriptionID, pData + NetworkMessageHeader::SUBSCRIPTION_ID_OFFSET, sizeof(subscriptionID));
+    assertEqual(subscriptionID, uint32_t(42));
+
+    // We deserialize the header...
+    pBuffer->resetPosition();
+    NetworkMessageHeader result;
+    result.deserialize(*pBuffer);
+    assertEqual(result.getAction() == NetworkMessageHeader::Action::SEND_MESSAGE, true);
+    assertEqual(result.getSubscriptionID(), uint32_t(42));
+    assertEqual(result.getSubject(), std::string("PRICES.VOD.L"));
+    assertEqual(result.getReplySubject(), std::string("REPLY.1"));
+    assertEqual(result.getMessageEncoding() == MessageEncoding::COMPACT, true);
+    assertEqual(result.usesFieldNameDictionary(), true);
+
+    // Data shorter than the fixed-size prefix has no action...
+    assertEqual(NetworkMessageHeader::peekAction(pData, NetworkMessageHeader::SUBJECTS_OFFSET - 1, action), false);
+}
+
+// Tests that copying a view releases the receive buffer it refers to. The slow-consumer
+// policy relies on this to bound the memory held for a socket above its high-water mark.
+void Tests::bufferViewDetaching()
+{
+    // We read a message into a receive buffer, and create a view of it...
+    ReceiveBufferPool pool;
+    uv_buf_t receiveBuffer;
+    pool.allocate(&receiveBuffer);
+    auto pMessage = Buffer::create();
+    pMessage->write_string("hello");
+    auto messageSize = pMessage->getBufferSize();
+    std::memcpy(receiveBuffer.base, pMessage->getBuffer(), messageSize);
+    auto pView = Buffer::createView(receiveBuffer.base, receiveBuffer.base, messageSize);
+    ReceiveBufferPool::release(receiveBuffer.base);
+
+    // We detach a copy of the view, as a socket does for a message it holds...
+    auto pHeld = pView;
+    Buffer::detachView(pHeld);
+    assertEqual(pView->isView(), true);
+    assertEqual(pHeld->isView(), false);
+    assertEqual(pHeld->getBufferSize(), messageSize);
+    assertEqual(std::memcmp(pHeld->getData(), pView->getData(), messageSize), 0);
+    assertEqual(pHeld->read_string(), std::string("hello"));
+
+    // When the view is released, the receive buffer goes back to the pool while
+    // the copy is still held, so it is used for the next read...
+    pView.reset();
+    uv_buf_t nextReceiveBuffer;
+    pool.allocate(&nextReceiveBuffer);
+    assertEqual(nextReceiveBuffer.base == receiveBuffer.base, true);
+    ReceiveBufferPool::release(nextReceiveBuffer.base);
+}
+
+// Tests that a socket using the CONFLATE slow-consumer policy sends messages for distinct
+// subjects which are above its high-water mark on their own, rather than holding them.
+void Tests::slowConsumerConflation()
+{
+    // Callbacks for the sockets. The server side sets the policy on the socket it accepts,
+    // and the client side counts the messages it receives...
+    class TestCallback : public Socket::ICallback
+    {
+    public:
+        void onNewConnection(SocketPtr pClientSocket)
+        {
+            Socket::SlowConsumerPolicy policy;
+            policy.highWaterMarkBytes = 10000;
+            policy.action = Socket::SlowConsumerAction::CONFLATE;
+            pClientSocket->setSlowConsumerPolicy(policy);
+            pClientSocket->setCallback(this);
+            pAcceptedSocket = pClientSocket;
+            accepted = true;
+        }
+        void onDataReceived(Socket* /*pSocket*/, BufferPtr /*pBuffer*/) { ++receivedCount; }
+        void onDisconnected(Socket* /*pSocket*/) {}
+        void onMoveToLoopComplete(Socket* /*pSocket*/) {}
+
+        SocketPtr pAcceptedSocket;
+        std::atomic<bool> accepted{ false };
+        std::atomic<int> receivedCount{ 0 };
+    };
+    TestCallback serverCallback;
+    TestCallback clientCallback;
+
+    // We connect a client socket to a listening socket...
+    const int port = 5061;
+    auto pUVLoop = UVLoop::create("TESTS");
+    auto pListeningSocket = Socket::create(pUVLoop);
+    auto pClientSocket = Socket::create(pUVLoop);
+    pListeningSocket->setCallback(&serverCallback);
+    pClientSocket->setCallback(&clientCallback);
+    pUVLoop->marshallEvent([&](uv_loop_t* /*pLoop*/) { pListeningSocket->listen(port); });
+    pUVLoop->marshallEvent([&](uv_loop_t* /*pLoop*/) { pClientSocket->connect("127.0.0.1", port); });
+    for (int i = 0; i < 500 && !serverCallback.accepted; ++i)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    assertEqual(serverCallback.accepted.load(), true);
+
+    // We write a batch of messages for distinct subjects, each about a tenth of the mark,
+    // so conflation removes none of them and they are above the mark on their own...
+    const int messageCount = 100;
+    Socket::VecQueuedWrite batch;
+    for (int i = 0; i < messageCount; ++i)
+    {
+        NetworkMessage networkMessage;
+        auto& header = networkMessage.getHeader();
+        header.setAction(NetworkMessageHeader::Action::SEND_MESSAGE);
+        header.setSubject("S." + std::to_string(i));
+        auto pMessage = Message::create();
+        pMessage->addField("DATA", std::string(1000, 'x'));
+        networkMessage.setMessage(pMessage);
+        auto pBuffer = Buffer::create();
+        networkMessage.serialize(*pBuffer);
+        batch.push_back(Socket::createQueuedWrite(pBuffer, 0, nullptr, 0));
+    }
+    serverCallback.pAcceptedSocket->write(std::move(batch));
+
+    // The messages are sent rather than held, as libuv had nothing to write...
+    for (int i = 0; i < 500 && clientCallback.receivedCount < messageCount; ++i)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    assertEqual(clientCallback.receivedCount.load(), messageCount);
+    assertEqual(serverCallback.pAcceptedSocket->getDroppedMessageCount(), uint64_t(0));
+
+    // We close the sockets before the loop...
+    serverCallback.pAcceptedSocket.reset();
+    pClientSocket.reset();
+    pListeningSocket.reset();
+}
+
+// Tests matching subjects to subscriptions.
+void Tests::subjectMatching()
+{
+    auto pUVLoop = UVLoop::create("TESTS");
+    auto pSocket1 = Socket::create(pUVLoop);
+    auto pSocket2 = Socket::create(pUVLoop);
+
+    // We make subscriptions...
+    SubjectMatchingEngine engine;
+    engine.addSubscription("A.B", pSocket1, 1);
+    engine.addSubscription("A.B", pSocket2, 1);
+    engine.addSubscription("A.B.C", pSocket1, 2);
+    engine.addSubscription("A", pSocket2, 2);
+
+    assertEqual(engine.getSubscribers("A.B").size(), size_t(2));
+    assertEqual(engine.getSubscribers("A.B.C").size(), size_t(1));
+    assertEqual(engine.getSubscribers("A").size(), size_t(1));
+    assertEqual(engine.getSubscribers("A.C").size(), size_t(0));
+    assertEqual(engine.getSubscribers("B").size(), size_t(0));
+
+    // We unsubscribe...
+    engine.removeSubscription(pSocket1.get(), 1);
+    assertEqual(engine.getSubscribers("A.B").size(), size_t(1));
+    assertEqual(engine.getSubscribers("A.B")[0].pSocket, pSocket2);
+
+    // We remove all subscriptions for a socket...
+    engine.removeAllSubscriptions(pSocket2.get());
+    assertEqual(engine.getSubscribers("A.B").size(), size_t(0));
+    assertEqual(engine.getSubscribers("A").size(), size_t(0));
+    assertEqual(engine.getSubscribers("A.B.C").size(), size_t(1));
+
+    // We subscribe with wildcards. A.B.C is already cached, so this also
+    // checks that the cached result is updated...
+    engine.addSubscription("A.*.C", pSocket2, 3);
+    engine.addSubscription("A.>", pSocket2, 4);
+    assertEqual(engine.getSubscribers("A.B.C").size(), size_t(3));
+    assertEqual(engine.getSubscribers("A.X.C").size(), size_t(2));
+    assertEqual(engine.getSubscribers("A.X").size(), size_t(1));
+    assertEqual(engine.getSubscribers("A").size(), size_t(0));
+
+    // We unsubscribe from a wildcard subscription...
+    engine.removeSubscription(pSocket2.get(), 3);
+    assertEqual(engine.getSubscribers("A.B.C").size(), size_t(2));
+    assertEqual(engine.getSubscribers("A.X.C").size(), size_t(1));
+
+    // We remove all subscriptions for a socket with wildcard subscriptions. The
+    // cached matches no longer hold the socket, even before they are looked up...
+    engine.removeAllSubscriptions(pSocket2.get());
+    assertEqual(pSocket2.use_count(), long(1));
+    assertEqual(engine.getSubscribers("A.X.C").size(), size_t(0));
+    assertEqual(engine.getSubscribers("A.B.C").size(), size_t(1));
 }
@@ -10,6 +10,36 @@ namespace MessagingMesh
         // Tests message serialization and deserialization.
         static void messageSerialization();
 
+        // Tests lazy deserialization of messages.
+        static void messageLazyDeserialization();
+
+        // Tests serialization of int64, bool, byte array and typed array fields.
+        static void messageTypedFields();
+
+        // Tests serialization with the compact message encoding.
+        static void messageCompactEncoding();
+
+        // Tests serialization with a field-name dictionary.
+        static void messageFieldNameDictionary();
+
+        // Tests finding fields by name and by key.
+        static void messageFieldLookup();
+
+        // Tests finding the network messages in received data.
+        static void networkMessageScanning();
+
+        // Tests serializing network-message headers, and reading them without deserializing.
+        static void networkMessageHeader();
+
+        // Tests that copying a view releases the receive buffer it refers to.
+        static void bufferViewDetaching();
+
+        // Tests the CONFLATE slow-consumer policy with messages above the high-water mark.
+        static void slowConsumerConflation();
+
+        // Tests matching subjects to subscriptions.
+        static void subjectMatching();
+
     // Private functions...
     private:
 
@@ -1,6 +1,5 @@
 #pragma once
 #include <vector>
-#include <set>
 #include <memory>
 #include <mutex>
 
@@ -13,7 +12,7 @@ namespace MessagingMesh
     /// When you retrieve data you are given a copy of all the data currently 
     /// available, and the internal data is cleared.
     /// </summary>
-    template<typename ItemType, typename UniqueKeyType = int>
+    template<typename ItemType>
     class ThreadsafeConsumableVector
     {
     // Public types...
@@ -40,32 +39,12 @@ namespace MessagingMesh
             m_items->push_back(item);
         }
 
-        // Adds an item to the vector if the key has not already been registered.
-        // Returns true if the item was added, false if not.
-        bool addUnique(const UniqueKeyType& key, ItemType& item)
-        {
-            std::lock_guard<std::mutex> lock(m_mutex);
-            if (m_uniqueKeys.count(key))
-            {
-                // The name has already been registered...
-                return false;
-            }
-            else
-            {
-                // The name has not been registered, so we add the item...
-                m_items->push_back(item);
-                m_uniqueKeys.insert(key);
-                return true;
-            }
-        }
-
         // Gets the current contents of the vector, and clears the data being held.
         VecItemTypePtr getItems()
         {
             std::lock_guard<std::mutex> lock(m_mutex);
             auto result = m_items;
             m_items = std::make_shared<VecItemType>();
-            m_uniqueKeys.clear();
             return result;
         }
 
@@ -74,10 +53,6 @@ namespace MessagingMesh
         // Vector of items.
         VecItemTypePtr m_items;
 
-        // Set of keys for registered unique items.
-        typedef std::set<UniqueKeyType> UniqueKeySet;
-        UniqueKeySet m_uniqueKeys;
-
         // Mutex.
         std::mutex m_mutex;
     };
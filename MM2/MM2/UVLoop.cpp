@@ -79,8 +79,8 @@ void UVLoop::threadEntryPoint()
 // will be called from within the event loop.
 void UVLoop::marshallEvent(MarshalledEvent marshalledEvent)
 {
-    // We add the event to the collection of marshalled events.
-    m_marshalledEvents.add(marshalledEvent);
+    // We add the event to the queue of marshalled events.
+    m_marshalledEvents.push(std::move(marshalledEvent));
 
     // We signal to the event loop that there is a new event.
     // Note: We check that the loop and signal have been set up. If not, we
@@ -91,37 +91,33 @@ void UVLoop::marshallEvent(MarshalledEvent marshalledEvent)
     }
 }
 
-// Marshalls an event to the UV loop we are managing. 
-// Only one event for the given key will be marshalled until events
-// are processed in the UV loop thread.
-void UVLoop::marshallUniqueEvent(const UniqueEventKey& key, MarshalledEvent marshalledEvent)
-{
-    // We add the event to the collection of marshalled events.
-    auto itemAdded = m_marshalledEvents.addUnique(key, marshalledEvent);
-
-    // We signal to the event loop that there is a new event.
-    // Note: We check that the loop and signal have been set up. If not, we
-    //       cannot signal, but the event has still been added to the queue.
-    if (itemAdded && m_marshalledEventsSignal)
-    {
-        uv_async_send(m_marshalledEventsSignal.get());
-    }
-}
-
 // Processes marshalled events.
 void UVLoop::processMarshalledEvents()
 {
     try
     {
-        // We get the marshalled events and process them...
-        auto marshalledEvents = m_marshalledEvents.getItems();
-        for (auto marshalledEvent : *marshalledEvents)
+        // We process the marshalled events, up to the maximum for one wakeup...
+        MarshalledEvent marshalledEvent;
+        int eventCount = 0;
+        while (eventCount < MAX_EVENTS_PER_WAKEUP && m_marshalledEvents.pop(marshalledEvent))
         {
             marshalledEvent(m_loop.get());
+            ++eventCount;
+        }
+
+        // If we stopped at the maximum there may be more events queued, so we signal
+        // to process them on the next iteration of the loop, after socket I/O...
+        if (eventCount == MAX_EVENTS_PER_WAKEUP)
+        {
+            uv_async_send(m_marshalledEventsSignal.get());
         }
     }
     catch (const std::exception& ex)
     {
         Logger::error(Utils::format("%s: %s", __func__, ex.what()));
+
+        // Events after the one which failed are still queued, so we signal
+        // to make sure that they are processed...
+        uv_async_send(m_marshalledEventsSignal.get());
     }
 }
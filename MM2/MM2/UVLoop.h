@@ -3,7 +3,8 @@
 #include <functional>
 #include "uv.h"
 #include "SharedPointers.h"
-#include "ThreadsafeConsumableVector.h"
+#include "MPSCQueue.h"
+#include "ReceiveBufferPool.h"
 
 namespace MessagingMesh
 {
@@ -12,6 +13,13 @@ namespace MessagingMesh
     /// 
     /// You can marshall events to the loop which will be picked up
     /// and run on the loop's thread.
+    /// 
+    /// Marshalled events are held in a lock-free MPSCQueue, so threads
+    /// marshalling events to the same loop do not contend on a lock.
+    /// 
+    /// We process at most MAX_EVENTS_PER_WAKEUP events each time the loop is
+    /// signalled, and signal it again if there are more. So a stream of marshalled
+    /// events cannot stop the loop from reading and writing its sockets.
     /// </summary>
     class UVLoop
     {
@@ -20,13 +28,6 @@ namespace MessagingMesh
         // An 'event' which can be marshalled to the event loop we are managing.
         typedef std::function<void(uv_loop_t*)> MarshalledEvent;
 
-        // Enum for unique marshalled events. (Events where we only marshall
-        // one at any one time for a given key.)
-        enum class UniqueEventKey
-        {
-            SOCKET_QUEUE_WRITE
-        };
-
     // Public methods...
     public:
         // Creates a Socket instance to be managed by the uv loop specified.
@@ -41,14 +42,17 @@ namespace MessagingMesh
         // Gets the UV loop.
         uv_loop_t* getUVLoop() const { return m_loop.get();  }
 
+        // Gets the pool of buffers for reading from sockets managed by the loop.
+        ReceiveBufferPool& getReceiveBufferPool() { return m_receiveBufferPool; }
+
         // Marshalls an event to the UV loop we are managing. This event (function)
         // will be called from within the event loop.
         void marshallEvent(MarshalledEvent marshalledEvent);
 
-        // Marshalls an event to the UV loop we are managing. 
-        // Only one event for the given key will be marshalled until events
-        // are processed in the UV loop thread.
-        void marshallUniqueEvent(const UniqueEventKey& key, MarshalledEvent marshalledEvent);
+    // Private constants...
+    private:
+        // The maximum number of marshalled events processed each time the loop is signalled.
+        static const int MAX_EVENTS_PER_WAKEUP = 1024;
 
     // Private functions...
     private:
@@ -76,8 +80,11 @@ namespace MessagingMesh
         // Signal sent to the event loop when there are new marshalled events.
         std::unique_ptr<uv_async_t> m_marshalledEventsSignal;
 
-        // Vector of marshalled events and a lock for it.
-        ThreadsafeConsumableVector<MarshalledEvent, UniqueEventKey> m_marshalledEvents;
+        // Queue of marshalled events.
+        MPSCQueue<MarshalledEvent> m_marshalledEvents;
+
+        // Pool of buffers for reading from sockets.
+        ReceiveBufferPool m_receiveBufferPool;
     };
 } // namespace
 
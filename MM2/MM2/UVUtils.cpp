@@ -3,6 +3,13 @@
 #include "Logger.h"
 #include "Exception.h"
 #include "OSSocketHolder.h"
+#include "UVLoop.h"
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#endif
 using namespace MessagingMesh;
 
 // Gets peer IP info for a tcp handle.
@@ -40,48 +47,49 @@ UVUtils::IPInfo UVUtils::getPeerIPInfo(uv_tcp_t* pTCPHandle)
     return ipInfo;
 }
 
-// Allocates buffer memory for a UV read from a socket.
-void UVUtils::allocateBufferMemory(uv_handle_t* /*handle*/, size_t suggested_size, uv_buf_t* pBuffer)
+// Allocates a buffer for a UV read from a socket.
+// The buffer comes from the receive-buffer pool of the UVLoop which owns the handle.
+void UVUtils::allocateBufferMemory(uv_handle_t* pHandle, size_t /*suggested_size*/, uv_buf_t* pBuffer)
 {
-    pBuffer->base = new char[suggested_size];
-    pBuffer->len = (ULONG)suggested_size;
+    auto pLoop = (UVLoop*)pHandle->loop->data;
+    pLoop->getReceiveBufferPool().allocate(pBuffer);
 }
 
-// Releases memory for a buffer.
+// Releases a buffer, returning it to the pool it came from.
 void UVUtils::releaseBufferMemory(const uv_buf_t* pBuffer)
 {
-    delete[] pBuffer->base;
-}
-
-// Allocates a write request.
-UVUtils::WriteRequest* UVUtils::allocateWriteRequest(BufferPtr pBuffer)
-{
-    return new WriteRequest(pBuffer);
-}
-
-// Allocates a write request.
-UVUtils::WriteRequest* UVUtils::allocateWriteRequest(size_t bufferSize)
-{
-    return new WriteRequest(bufferSize);
-}
-
-// Releases a write request.
-void UVUtils::releaseWriteRequest(WriteRequest* pWriteRequest)
-{
-    delete pWriteRequest;
+    ReceiveBufferPool::release(pBuffer->base);
 }
 
 // Duplicates the socket.
 // Note: This has different implementations depending on the OS.
 OSSocketHolderPtr UVUtils::duplicateSocket(const uv_os_sock_t& socket)
 {
-#ifdef WIN32
     auto pSocketHolder = OSSocketHolder::create();
+#ifdef _WIN32
     pSocketHolder->setSocket(duplicateSocket_Windows(socket));
+#else
+    pSocketHolder->setSocket(duplicateSocket_Linux(socket));
+#endif
     return pSocketHolder;
+}
+
+// Closes an OS socket which is not (or is no longer) owned by a UV handle,
+// such as a duplicated socket which could not be opened by a UV handle.
+void UVUtils::closeSocket(const uv_os_sock_t& socket)
+{
+#ifdef _WIN32
+    auto status = closesocket(socket);
+#else
+    auto status = close(socket);
 #endif
+    if (status != 0)
+    {
+        Logger::error(Utils::format("closeSocket: failed to close socket %d", (int)socket));
+    }
 }
 
+#ifdef _WIN32
 // Duplicates the socket when compiling for Windows.
 uv_os_sock_t UVUtils::duplicateSocket_Windows(const uv_os_sock_t& socket)
 {
@@ -111,6 +119,38 @@ uv_os_sock_t UVUtils::duplicateSocket_Windows(const uv_os_sock_t& socket)
     // We return the duplicated socket...
     return (uv_os_sock_t)newSocket;
 }
+#else
+// Duplicates the socket when compiling for Linux.
+uv_os_sock_t UVUtils::duplicateSocket_Linux(const uv_os_sock_t& socket)
+{
+    // We duplicate the file descriptor. The duplicate refers to the same open socket,
+    // so it stays connected when the original UV handle closes its descriptor, and any
+    // data the client has sent which we have not yet read stays queued on the socket.
+    // We set close-on-exec on the new descriptor, as libuv does for its own sockets...
+    auto newSocket = fcntl(socket, F_DUPFD_CLOEXEC, 0);
+    if (newSocket == -1)
+    {
+        auto error = errno;
+        throw Exception(Utils::format("fcntl(F_DUPFD_CLOEXEC) failed: %s", strerror(error)));
+    }
+
+    // We return the duplicated socket...
+    return (uv_os_sock_t)newSocket;
+}
+#endif
+
+// Returns true if listening sockets can share a port using SO_REUSEPORT with the
+// OS spreading incoming connections across them (see Socket::listen()).
+bool UVUtils::supportsReusePort()
+{
+    // libuv only supports UV_TCP_REUSEPORT on platforms where the OS balances
+    // connections across the sockets. (Windows does not support it at all.)
+#if defined(__linux__) || defined(__FreeBSD__) || defined(__DragonFly__)
+    return true;
+#else
+    return false;
+#endif
+}
 
 // Sets the thread name.
 void UVUtils::setThreadName(const std::string& threadName)
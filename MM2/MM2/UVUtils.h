@@ -21,46 +21,6 @@ namespace MessagingMesh
             std::string Service;   // Service or port
         };
 
-        // A UV write request plus the buffer it is writing.
-        struct WriteRequest
-        {
-            // Constructor from Buffer. 
-            // The buffer points to the data in the Buffer, and we hold a reference
-            // to the Buffer to ensure that its lifetime matches the write request.
-            WriteRequest(BufferPtr pBuffer) :
-                write_request{},
-                m_pBuffer(pBuffer)
-            {
-                buffer.base = pBuffer->getBuffer();
-                buffer.len = pBuffer->getBufferSize();
-            }
-
-            // Constructor specifying a buffer size.
-            // We allocate the buffer and release it in the destructor.
-            WriteRequest(size_t bufferSize) :
-                write_request{},
-                m_pBuffer(nullptr)
-            {
-                buffer.base = new char[bufferSize];
-                buffer.len = (ULONG)bufferSize;
-            }
-
-            // Destructor.
-            ~WriteRequest()
-            {
-                // If we allocated the buffer (ie, if we are not using the
-                // buffer from a Buffer), we release it.
-                if (!m_pBuffer)
-                {
-                    delete[] buffer.base;
-                }
-            }
-
-            uv_write_t write_request;
-            uv_buf_t buffer;
-            BufferPtr m_pBuffer;
-        };
-
     // Public functions...
     public:
         // Gets peer IP info for a tcp handle.
@@ -68,24 +28,24 @@ namespace MessagingMesh
         static IPInfo getPeerIPInfo(uv_tcp_t* pTCPHandle);
 
         // Allocates a buffer for a UV read from a socket.
+        // The buffer comes from the receive-buffer pool of the UVLoop which owns the handle.
         static void allocateBufferMemory(uv_handle_t* pHandle, size_t suggested_size, uv_buf_t* pBuffer);
 
-        // Releases a buffer.
+        // Releases a buffer, returning it to the pool it came from.
         static void releaseBufferMemory(const uv_buf_t* pBuffer);
 
-        // Allocates a write request.
-        static WriteRequest* allocateWriteRequest(BufferPtr pBuffer);
-
-        // Allocates a write request.
-        static WriteRequest* allocateWriteRequest(size_t bufferSize);
-
-        // Releases a write request.
-        static void releaseWriteRequest(WriteRequest* pWriteRequest);
-
         // Duplicates the socket.
         // Note: This has different implementations depending on the OS.
         static OSSocketHolderPtr duplicateSocket(const uv_os_sock_t& socket);
 
+        // Closes an OS socket which is not (or is no longer) owned by a UV handle,
+        // such as a duplicated socket which could not be opened by a UV handle.
+        static void closeSocket(const uv_os_sock_t& socket);
+
+        // Returns true if listening sockets can share a port using SO_REUSEPORT with the
+        // OS spreading incoming connections across them (see Socket::listen()).
+        static bool supportsReusePort();
+
         // Sets the thread name.
         static void setThreadName(const std::string& threadName);
 
@@ -94,8 +54,13 @@ namespace MessagingMesh
 
     // Private functions...
     private:
+#ifdef _WIN32
         // Duplicates the socket when compiling for Windows.
         static uv_os_sock_t duplicateSocket_Windows(const uv_os_sock_t& socket);
+#else
+        // Duplicates the socket when compiling for Linux.
+        static uv_os_sock_t duplicateSocket_Linux(const uv_os_sock_t& socket);
+#endif
     };
 } // namespace
 
@@ -56,7 +56,11 @@ std::string Utils::getTimeString()
 
     // convert to broken time
     std::tm bt;
+#ifdef _WIN32
     localtime_s(&bt, &timer);
+#else
+    localtime_r(&timer, &bt);
+#endif
 
     std::ostringstream oss;
     oss << std::put_time(&bt, "%H:%M:%S"); // HH:MM:SS
@@ -78,3 +82,13 @@ void Utils::sendNetworkMessage(const NetworkMessage& networkMessage, Socket* pSo
     networkMessage.serialize(*pBuffer);
     pSocket->write(pBuffer);
 }
+
+// Forwards a Buffer holding a serialized network-message to the socket, with the
+// subscription ID in its header replaced by the one specified. The Buffer is not
+// changed and is not re-serialized, so it can be forwarded to multiple sockets.
+void Utils::forwardNetworkMessage(const BufferPtr& pBuffer, uint32_t subscriptionID, const SocketPtr& pSocket)
+{
+    // Note: The subscription ID is written as-is as the messaging-mesh 
+    //       network protocol for uint32 is little-endian.
+    pSocket->write(pBuffer, NetworkMessageHeader::SUBSCRIPTION_ID_OFFSET, &subscriptionID, sizeof(subscriptionID));
+}
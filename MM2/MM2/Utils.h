@@ -1,4 +1,5 @@
 #pragma once
+#include <cstdint>
 #include <string>
 #include "SharedPointers.h"
 
@@ -26,6 +27,11 @@ namespace MessagingMesh
 
         // Sends a network-message to the socket.
         static void sendNetworkMessage(const NetworkMessage& networkMessage, Socket* pSocket);
+
+        // Forwards a Buffer holding a serialized network-message to the socket, with the
+        // subscription ID in its header replaced by the one specified. The Buffer is not
+        // changed and is not re-serialized, so it can be forwarded to multiple sockets.
+        static void forwardNetworkMessage(const BufferPtr& pBuffer, uint32_t subscriptionID, const SocketPtr& pSocket);
     };
 } // namespace
 
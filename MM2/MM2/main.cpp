@@ -1,10 +1,13 @@
 #include <iostream>
+#include <cstring>
 #include "Logger.h"
 #include "Gateway.h"
 #include "Utils.h"
 #include "Tests.h"
 #include "Connection.h"
 #include "Message.h"
+#include "Field.h"
+#include "FieldKey.h"
 #include "UVUtils.h"
 using namespace MessagingMesh;
 
@@ -21,7 +24,12 @@ void runClient()
     Connection connection("localhost", 5050, "VULCAN");
 
     // We make subscriptions...
-    auto s1 = connection.subscribe("A.B", nullptr);
+    auto s1 = connection.subscribe("A.B", [](const std::string& subject, const std::string& /*replySubject*/, MessagePtr pMessage)
+        {
+            static const FieldKey VALUE("VALUE");
+            auto value = pMessage->getField(VALUE)->getSignedInt32();
+            Logger::info(Utils::format("Received %s: VALUE=%d", subject.c_str(), value));
+        });
     auto s2 = connection.subscribe("C.D", nullptr);
 
     // We send updates...
@@ -49,6 +57,16 @@ int main(int argc, char** argv)
 {
     //Logger::registerCallback(onMessageLogged);
     //Tests::messageSerialization();
+    //Tests::messageLazyDeserialization();
+    //Tests::messageTypedFields();
+    //Tests::messageCompactEncoding();
+    //Tests::messageFieldNameDictionary();
+    //Tests::messageFieldLookup();
+    //Tests::networkMessageScanning();
+    //Tests::networkMessageHeader();
+    //Tests::bufferViewDetaching();
+    //Tests::slowConsumerConflation();
+    //Tests::subjectMatching();
 
     UVUtils::setThreadName("MAIN");
     Logger::registerCallback(onMessageLogged);